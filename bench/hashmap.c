@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "common.h"
+
+/*
+ * Compares cd_hashmap with the linear probing table it replaced (`% count`
+ * indexing, no stored hashes, grown after 64 probes). The new table is
+ * checked against a shadow set before timing.
+ *
+ * Usage: bench-hashmap [key count]
+ */
+
+typedef struct cd_bench_oldmap_s cd_bench_oldmap_t;
+typedef struct cd_bench_olditem_s cd_bench_olditem_t;
+
+struct cd_bench_olditem_s {
+  const char* key;
+  unsigned int key_len;
+  void* value;
+};
+
+struct cd_bench_oldmap_s {
+  unsigned int count;
+  cd_bench_olditem_t* items;
+  int ptr;
+};
+
+static const int kCDBenchDefaultKeys = 2000000;
+static const int kCDBenchOldMaxSkip = 64;
+static const int kCDBenchOldGrowRateLimit = 1048576;
+
+static double cd_bench_now(void);
+static int cd_bench_oldmap_init(cd_bench_oldmap_t* map,
+                                unsigned int count,
+                                int ptr);
+static void cd_bench_oldmap_destroy(cd_bench_oldmap_t* map);
+static uint32_t cd_bench_oldmap_index(cd_bench_oldmap_t* map,
+                                      const char* key,
+                                      unsigned int key_len);
+static int cd_bench_oldmap_insert(cd_bench_oldmap_t* map,
+                                  const char* key,
+                                  unsigned int key_len,
+                                  void* value);
+static void* cd_bench_oldmap_get(cd_bench_oldmap_t* map,
+                                 const char* key,
+                                 unsigned int key_len);
+static int cd_bench_verify(char** keys, int count);
+static int cd_bench_run(char** keys, void** ptrs, int count, int ptr);
+
+
+int main(int argc, char** argv) {
+  int count;
+  int i;
+  char** keys;
+  void** ptrs;
+  int r;
+
+  count = argc > 1 ? atoi(argv[1]) : kCDBenchDefaultKeys;
+  if (count <= 0) {
+    fprintf(stderr, "Usage: %s [key count]\n", argv[0]);
+    return 1;
+  }
+
+  keys = malloc(sizeof(*keys) * count);
+  ptrs = malloc(sizeof(*ptrs) * count);
+  if (keys == NULL || ptrs == NULL) {
+    fprintf(stderr, "Failed to allocate keys\n");
+    return 1;
+  }
+
+  /* Heap-like keys: short strings and 8-byte aligned addresses */
+  for (i = 0; i < count; i++) {
+    keys[i] = malloc(24);
+    if (keys[i] == NULL) {
+      fprintf(stderr, "Failed to allocate keys\n");
+      return 1;
+    }
+    snprintf(keys[i], 24, "key_%d_%x", i, i * 2654435761u);
+    ptrs[i] = (void*) (0x10000000UL + (unsigned long) i * 24);
+  }
+
+  r = cd_bench_verify(keys, count);
+  if (r == 0)
+    r = cd_bench_run(keys, (void**) keys, count, 0);
+  if (r == 0)
+    r = cd_bench_run(keys, ptrs, count, 1);
+
+  for (i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+  free(ptrs);
+
+  return r;
+}
+
+
+double cd_bench_now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+int cd_bench_oldmap_init(cd_bench_oldmap_t* map,
+                         unsigned int count,
+                         int ptr) {
+  map->items = calloc(count, sizeof(*map->items));
+  if (map->items == NULL)
+    return -1;
+
+  map->count = count;
+  map->ptr = ptr;
+
+  return 0;
+}
+
+
+void cd_bench_oldmap_destroy(cd_bench_oldmap_t* map) {
+  free(map->items);
+  map->items = NULL;
+}
+
+
+uint32_t cd_bench_oldmap_index(cd_bench_oldmap_t* map,
+                               const char* key,
+                               unsigned int key_len) {
+  if (map->ptr)
+    return cd_murmur3((const char*) &key, key_len) % map->count;
+  else
+    return cd_murmur3(key, key_len) % map->count;
+}
+
+
+int cd_bench_oldmap_insert(cd_bench_oldmap_t* map,
+                           const char* key,
+                           unsigned int key_len,
+                           void* value) {
+  uint32_t index;
+
+  do {
+    int skip;
+    cd_bench_olditem_t* items;
+    cd_bench_olditem_t* nitems;
+    unsigned int i;
+    unsigned int count;
+    unsigned int grow;
+
+    index = cd_bench_oldmap_index(map, key, key_len);
+    for (skip = 0;
+         skip < kCDBenchOldMaxSkip && map->items[index].key != NULL;
+         skip++) {
+      cd_bench_olditem_t* item;
+
+      item = &map->items[index];
+
+      /* Equal entries - update */
+      if (key_len == item->key_len &&
+          (map->ptr ? item->key == key :
+                      (memcmp(item->key, key, key_len) == 0))) {
+        break;
+      }
+
+      index = (index + 1) % map->count;
+    }
+
+    if (skip != kCDBenchOldMaxSkip)
+      break;
+
+    /* Grow is needed */
+    if ((int) map->count < kCDBenchOldGrowRateLimit)
+      grow = map->count;
+    else
+      grow = kCDBenchOldGrowRateLimit;
+
+    nitems = calloc(map->count + grow, sizeof(*nitems));
+    if (nitems == NULL)
+      return -1;
+
+    /* Rehash */
+    items = map->items;
+    count = map->count;
+
+    map->count += grow;
+    map->items = nitems;
+    for (i = 0; i < count; i++) {
+      if (items[i].key == NULL)
+        continue;
+      cd_bench_oldmap_insert(map,
+                             items[i].key,
+                             items[i].key_len,
+                             items[i].value);
+    }
+    free(items);
+  } while (1);
+
+  map->items[index].key = key;
+  map->items[index].key_len = key_len;
+  map->items[index].value = value;
+
+  return 0;
+}
+
+
+void* cd_bench_oldmap_get(cd_bench_oldmap_t* map,
+                          const char* key,
+                          unsigned int key_len) {
+  uint32_t index;
+
+  index = cd_bench_oldmap_index(map, key, key_len);
+  do {
+    cd_bench_olditem_t* item;
+
+    item = &map->items[index];
+
+    /* Not found */
+    if (item->key == NULL)
+      return NULL;
+
+    if (key_len == item->key_len &&
+        (map->ptr ? item->key == key :
+                    (memcmp(item->key, key, key_len) == 0))) {
+      return item->value;
+    }
+
+    index = (index + 1) % map->count;
+  } while (1);
+}
+
+
+/* Random inserts, deletes and lookups must agree with a shadow set */
+int cd_bench_verify(char** keys, int count) {
+  cd_hashmap_t map;
+  char* shadow;
+  int i;
+  int k;
+  int size;
+  unsigned int live;
+
+  size = count < 50000 ? count : 50000;
+  shadow = calloc(size, 1);
+  if (shadow == NULL || cd_hashmap_init(&map, 16, 0) != 0) {
+    fprintf(stderr, "Failed to allocate the map\n");
+    free(shadow);
+    return 1;
+  }
+
+  srand(1);
+  for (i = 0; i < 2000000; i++) {
+    int op;
+    void* value;
+
+    k = rand() % size;
+    op = rand() % 3;
+    if (op == 0) {
+      if (cd_hashmap_insert(&map,
+                            keys[k],
+                            strlen(keys[k]),
+                            (void*) (intptr_t) (k + 1)) != 0) {
+        break;
+      }
+      shadow[k] = 1;
+    } else if (op == 1) {
+      cd_hashmap_delete(&map, keys[k], strlen(keys[k]));
+      shadow[k] = 0;
+    } else {
+      value = cd_hashmap_get(&map, keys[k], strlen(keys[k]));
+      if ((value != NULL) != shadow[k] ||
+          (value != NULL && (intptr_t) value != k + 1)) {
+        break;
+      }
+    }
+  }
+
+  live = 0;
+  for (k = 0; k < size; k++)
+    live += shadow[k];
+  if (live != map.count)
+    i = -1;
+  cd_hashmap_destroy(&map);
+  free(shadow);
+
+  if (i != 2000000) {
+    fprintf(stderr, "cd_hashmap mismatch at op %d\n", i);
+    return 1;
+  }
+  fprintf(stdout, "verify ok\n");
+
+  return 0;
+}
+
+
+int cd_bench_run(char** keys, void** ptrs, int count, int ptr) {
+  cd_bench_oldmap_t old;
+  cd_hashmap_t map;
+  const char* name;
+  int i;
+  int j;
+  int hits;
+  double start;
+  double t[6];
+
+  name = ptr ? "ptr" : "str";
+  if (cd_bench_oldmap_init(&old, ptr ? 1024 : 65536, ptr) != 0)
+    return 1;
+  if (cd_hashmap_init(&map, ptr ? 1024 : 65536, ptr) != 0) {
+    cd_bench_oldmap_destroy(&old);
+    return 1;
+  }
+
+#define CD_BENCH_KEY(i) ((const char*) ptrs[(i)])
+#define CD_BENCH_LEN(i) (ptr ? 8 : (unsigned int) strlen(CD_BENCH_KEY(i)))
+
+  /* Misses are shifted pointers, or strings without their first char */
+#define CD_BENCH_MISS(i) CD_BENCH_KEY(i) + 1, CD_BENCH_LEN(i) - (ptr ? 0 : 1)
+
+  /* Insert, lookup hits in a scattered order, lookup misses */
+  start = cd_bench_now();
+  for (i = 0; i < count; i++)
+    cd_bench_oldmap_insert(&old, CD_BENCH_KEY(i), CD_BENCH_LEN(i), keys[i]);
+  t[0] = cd_bench_now() - start;
+
+  start = cd_bench_now();
+  for (i = 0; i < count; i++) {
+    j = (int) (((uint64_t) i * 7) % count);
+    if (cd_bench_oldmap_get(&old, CD_BENCH_KEY(j), CD_BENCH_LEN(j)) == NULL)
+      break;
+  }
+  t[1] = cd_bench_now() - start;
+  hits = i;
+
+  start = cd_bench_now();
+  for (i = 0; i < count; i++)
+    cd_bench_oldmap_get(&old, CD_BENCH_MISS(i));
+  t[2] = cd_bench_now() - start;
+
+  start = cd_bench_now();
+  for (i = 0; i < count; i++)
+    cd_hashmap_insert(&map, CD_BENCH_KEY(i), CD_BENCH_LEN(i), keys[i]);
+  t[3] = cd_bench_now() - start;
+
+  start = cd_bench_now();
+  for (i = 0; i < count; i++) {
+    j = (int) (((uint64_t) i * 7) % count);
+    if (cd_hashmap_get(&map, CD_BENCH_KEY(j), CD_BENCH_LEN(j)) == NULL)
+      break;
+  }
+  t[4] = cd_bench_now() - start;
+  hits += i;
+
+  start = cd_bench_now();
+  for (i = 0; i < count; i++)
+    cd_hashmap_get(&map, CD_BENCH_MISS(i));
+  t[5] = cd_bench_now() - start;
+
+#undef CD_BENCH_KEY
+#undef CD_BENCH_LEN
+#undef CD_BENCH_MISS
+
+  cd_bench_oldmap_destroy(&old);
+  cd_hashmap_destroy(&map);
+
+  if (hits != 2 * count) {
+    fprintf(stderr, "%s: inserted key not found\n", name);
+    return 1;
+  }
+
+  fprintf(stdout,
+          "%s keys: %d\n"
+          "  %-8s %10s %10s %10s\n"
+          "  %-8s %10.3f %10.3f %10.3f\n"
+          "  %-8s %10.3f %10.3f %10.3f\n",
+          name, count,
+          "", "insert", "get hit", "get miss",
+          "old", t[0], t[1], t[2],
+          "new", t[3], t[4], t[5]);
+
+  return 0;
+}
@@ -0,0 +1,279 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "strings.h"
+
+/*
+ * Throughput of cd_strings_print_json() over corpora of heap-like strings.
+ * Every file argument is an extra corpus with one string per line, the
+ * built-in ones are generated from a fixed seed.
+ *
+ * Usage: bench-strings [corpus file...]
+ */
+
+typedef struct cd_bench_corpus_s cd_bench_corpus_t;
+
+struct cd_bench_corpus_s {
+  const char* name;
+  char* data;
+  int* lens;
+  int count;
+  uint64_t bytes;
+};
+
+static const int kCDBenchStrings = 100000;
+static const int kCDBenchRounds = 10;
+static const unsigned int kCDBenchWritebufSize = 524288;
+
+static double cd_bench_now(void);
+static int cd_bench_gen(cd_bench_corpus_t* corpus,
+                        const char* name,
+                        const char* alphabet,
+                        int min_len,
+                        int max_len);
+static int cd_bench_load(cd_bench_corpus_t* corpus, const char* path);
+static int cd_bench_run(cd_bench_corpus_t* corpus, int fd);
+static void cd_bench_free(cd_bench_corpus_t* corpus);
+
+
+int main(int argc, char** argv) {
+  cd_bench_corpus_t corpus;
+  int fd;
+  int i;
+  int r;
+
+  fd = open("/dev/null", O_WRONLY);
+  if (fd == -1) {
+    perror("open(/dev/null)");
+    return 1;
+  }
+
+  /* Names and identifiers, prose, source code, heavy escapes, UTF-8 */
+  r = cd_bench_gen(&corpus,
+                   "ident",
+                   "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_$0123",
+                   4,
+                   24);
+  if (r == 0)
+    r = cd_bench_run(&corpus, fd);
+  if (r == 0) {
+    r = cd_bench_gen(&corpus,
+                     "prose",
+                     "eeeettaaoinshrdlucmfwypvbgkjqxz        ,.,.'\"",
+                     16,
+                     512);
+  }
+  if (r == 0)
+    r = cd_bench_run(&corpus, fd);
+  if (r == 0) {
+    r = cd_bench_gen(&corpus,
+                     "source",
+                     "function(x){return x+1;}\n\tvar a=\"b\";// c/d\n    ",
+                     32,
+                     1024);
+  }
+  if (r == 0)
+    r = cd_bench_run(&corpus, fd);
+  if (r == 0) {
+    r = cd_bench_gen(&corpus,
+                     "escapes",
+                     "\"\\/\b\f\n\r\t\x01\x1f" "abc",
+                     8,
+                     256);
+  }
+  if (r == 0)
+    r = cd_bench_run(&corpus, fd);
+  if (r == 0) {
+    r = cd_bench_gen(&corpus,
+                     "utf8",
+                     "\xc3\xa9\xc3\xbc\xd0\xb6\xd0\xb8 abcdef",
+                     16,
+                     512);
+  }
+  if (r == 0)
+    r = cd_bench_run(&corpus, fd);
+
+  for (i = 1; r == 0 && i < argc; i++) {
+    r = cd_bench_load(&corpus, argv[i]);
+    if (r == 0)
+      r = cd_bench_run(&corpus, fd);
+  }
+
+  close(fd);
+  return r;
+}
+
+
+double cd_bench_now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+int cd_bench_gen(cd_bench_corpus_t* corpus,
+                 const char* name,
+                 const char* alphabet,
+                 int min_len,
+                 int max_len) {
+  int i;
+  int j;
+  int alen;
+  char* p;
+
+  corpus->name = name;
+  corpus->count = kCDBenchStrings;
+  corpus->data = malloc((size_t) kCDBenchStrings * max_len);
+  corpus->lens = malloc(sizeof(*corpus->lens) * kCDBenchStrings);
+  corpus->bytes = 0;
+  if (corpus->data == NULL || corpus->lens == NULL) {
+    fprintf(stderr, "Failed to allocate corpus %s\n", name);
+    cd_bench_free(corpus);
+    return 1;
+  }
+
+  /* Random draws from `alphabet`, UTF-8 pairs are never split */
+  srand(1);
+  alen = strlen(alphabet);
+  p = corpus->data;
+  for (i = 0; i < corpus->count; i++) {
+    int len;
+
+    len = min_len + rand() % (max_len - min_len + 1);
+    for (j = 0; j < len; j++) {
+      int c;
+
+      c = rand() % alen;
+      if (((unsigned char) alphabet[c] & 0xc0) == 0x80)
+        c--;
+      if (((unsigned char) alphabet[c] & 0xe0) == 0xc0) {
+        if (j + 1 == len)
+          break;
+        p[j++] = alphabet[c++];
+      }
+      p[j] = alphabet[c];
+    }
+    corpus->lens[i] = j;
+    corpus->bytes += j;
+    p += j;
+  }
+
+  return 0;
+}
+
+
+int cd_bench_load(cd_bench_corpus_t* corpus, const char* path) {
+  FILE* fp;
+  long size;
+  char* p;
+  char* end;
+  int size_hint;
+
+  corpus->name = path;
+  corpus->data = NULL;
+  corpus->lens = NULL;
+  corpus->count = 0;
+  corpus->bytes = 0;
+
+  fp = fopen(path, "rb");
+  if (fp == NULL) {
+    perror(path);
+    return 1;
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0)
+    goto fail;
+  rewind(fp);
+
+  corpus->data = malloc(size + 1);
+  if (corpus->data == NULL)
+    goto fail;
+  if (fread(corpus->data, 1, size, fp) != (size_t) size)
+    goto fail;
+  fclose(fp);
+  fp = NULL;
+
+  /* One string per line, newlines are not part of them */
+  size_hint = 1;
+  end = corpus->data + size;
+  for (p = corpus->data; p != end; p++)
+    size_hint += *p == '\n';
+  corpus->lens = malloc(sizeof(*corpus->lens) * size_hint);
+  if (corpus->lens == NULL)
+    goto fail;
+
+  for (p = corpus->data; p != end; ) {
+    char* nl;
+
+    nl = memchr(p, '\n', end - p);
+    if (nl == NULL)
+      nl = end;
+    memmove(corpus->data + corpus->bytes, p, nl - p);
+    corpus->lens[corpus->count++] = nl - p;
+    corpus->bytes += nl - p;
+    p = nl == end ? end : nl + 1;
+  }
+
+  return 0;
+
+fail:
+  fprintf(stderr, "Failed to load corpus %s\n", path);
+  if (fp != NULL)
+    fclose(fp);
+  cd_bench_free(corpus);
+  return 1;
+}
+
+
+int cd_bench_run(cd_bench_corpus_t* corpus, int fd) {
+  cd_writebuf_t buf;
+  int round;
+  int i;
+  double start;
+  double elapsed;
+  uint64_t written;
+
+  if (cd_writebuf_init(&buf, fd, kCDBenchWritebufSize) != 0) {
+    cd_bench_free(corpus);
+    return 1;
+  }
+
+  start = cd_bench_now();
+  for (round = 0; round < kCDBenchRounds; round++) {
+    const char* p;
+
+    p = corpus->data;
+    for (i = 0; i < corpus->count; i++) {
+      cd_strings_print_json(&buf, p, corpus->lens[i]);
+      p += corpus->lens[i];
+    }
+  }
+  cd_writebuf_flush(&buf);
+  elapsed = cd_bench_now() - start;
+  written = buf.written;
+  cd_writebuf_destroy(&buf);
+
+  fprintf(stdout,
+          "%-12s %8d strings %10.1f MB in %9.1f MB out %8.1f MB/s\n",
+          corpus->name,
+          corpus->count,
+          corpus->bytes / 1e6,
+          written / 1e6 / kCDBenchRounds,
+          kCDBenchRounds * corpus->bytes / 1e6 / elapsed);
+
+  cd_bench_free(corpus);
+  return 0;
+}
+
+
+void cd_bench_free(cd_bench_corpus_t* corpus) {
+  free(corpus->data);
+  free(corpus->lens);
+  corpus->data = NULL;
+  corpus->lens = NULL;
+}
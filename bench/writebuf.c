@@ -0,0 +1,282 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+/*
+ * Output MB/s of snapshot node and edge rows, written with vsnprintf
+ * through cd_writebuf_put() (as before) and with cd_writebuf_put_int() and
+ * CD_WRITEBUF_PUT_LIT() (as now). Both must produce the same bytes.
+ *
+ * Usage: bench-writebuf [row count]
+ */
+
+typedef void (*cd_bench_row_cb)(cd_writebuf_t* buf,
+                                 const int* fields,
+                                 int count,
+                                 int last);
+
+static const int kCDBenchDefaultRows = 5000000;
+static const int kCDBenchVerifyRows = 100000;
+static const unsigned int kCDBenchWritebufSize = 524288;
+
+/* Same as kCDNodeFieldCount and kCDEdgeFieldCount */
+#define CD_BENCH_NODE_FIELDS 6
+#define CD_BENCH_EDGE_FIELDS 3
+
+static double cd_bench_now(void);
+static int* cd_bench_gen(int rows, int fields);
+static void cd_bench_row_fmt(cd_writebuf_t* buf,
+                             const int* fields,
+                             int count,
+                             int last);
+static void cd_bench_row_int(cd_writebuf_t* buf,
+                             const int* fields,
+                             int count,
+                             int last);
+static uint64_t cd_bench_write(int fd,
+                               const int* data,
+                               int rows,
+                               int fields,
+                               cd_bench_row_cb cb);
+static int cd_bench_verify(const int* data, int rows, int fields);
+static void cd_bench_run(const char* name,
+                         int fd,
+                         const int* data,
+                         int rows,
+                         int fields);
+
+
+int main(int argc, char** argv) {
+  int rows;
+  int fd;
+  int* nodes;
+  int* edges;
+  int r;
+
+  rows = argc > 1 ? atoi(argv[1]) : kCDBenchDefaultRows;
+  if (rows <= 0) {
+    fprintf(stderr, "Usage: %s [row count]\n", argv[0]);
+    return 1;
+  }
+
+  fd = open("/dev/null", O_WRONLY);
+  if (fd == -1) {
+    perror("open(/dev/null)");
+    return 1;
+  }
+
+  nodes = cd_bench_gen(rows, CD_BENCH_NODE_FIELDS);
+  edges = cd_bench_gen(rows, CD_BENCH_EDGE_FIELDS);
+  if (nodes == NULL || edges == NULL) {
+    fprintf(stderr, "Failed to allocate rows\n");
+    r = 1;
+    goto done;
+  }
+
+  r = cd_bench_verify(nodes, rows, CD_BENCH_NODE_FIELDS);
+  if (r == 0)
+    r = cd_bench_verify(edges, rows, CD_BENCH_EDGE_FIELDS);
+  if (r != 0)
+    goto done;
+
+  cd_bench_run("nodes", fd, nodes, rows, CD_BENCH_NODE_FIELDS);
+  cd_bench_run("edges", fd, edges, rows, CD_BENCH_EDGE_FIELDS);
+
+done:
+  free(nodes);
+  free(edges);
+  close(fd);
+  return r;
+}
+
+
+double cd_bench_now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/* Field values of the magnitudes seen in real snapshots */
+int* cd_bench_gen(int rows, int fields) {
+  int* data;
+  int i;
+  int j;
+
+  data = malloc(sizeof(*data) * rows * fields);
+  if (data == NULL)
+    return NULL;
+
+  srand(1);
+  for (i = 0; i < rows; i++) {
+    int* row;
+
+    row = &data[i * fields];
+    for (j = 0; j < fields; j++) {
+      switch (j) {
+        case 0: row[j] = rand() % 14; break;
+        case 1: row[j] = rand() % 1000000; break;
+        case 2: row[j] = fields == CD_BENCH_EDGE_FIELDS ?
+                         (rand() % rows) * CD_BENCH_NODE_FIELDS :
+                         i * 2 + 1;
+                break;
+        case 3: row[j] = 16 + (rand() % 64) * 8; break;
+        case 4: row[j] = rand() % 16; break;
+        default: row[j] = 0; break;
+      }
+    }
+  }
+
+  return data;
+}
+
+
+void cd_bench_row_fmt(cd_writebuf_t* buf,
+                      const int* fields,
+                      int count,
+                      int last) {
+  if (count == CD_BENCH_NODE_FIELDS) {
+    cd_writebuf_put(buf,
+                    "    %d, %d, %d, %d, %d, %d",
+                    fields[0],
+                    fields[1],
+                    fields[2],
+                    fields[3],
+                    fields[4],
+                    fields[5]);
+  } else {
+    cd_writebuf_put(buf, "    %d, %d, %d", fields[0], fields[1], fields[2]);
+  }
+
+  if (last)
+    cd_writebuf_put(buf, "\n");
+  else
+    cd_writebuf_put(buf, ",\n");
+}
+
+
+/* Same as cd_snapshot_json_row() */
+void cd_bench_row_int(cd_writebuf_t* buf,
+                      const int* fields,
+                      int count,
+                      int last) {
+  int i;
+
+  CD_WRITEBUF_PUT_LIT(buf, "    ");
+  for (i = 0; i < count; i++) {
+    if (i != 0)
+      CD_WRITEBUF_PUT_LIT(buf, ", ");
+    cd_writebuf_put_int(buf, fields[i]);
+  }
+
+  if (last)
+    CD_WRITEBUF_PUT_LIT(buf, "\n");
+  else
+    CD_WRITEBUF_PUT_LIT(buf, ",\n");
+}
+
+
+uint64_t cd_bench_write(int fd,
+                        const int* data,
+                        int rows,
+                        int fields,
+                        cd_bench_row_cb cb) {
+  cd_writebuf_t buf;
+  uint64_t written;
+  int i;
+
+  if (cd_writebuf_init(&buf, fd, kCDBenchWritebufSize) != 0)
+    return 0;
+
+  for (i = 0; i < rows; i++)
+    cb(&buf, &data[i * fields], fields, i == rows - 1);
+  cd_writebuf_flush(&buf);
+
+  written = buf.written;
+  cd_writebuf_destroy(&buf);
+  return written;
+}
+
+
+int cd_bench_verify(const int* data, int rows, int fields) {
+  FILE* fmt;
+  FILE* raw;
+  uint64_t fmt_size;
+  uint64_t raw_size;
+  int r;
+
+  if (rows > kCDBenchVerifyRows)
+    rows = kCDBenchVerifyRows;
+
+  fmt = tmpfile();
+  raw = tmpfile();
+  if (fmt == NULL || raw == NULL) {
+    perror("tmpfile()");
+    r = 1;
+    goto done;
+  }
+
+  fmt_size = cd_bench_write(fileno(fmt), data, rows, fields, cd_bench_row_fmt);
+  raw_size = cd_bench_write(fileno(raw), data, rows, fields, cd_bench_row_int);
+
+  /* Compare the two files */
+  r = fmt_size == 0 || fmt_size != raw_size;
+  rewind(fmt);
+  rewind(raw);
+  while (r == 0) {
+    char a[4096];
+    char b[4096];
+    size_t alen;
+    size_t blen;
+
+    alen = fread(a, 1, sizeof(a), fmt);
+    blen = fread(b, 1, sizeof(b), raw);
+    if (alen != blen || memcmp(a, b, alen) != 0)
+      r = 1;
+    if (alen == 0)
+      break;
+  }
+  if (r != 0)
+    fprintf(stderr, "Output of %d-field rows differs\n", fields);
+
+done:
+  if (fmt != NULL)
+    fclose(fmt);
+  if (raw != NULL)
+    fclose(raw);
+  return r;
+}
+
+
+void cd_bench_run(const char* name,
+                  int fd,
+                  const int* data,
+                  int rows,
+                  int fields) {
+  double start;
+  double fmt_time;
+  double raw_time;
+  uint64_t size;
+
+  start = cd_bench_now();
+  size = cd_bench_write(fd, data, rows, fields, cd_bench_row_fmt);
+  fmt_time = cd_bench_now() - start;
+
+  start = cd_bench_now();
+  cd_bench_write(fd, data, rows, fields, cd_bench_row_int);
+  raw_time = cd_bench_now() - start;
+
+  fprintf(stdout,
+          "%-6s %9d rows %8.1f MB  vsnprintf %8.1f MB/s  put_int %8.1f MB/s\n",
+          name,
+          rows,
+          size / 1e6,
+          size / 1e6 / fmt_time,
+          size / 1e6 / raw_time);
+}
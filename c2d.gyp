@@ -4,12 +4,14 @@
     "type": "executable",
     "include_dirs": [ "src" ],
     "sources": [
+      "src/cache.c",
       "src/common.c",
       "src/collector.c",
       "src/cli.c",
       "src/error.c",
       "src/obj.c",
       "src/obj/dwarf.c",
+      "src/snapshot.c",
       "src/strings.c",
       "src/v8constants.c",
       "src/v8helpers.c",
@@ -27,6 +29,61 @@
         "sources": [
           "src/obj/elf.c",
         ],
+        "libraries": [
+          "-lpthread",
+        ],
+      }],
+    ],
+  }, {
+    # Throughput of the JSON string escaper, see bench/strings.c
+    "target_name": "bench-strings",
+    "type": "executable",
+    "include_dirs": [ "src" ],
+    "sources": [
+      "bench/strings.c",
+      "src/common.c",
+      "src/error.c",
+      "src/strings.c",
+    ],
+    "conditions": [
+      ["OS == 'linux' or OS == 'freebsd'", {
+        "libraries": [
+          "-lpthread",
+        ],
+      }],
+    ],
+  }, {
+    # cd_hashmap against the table it replaced, see bench/hashmap.c
+    "target_name": "bench-hashmap",
+    "type": "executable",
+    "include_dirs": [ "src" ],
+    "sources": [
+      "bench/hashmap.c",
+      "src/common.c",
+      "src/error.c",
+    ],
+    "conditions": [
+      ["OS == 'linux' or OS == 'freebsd'", {
+        "libraries": [
+          "-lpthread",
+        ],
+      }],
+    ],
+  }, {
+    # Snapshot rows via vsnprintf and via put_int, see bench/writebuf.c
+    "target_name": "bench-writebuf",
+    "type": "executable",
+    "include_dirs": [ "src" ],
+    "sources": [
+      "bench/writebuf.c",
+      "src/common.c",
+      "src/error.c",
+    ],
+    "conditions": [
+      ["OS == 'linux' or OS == 'freebsd'", {
+        "libraries": [
+          "-lpthread",
+        ],
       }],
     ],
   }, {
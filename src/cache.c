@@ -0,0 +1,259 @@
+#include "cache.h"
+#include "common.h"
+#include "error.h"
+#include "obj.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+typedef struct cd_cache_header_s cd_cache_header_t;
+
+struct cd_cache_header_s {
+  char magic[8];
+  uint32_t version;
+  uint32_t kind;
+  uint64_t file_size;
+  uint32_t build_id_len;
+  uint32_t reserved;
+  uint64_t size;
+  unsigned char build_id[CD_CACHE_MAX_BUILD_ID];
+};
+
+static cd_error_t cd_cache_header(struct cd_obj_s* obj,
+                                  cd_cache_kind_t kind,
+                                  cd_cache_header_t* header);
+static cd_error_t cd_cache_path(struct cd_obj_s* obj,
+                                cd_cache_header_t* header,
+                                char* path,
+                                unsigned int size);
+
+
+static const int kCDCacheBufSize = 65536;
+static const char* kCDCacheExt[] = { NULL, "syms", "fdes", "v8" };
+
+
+cd_error_t cd_cache_header(cd_obj_t* obj,
+                           cd_cache_kind_t kind,
+                           cd_cache_header_t* header) {
+  cd_error_t err;
+  void* id;
+  int len;
+
+  if (obj->cache_dir == NULL || cd_obj_is_core(obj))
+    return cd_error_str(kCDErrNotFound, "cache dir");
+
+  err = cd_obj_get_build_id(obj, &id, &len);
+  if (!cd_is_ok(err))
+    return err;
+  if (len <= 0 || len > CD_CACHE_MAX_BUILD_ID)
+    return cd_error_str(kCDErrNotFound, "build-id length");
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, CD_CACHE_MAGIC, sizeof(header->magic));
+  header->version = CD_CACHE_VERSION;
+  header->kind = kind;
+  header->file_size = obj->size;
+  header->build_id_len = len;
+  memcpy(header->build_id, id, len);
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_cache_path(cd_obj_t* obj,
+                         cd_cache_header_t* header,
+                         char* path,
+                         unsigned int size) {
+  static const char hex[] = "0123456789abcdef";
+  char id[CD_CACHE_MAX_BUILD_ID * 2 + 1];
+  uint32_t i;
+  int r;
+
+  for (i = 0; i < header->build_id_len; i++) {
+    id[i * 2] = hex[header->build_id[i] >> 4];
+    id[i * 2 + 1] = hex[header->build_id[i] & 0xf];
+  }
+  id[i * 2] = '\0';
+
+  r = snprintf(path,
+               size,
+               "%s/%s.%s",
+               obj->cache_dir,
+               id,
+               kCDCacheExt[header->kind]);
+  if (r < 0 || (unsigned int) r >= size)
+    return cd_error_str(kCDErrNotFound, "cache path");
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_cache_open(cd_obj_t* obj,
+                         cd_cache_kind_t kind,
+                         cd_cache_t* cache) {
+  cd_error_t err;
+  cd_cache_header_t expected;
+  cd_cache_header_t* header;
+  struct stat sbuf;
+  char path[1024];
+  int fd;
+
+  err = cd_cache_header(obj, kind, &expected);
+  if (!cd_is_ok(err))
+    return err;
+  err = cd_cache_path(obj, &expected, path, sizeof(path));
+  if (!cd_is_ok(err))
+    return err;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return cd_error_num(kCDErrNotFound, errno);
+
+  if (fstat(fd, &sbuf) != 0) {
+    err = cd_error_num(kCDErrNotFound, errno);
+    goto done;
+  }
+
+  if ((uint64_t) sbuf.st_size < sizeof(*header)) {
+    err = cd_error_str(kCDErrNotFound, "cache header");
+    goto done;
+  }
+
+  cache->size = sbuf.st_size;
+  cache->addr = mmap(NULL, cache->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (cache->addr == MAP_FAILED) {
+    err = cd_error_num(kCDErrNotFound, errno);
+    goto done;
+  }
+
+  /* Stale, or written by a different version */
+  header = cache->addr;
+  expected.size = header->size;
+  if (memcmp(header, &expected, sizeof(expected)) != 0 ||
+      header->size != cache->size - sizeof(*header)) {
+    munmap(cache->addr, cache->size);
+    err = cd_error_str(kCDErrNotFound, "cache header");
+    goto done;
+  }
+
+  cache->data = (char*) cache->addr + sizeof(*header);
+  cache->data_size = header->size;
+  err = cd_ok();
+
+done:
+  close(fd);
+  return err;
+}
+
+
+void cd_cache_close(cd_cache_t* cache) {
+  munmap(cache->addr, cache->size);
+  cache->addr = NULL;
+  cache->data = NULL;
+}
+
+
+cd_error_t cd_cache_begin(cd_obj_t* obj,
+                          cd_cache_kind_t kind,
+                          cd_cache_writer_t* writer) {
+  cd_error_t err;
+  cd_cache_header_t header;
+  int fd;
+  int r;
+
+  err = cd_cache_header(obj, kind, &header);
+  if (!cd_is_ok(err))
+    return err;
+  err = cd_cache_path(obj, &header, writer->path, sizeof(writer->path));
+  if (!cd_is_ok(err))
+    return err;
+
+  /* Written aside, and renamed once complete */
+  r = snprintf(writer->tmp,
+               sizeof(writer->tmp),
+               "%s.%d",
+               writer->path,
+               (int) getpid());
+  if (r < 0 || (unsigned int) r >= sizeof(writer->tmp))
+    return cd_error_str(kCDErrNotFound, "cache path");
+
+  if (mkdir(obj->cache_dir, 0755) != 0 && errno != EEXIST)
+    return cd_error_num(kCDErrFileNotFound, errno);
+
+  fd = open(writer->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return cd_error_num(kCDErrFileNotFound, errno);
+
+  if (cd_writebuf_init(&writer->buf, fd, kCDCacheBufSize) != 0) {
+    close(fd);
+    unlink(writer->tmp);
+    return cd_error_str(kCDErrNoMem, "cd_writebuf_t");
+  }
+
+  writer->obj = obj;
+  writer->kind = kind;
+
+  /* Size is filled in by `cd_cache_end` */
+  cd_writebuf_put_raw(&writer->buf, (char*) &header, sizeof(header));
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_cache_end(cd_cache_writer_t* writer) {
+  static const char zero[8];
+  cd_error_t err;
+  cd_cache_header_t header;
+  uint64_t size;
+  int fd;
+
+  fd = writer->buf.fd;
+
+  size = writer->buf.written + writer->buf.off;
+  if ((size & 7) != 0) {
+    cd_writebuf_put_raw(&writer->buf, zero, 8 - (size & 7));
+    size = (size + 7) & ~7ULL;
+  }
+  cd_writebuf_flush(&writer->buf);
+  cd_writebuf_destroy(&writer->buf);
+
+  err = cd_cache_header(writer->obj, writer->kind, &header);
+  if (!cd_is_ok(err))
+    goto fatal;
+
+  header.size = size - sizeof(header);
+  if (lseek(fd, 0, SEEK_END) != (off_t) size ||
+      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    err = cd_error_num(kCDErrFileNotFound, errno);
+    goto fatal;
+  }
+
+  if (close(fd) != 0) {
+    fd = -1;
+    err = cd_error_num(kCDErrFileNotFound, errno);
+    goto fatal;
+  }
+  fd = -1;
+
+  if (rename(writer->tmp, writer->path) != 0) {
+    err = cd_error_num(kCDErrFileNotFound, errno);
+    goto fatal;
+  }
+
+  return cd_ok();
+
+fatal:
+  if (fd != -1)
+    close(fd);
+  unlink(writer->tmp);
+  return err;
+}
@@ -0,0 +1,71 @@
+#ifndef SRC_CACHE_H_
+#define SRC_CACHE_H_
+
+#include "common.h"
+#include "error.h"
+
+#include <stdint.h>
+
+/* Forward-declarations */
+struct cd_obj_s;
+
+/*
+ * On-disk cache of the data parsed out of an object, a file per object and
+ * kind: `<dir>/<hex build-id>.<kind>`. The file is used only if both the
+ * build-id and the size of the object match the ones in the header.
+ *
+ *   header (104 bytes, host byte order):
+ *     char magic[8] = "C2DCACHE"
+ *     u32 version, kind
+ *     u64 file_size
+ *     u32 build_id_len, reserved
+ *     u64 size
+ *     u8 build_id[64]
+ *   payload: `size` bytes, specific to the kind
+ *
+ * The payload is 8-byte aligned, so it is mmap()-ed and used as is.
+ */
+
+#define CD_CACHE_MAGIC "C2DCACHE"
+#define CD_CACHE_VERSION 1
+#define CD_CACHE_MAX_BUILD_ID 64
+
+typedef struct cd_cache_s cd_cache_t;
+typedef struct cd_cache_writer_s cd_cache_writer_t;
+typedef enum cd_cache_kind_e cd_cache_kind_t;
+
+enum cd_cache_kind_e {
+  kCDCacheSyms = 1,
+  kCDCacheFDEs = 2,
+  kCDCacheV8 = 3
+};
+
+struct cd_cache_s {
+  void* addr;
+  uint64_t size;
+
+  char* data;
+  uint64_t data_size;
+};
+
+struct cd_cache_writer_s {
+  struct cd_obj_s* obj;
+  cd_cache_kind_t kind;
+  char path[1024];
+  char tmp[1024];
+  cd_writebuf_t buf;
+};
+
+/* Map the payload, `kCDErrNotFound` if there is no valid cache */
+cd_error_t cd_cache_open(struct cd_obj_s* obj,
+                         cd_cache_kind_t kind,
+                         cd_cache_t* cache);
+void cd_cache_close(cd_cache_t* cache);
+
+/* Payload is written with `cd_writebuf_put_*` to `writer->buf` */
+cd_error_t cd_cache_begin(struct cd_obj_s* obj,
+                          cd_cache_kind_t kind,
+                          cd_cache_writer_t* writer);
+cd_error_t cd_cache_end(cd_cache_writer_t* writer);
+
+#endif  /* SRC_CACHE_H_ */
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include <unistd.h>
 
 #include "error.h"
@@ -12,6 +13,7 @@
 #include "obj/mach.h"
 #include "obj/elf.h"
 #include "obj.h"
+#include "snapshot.h"
 #include "strings.h"
 #include "version.h"
 #include "visitor.h"
@@ -24,21 +26,29 @@ struct cd_argv_s {
   const char* core;
   const char* binary;
   const char* output;
+  const char* convert;
+  const char* cache_dir;
+  cd_snapshot_format_t format;
   int trace;
   int thread_id;
+  int all_threads;
+  int jobs;
+  int stats;
+  int full_heap;
   intptr_t inspect;
 };
 
 static cd_error_t run(cd_argv_t* argv);
 static cd_error_t cd_obj2json(int output, cd_argv_t* argv);
-static cd_error_t cd_print_dump(cd_state_t* state, cd_writebuf_t* buf);
+static cd_error_t cd_convert(int output, cd_argv_t* argv);
 static cd_error_t cd_print_trace(cd_state_t* state, cd_writebuf_t* buf);
-static void cd_print_nodes(cd_state_t* state, cd_writebuf_t* buf);
-static void cd_print_edges(cd_state_t* state, cd_writebuf_t* buf);
+static void cd_print_stats(cd_state_t* state,
+                           cd_writebuf_t* buf,
+                           struct timeval* start);
 
 
-static const int kCDNodeFieldCount = 6;
 static const int kCDOutputBufSize = 524288;  /* 512kb */
+static const int kCDArenaSlabSize = 1048576;  /* 1mb */
 
 
 void cd_print_version() {
@@ -58,6 +68,13 @@ void cd_print_help(const char* name) {
               " --help, -h              Print this message\n"
               " --trace, -t             Print only a stack trace\n"
               " --thread-id=num         Id of thread in core file to use\n"
+              " --all-threads           Use stacks of all threads\n"
+              " --jobs N, -j N          Number of heap traversal threads\n"
+              " --stats                 Print allocation stats to stderr\n"
+              " --format=FMT, -f FMT    Output format: json, binary\n"
+              " --convert=PATH          Print binary snapshot as JSON\n"
+              " --full-heap             Walk all heap pages, not only roots\n"
+              " --cache-dir=PATH        Cache parsed symbols by build-id\n"
               " --core PATH, -c PATH    Specify core file (Required)\n"
               " --binary PATH, -b PATH  Specify binary\n"
               " --output PATH, -o PATH  Specify output    (Default: stdout)\n",
@@ -66,6 +83,11 @@ void cd_print_help(const char* name) {
 
 
 #define CD_THREAD_ID_CMD 0x1000
+#define CD_STATS_CMD 0x1001
+#define CD_CONVERT_CMD 0x1002
+#define CD_FULL_HEAP_CMD 0x1003
+#define CD_ALL_THREADS_CMD 0x1004
+#define CD_CACHE_DIR_CMD 0x1005
 
 
 int main(int argc, char** argv) {
@@ -78,6 +100,13 @@ int main(int argc, char** argv) {
     { "trace", 5, NULL, 't' },
     { "thread-id", 6, NULL, CD_THREAD_ID_CMD },
     { "inspect", 7, NULL, 'i' },
+    { "jobs", 8, NULL, 'j' },
+    { "stats", 9, NULL, CD_STATS_CMD },
+    { "format", 10, NULL, 'f' },
+    { "convert", 11, NULL, CD_CONVERT_CMD },
+    { "full-heap", 12, NULL, CD_FULL_HEAP_CMD },
+    { "all-threads", 13, NULL, CD_ALL_THREADS_CMD },
+    { "cache-dir", 14, NULL, CD_CACHE_DIR_CMD },
   };
   int c;
   cd_argv_t cargv;
@@ -86,7 +115,7 @@ int main(int argc, char** argv) {
   memset(&cargv, 0, sizeof(cargv));
 
   do {
-    c = getopt_long(argc, argv, "hvtc:b:o:i:", long_options, NULL);
+    c = getopt_long(argc, argv, "hvtc:b:o:i:j:f:", long_options, NULL);
     switch (c) {
       case 'v':
         cd_print_version();
@@ -113,6 +142,47 @@ int main(int argc, char** argv) {
         }
         cargv.thread_id = atoi(optarg);
         break;
+      case 'j':
+        cargv.jobs = atoi(optarg);
+        break;
+      case CD_STATS_CMD:
+        cargv.stats = 1;
+        break;
+      case 'f':
+        if (optarg == NULL) {
+          cd_print_help(argv[0]);
+          return 0;
+        }
+        if (strcmp(optarg, "binary") == 0) {
+          cargv.format = kCDSnapshotBinary;
+        } else if (strcmp(optarg, "json") == 0) {
+          cargv.format = kCDSnapshotJSON;
+        } else {
+          cd_print_help(argv[0]);
+          fprintf(stderr, "\nUnknown format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case CD_FULL_HEAP_CMD:
+        cargv.full_heap = 1;
+        break;
+      case CD_ALL_THREADS_CMD:
+        cargv.all_threads = 1;
+        break;
+      case CD_CACHE_DIR_CMD:
+        if (optarg == NULL) {
+          cd_print_help(argv[0]);
+          return 0;
+        }
+        cargv.cache_dir = optarg;
+        break;
+      case CD_CONVERT_CMD:
+        if (optarg == NULL) {
+          cd_print_help(argv[0]);
+          return 0;
+        }
+        cargv.convert = optarg;
+        break;
       case 'i':
         cargv.inspect = cd_str_to_addr(optarg);
       default:
@@ -121,7 +191,7 @@ int main(int argc, char** argv) {
     }
   } while (c != -1);
 
-  if (cargv.core == NULL) {
+  if (cargv.core == NULL && cargv.convert == NULL) {
     cd_print_help(argv[0]);
     fprintf(stderr, "\nCore is a required argument\n");
     return 1;
@@ -141,6 +211,11 @@ int main(int argc, char** argv) {
 
 
 #undef CD_THREAD_ID_CMD
+#undef CD_STATS_CMD
+#undef CD_CONVERT_CMD
+#undef CD_FULL_HEAP_CMD
+#undef CD_ALL_THREADS_CMD
+#undef CD_CACHE_DIR_CMD
 
 
 /* Open files and execute obj2json */
@@ -152,7 +227,10 @@ cd_error_t run(cd_argv_t* argv) {
   if (output == -1)
     return cd_error_num(kCDErrFileNotFound, errno);
 
-  err = cd_obj2json(output, argv);
+  if (argv->convert != NULL)
+    err = cd_convert(output, argv);
+  else
+    err = cd_obj2json(output, argv);
 
   /* Clean-up */
   close(output);
@@ -165,6 +243,7 @@ cd_error_t cd_obj2json(int output, cd_argv_t* argv) {
   cd_state_t state;
   cd_writebuf_t buf;
   cd_obj_method_t* method;
+  struct timeval start;
 
 #if defined(__APPLE__)
   method = cd_mach_obj_method;
@@ -176,12 +255,18 @@ cd_error_t cd_obj2json(int output, cd_argv_t* argv) {
 #endif
 
   state.thread_id = argv->thread_id;
+  state.all_threads = argv->all_threads;
+  state.trace = argv->trace;
+  state.jobs = argv->jobs > 1 ? argv->jobs : 1;
+  cd_arena_init(&state.arena, kCDArenaSlabSize);
 
   state.core = cd_obj_new(method, argv->core, &err);
   if (!cd_is_ok(err))
     goto fatal;
 
   state.ptr_size = cd_obj_is_x64(state.core) ? 8 : 4;
+  if (argv->cache_dir != NULL)
+    cd_obj_set_cache_dir(state.core, argv->cache_dir);
 
   if (argv->binary != NULL) {
     cd_obj_t* binary;
@@ -195,6 +280,8 @@ cd_error_t cd_obj2json(int output, cd_argv_t* argv) {
       cd_obj_free(binary);
       goto failed_cd_strings_init;
     }
+    if (argv->cache_dir != NULL)
+      cd_obj_set_cache_dir(binary, argv->cache_dir);
   }
 
   state.output = output;
@@ -211,14 +298,19 @@ cd_error_t cd_obj2json(int output, cd_argv_t* argv) {
   if (!cd_is_ok(err))
     goto failed_v8_init;
 
-  err = cd_visitor_init(&state);
-  if (!cd_is_ok(err))
-    goto failed_visitor_init;
+  /* Stack trace needs no heap nodes */
+  if (!state.trace) {
+    err = cd_visitor_init(&state);
+    if (!cd_is_ok(err))
+      goto failed_visitor_init;
+  }
 
   if (argv->inspect != 0)
     err = cd_collect_addr(&state, argv->inspect);
   else
     err = cd_collect_roots(&state);
+  if (cd_is_ok(err) && argv->full_heap && !argv->trace)
+    err = cd_collect_heap(&state);
   if (!cd_is_ok(err))
     goto failed_collect_roots;
 
@@ -228,24 +320,30 @@ cd_error_t cd_obj2json(int output, cd_argv_t* argv) {
   }
 
   if (argv->trace) {
+    gettimeofday(&start, NULL);
     err = cd_print_trace(&state, &buf);
   } else {
     err = cd_visit_roots(&state);
     if (!cd_is_ok(err))
       goto failed_visit_roots;
 
-    err = cd_print_dump(&state, &buf);
+    gettimeofday(&start, NULL);
+    err = cd_snapshot_write(&state, &buf, argv->format);
   }
   if (!cd_is_ok(err))
     goto failed_visit_roots;
 
   cd_writebuf_flush(&buf);
 
+  if (argv->stats)
+    cd_print_stats(&state, &buf, &start);
+
 failed_visit_roots:
   cd_writebuf_destroy(&buf);
 
 failed_collect_roots:
-  cd_visitor_destroy(&state);
+  if (!state.trace)
+    cd_visitor_destroy(&state);
 
 failed_visitor_init:
   cd_collector_destroy(&state);
@@ -257,165 +355,81 @@ failed_cd_strings_init:
   cd_obj_free(state.core);
 
 fatal:
+  cd_arena_destroy(&state.arena);
   return err;
 }
 
 
-cd_error_t cd_print_dump(cd_state_t* state, cd_writebuf_t* buf) {
-  /* XXX Could be in a separate file */
-  cd_writebuf_put(
-      buf,
-      "{\n"
-      "  \"snapshot\": {\n"
-      "    \"title\": \"heapdump by core2dump\",\n"
-      "    \"uid\": %d,\n"
-      "    \"meta\": {\n"
-      "      \"node_fields\": [\n"
-      "        \"type\", \"name\", \"id\", \"self_size\", \"edge_count\",\n"
-      "        \"trace_node_id\"\n"
-      "      ],\n"
-      "      \"node_types\": [\n"
-      "        [ \"hidden\", \"array\", \"string\", \"object\", \"code\",\n"
-      "          \"closure\", \"regexp\", \"number\", \"native\",\n"
-      "          \"synthetic\", \"concatenated string\", \"sliced string\" ],\n"
-      "        \"string\", \"number\", \"number\", \"number\", \"number\",\n"
-      "        \"number\"\n"
-      "      ],\n"
-      "      \"edge_fields\": [ \"type\", \"name_or_index\", \"to_node\" ],\n"
-      "      \"edge_types\": [\n"
-      "        [ \"context\", \"element\", \"property\", \"internal\",\n"
-      "          \"hidden\", \"shortcut\", \"weak\" ],\n"
-      "        \"string_or_number\", \"node\"\n"
-      "      ],\n"
-      "      \"trace_function_info_fields\": [\n"
-      "        \"function_id\", \"name\", \"script_name\", \"script_id\",\n"
-      "        \"line\", \"column\"\n"
-      "      ],\n"
-      "      \"trace_node_fields\": [\n"
-      "        \"id\", \"function_info_index\", \"count\", \"size\",\n"
-      "        \"children\"\n"
-      "      ]\n"
-      "    },\n"
-      "    \"node_count\": %d,\n"
-      "    \"edge_count\": %d,\n"
-      "    \"trace_function_count\": %d\n"
-      "  },\n",
-      42,
-      state->nodes.id,
-      state->edges.count,
-      0);
-
-  /* Print all accumulated nodes */
-  cd_writebuf_put(buf, "  \"nodes\": [\n");
-  cd_print_nodes(state, buf);
-  cd_writebuf_put(buf, "  ],\n");
-
-  /* Print all accumulated edges */
-  cd_writebuf_put(buf, "  \"edges\": [\n");
-  cd_print_edges(state, buf);
-  cd_writebuf_put(buf, "  ],\n");
-
-  cd_writebuf_put(
-      buf,
-      "  \"trace_function_infos\": [],\n"
-      "  \"trace_tree\": [],\n");
-
-  /* Print all accumulated strings */
-  cd_writebuf_put(buf, "  \"strings\": [ ");
-  cd_strings_print(&state->strings, buf);
-  cd_writebuf_put(buf, " ]\n");
-  cd_writebuf_put(buf, "}\n");
-
-  return cd_ok();
-}
-
-
-void cd_print_nodes(cd_state_t* state, cd_writebuf_t* buf) {
-  QUEUE* q;
+cd_error_t cd_convert(int output, cd_argv_t* argv) {
+  cd_error_t err;
+  cd_writebuf_t buf;
 
-  QUEUE_FOREACH(q, &state->nodes.list) {
-    cd_node_t* node;
+  if (cd_writebuf_init(&buf, output, kCDOutputBufSize) != 0)
+    return cd_error_str(kCDErrNoMem, "cd_writebuf_t");
 
-    node = container_of(q, cd_node_t, member);
+  err = cd_snapshot_convert(argv->convert, &buf);
+  if (cd_is_ok(err))
+    cd_writebuf_flush(&buf);
 
-    cd_writebuf_put(
-        buf,
-        "    %d, %d, %d, %d, %d, %d",
-        node->type,
-        node->name,
-        node->id,
-        node->size,
-        node->edges.outgoing_count,
-        0);
-
-    if (q != QUEUE_PREV(&state->nodes.list))
-      cd_writebuf_put(buf, ",\n");
-    else
-      cd_writebuf_put(buf, "\n");
-  }
+  cd_writebuf_destroy(&buf);
+  return err;
 }
 
 
-void cd_print_edges(cd_state_t* state, cd_writebuf_t* buf) {
-  QUEUE* nq;
+void cd_print_stats(cd_state_t* state,
+                    cd_writebuf_t* buf,
+                    struct timeval* start) {
+  struct timeval end;
+  double elapsed;
 
+  gettimeofday(&end, NULL);
+  elapsed = (end.tv_sec - start->tv_sec) +
+            (end.tv_usec - start->tv_usec) / 1e6;
 
-  QUEUE_FOREACH(nq, &state->nodes.list) {
-    QUEUE* eq;
-    cd_node_t* node;
-
-    node = container_of(nq, cd_node_t, member);
-    QUEUE_FOREACH(eq, &node->edges.outgoing) {
-      cd_edge_t* edge;
-      cd_edge_t* next;
-
-      edge = container_of(eq, cd_edge_t, out);
-      if (eq != QUEUE_PREV(&node->edges.outgoing)) {
-        eq = QUEUE_NEXT(eq);
-        next = container_of(eq, cd_edge_t, out);
-      } else {
-        next = NULL;
-      }
-
-      if (next == NULL) {
-        cd_writebuf_put(
-            buf,
-            "    %d, %d, %d",
-            edge->type,
-            edge->name,
-            edge->key.to->id * kCDNodeFieldCount);
-      } else {
-        cd_writebuf_put(
-            buf,
-            "    %d, %d, %d,\n"
-            "    %d, %d, %d",
-            edge->type,
-            edge->name,
-            edge->key.to->id * kCDNodeFieldCount,
-            next->type,
-            next->name,
-            next->key.to->id * kCDNodeFieldCount);
-      }
-
-      if (eq != QUEUE_PREV(&node->edges.outgoing) ||
-          nq != QUEUE_PREV(&state->nodes.list)) {
-        cd_writebuf_put(buf, ",\n");
-      } else {
-        cd_writebuf_put(buf, "\n");
-      }
-    }
-  }
+  fprintf(stderr,
+          "output: %llu bytes in %.3fs, %.1f MB/s\n",
+          (unsigned long long) buf->written,
+          elapsed,
+          elapsed > 0 ? buf->written / elapsed / 1048576 : 0);
+  fprintf(stderr,
+          "nodes, frames: %llu allocations, %llu bytes, %llu slabs\n"
+          "strings: %llu allocations, %llu bytes, %llu slabs\n",
+          (unsigned long long) state->arena.stats.allocs,
+          (unsigned long long) state->arena.stats.bytes,
+          (unsigned long long) state->arena.stats.slabs,
+          (unsigned long long) state->strings.arena.stats.allocs,
+          (unsigned long long) state->strings.arena.stats.bytes,
+          (unsigned long long) state->strings.arena.stats.slabs);
+  cd_v8_print_stats();
 }
 
 
 cd_error_t cd_print_trace(cd_state_t* state, cd_writebuf_t* buf) {
   QUEUE* q;
+  int thread;
 
+  thread = -1;
   QUEUE_FOREACH(q, &state->frames) {
     cd_js_frame_t* frame;
 
     frame = container_of(q, cd_js_frame_t, member);
 
+    /* Frames are grouped by thread */
+    if (state->all_threads && frame->thread != thread) {
+      cd_obj_thread_t othread;
+
+      if (thread != -1)
+        cd_writebuf_put(buf, "\n");
+      thread = frame->thread;
+
+      if (cd_is_ok(cd_obj_get_thread(state->core, thread, &othread)) &&
+          othread.tid != 0) {
+        cd_writebuf_put(buf, "thread %d (tid %d)\n", thread, othread.tid);
+      } else {
+        cd_writebuf_put(buf, "thread %d\n", thread);
+      }
+    }
+
     cd_writebuf_put(
         buf,
         "0x%016llx %.*s\n",
@@ -8,6 +8,7 @@
 #include "visitor.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -19,57 +20,64 @@ static cd_error_t cd_collect_frame(cd_obj_t* obj,
                                    void* arg);
 static cd_error_t cd_collect_v8_frame(cd_state_t* state,
                                       cd_js_frame_t* frame);
+static cd_error_t cd_collect_frame_ptrs(cd_state_t* state,
+                                        cd_js_frame_t* frame,
+                                        void* fn);
+static cd_error_t cd_collect_find_pages(cd_state_t* state,
+                                        cd_heap_scan_t* scan);
+static cd_error_t cd_collect_check_page(cd_state_t* state,
+                                        uint64_t addr,
+                                        cd_heap_page_t* page);
+static cd_error_t cd_collect_read_word(cd_state_t* state,
+                                       uint64_t addr,
+                                       uint64_t* res);
+static void* cd_collect_heap_worker(void* arg);
+static cd_error_t cd_collect_all_threads(cd_state_t* state);
+static void* cd_collect_stack_worker(void* arg);
+static cd_error_t cd_collect_push_frame(cd_obj_t* obj,
+                                        cd_frame_t* frame,
+                                        void* arg);
+static cd_error_t cd_collect_walk_page(cd_state_t* state,
+                                       cd_heap_page_t* page);
+
+
+static const int kCDHeapPagesInitialSize = 64;
+static const int kCDHeapObjsInitialSize = 1024;
+static const int kCDStackFramesInitialSize = 64;
 
 
 cd_error_t cd_collector_init(cd_state_t* state) {
   QUEUE_INIT(&state->queue);
   QUEUE_INIT(&state->frames);
   state->frame_count = 0;
+  state->frame_start = 0;
   return cd_ok();
 }
 
 
 void cd_collector_destroy(cd_state_t* state) {
-  while (!QUEUE_EMPTY(&state->queue)) {
-    QUEUE* q;
-    cd_node_t* node;
-
-    q = QUEUE_HEAD(&state->queue);
-    QUEUE_REMOVE(q);
-
-    node = container_of(q, cd_node_t, member);
-    free(node);
-  }
-
-  while (!QUEUE_EMPTY(&state->frames)) {
-    QUEUE* q;
-    cd_js_frame_t* frame;
-
-    q = QUEUE_HEAD(&state->frames);
-    QUEUE_REMOVE(q);
-
-    frame = container_of(q, cd_js_frame_t, member);
-    free(frame);
-  }
+  /* Queued nodes and frames are released with the `state->arena` */
+  QUEUE_INIT(&state->queue);
+  QUEUE_INIT(&state->frames);
+  state->frame_count = 0;
 }
 
 
 cd_error_t cd_collect_frame(cd_obj_t* obj, cd_frame_t* sframe, void* arg) {
   cd_state_t* state;
   cd_error_t err;
+  cd_js_frame_t tmp;
   cd_js_frame_t* frame;
 
   state = (cd_state_t*) arg;
-
-  frame = malloc(sizeof(*frame));
-  if (frame == NULL)
-    return cd_error_str(kCDErrNoMem, "cd_js_frame_t");
+  frame = &tmp;
 
   /* Copy the data */
   frame->start = sframe->start;
   frame->stop = sframe->stop;
   frame->frame = sframe->frame;
   frame->ip = sframe->ip;
+  frame->thread = state->thread_id;
 
   /* Lookup C/C++ symbol if present */
   if (sframe->sym != NULL) {
@@ -84,12 +92,16 @@ cd_error_t cd_collect_frame(cd_obj_t* obj, cd_frame_t* sframe, void* arg) {
   frame->name_len = 0;
 
   err = cd_collect_v8_frame(state, frame);
-  if (!cd_is_ok(err)) {
-    free(frame);
+  if (!cd_is_ok(err))
     return cd_ok();
-  }
 
 done:
+  /* Only the frames that are printed get into the arena */
+  frame = cd_arena_alloc(&state->arena, sizeof(*frame));
+  if (frame == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_js_frame_t");
+  *frame = tmp;
+
   QUEUE_INSERT_TAIL(&state->frames, &frame->member);
   state->frame_count++;
   return cd_ok();
@@ -112,9 +124,6 @@ cd_error_t cd_collect_v8_frame(cd_state_t* state, cd_js_frame_t* frame) {
   void* fn;
   void* args;
   int type;
-  unsigned int i;
-  cd_obj_thread_t thread;
-  cd_node_t* fn_node;
 
   ctx = *(void**) (frame->frame + cd_v8_off_fp_context);
   if (V8_IS_SMI(ctx) &&
@@ -151,6 +160,39 @@ cd_error_t cd_collect_v8_frame(cd_state_t* state, cd_js_frame_t* frame) {
   if (!cd_is_ok(err))
     return err;
 
+  /* Stack trace needs only the name */
+  if (!state->trace) {
+    err = cd_collect_frame_ptrs(state, frame, fn);
+    if (!cd_is_ok(err))
+      return err;
+  }
+
+  if (type == CD_V8_TYPE(Code, CODE))
+    CFRAME(frame, "<internal code>");
+
+  err = cd_v8_fn_info(state, fn, &frame->name, NULL, NULL, &frame->script);
+  if (!cd_is_ok(err))
+    return err;
+
+  frame->name_len = strlen(frame->name);
+  if (frame->name_len == 0)
+    CFRAME(frame, "(anon)");
+
+  return cd_ok();
+}
+
+
+#undef CFRAME
+
+
+cd_error_t cd_collect_frame_ptrs(cd_state_t* state,
+                                 cd_js_frame_t* frame,
+                                 void* fn) {
+  cd_error_t err;
+  unsigned int i;
+  cd_obj_thread_t thread;
+  cd_node_t* fn_node;
+
   err = cd_queue_ptr(state,
                      &state->nodes.root,
                      fn,
@@ -182,8 +224,8 @@ cd_error_t cd_collect_v8_frame(cd_state_t* state, cd_js_frame_t* frame) {
                  NULL);
   }
 
-  /* First frame - collect registers too */
-  if (state->frame_count == 0) {
+  /* First frame of the thread - collect registers too */
+  if (state->frame_count == state->frame_start) {
     unsigned int j;
     err = cd_obj_get_thread(state->core, state->thread_id, &thread);
     if (!cd_is_ok(err))
@@ -205,24 +247,10 @@ cd_error_t cd_collect_v8_frame(cd_state_t* state, cd_js_frame_t* frame) {
     }
   }
 
-  if (type == CD_V8_TYPE(Code, CODE))
-    CFRAME(frame, "<internal code>");
-
-  err = cd_v8_fn_info(state, fn, &frame->name, NULL, NULL, &frame->script);
-  if (!cd_is_ok(err))
-    return err;
-
-  frame->name_len = strlen(frame->name);
-  if (frame->name_len == 0)
-    CFRAME(frame, "(anon)");
-
   return cd_ok();
 }
 
 
-#undef CFRAME
-
-
 cd_error_t cd_collect_roots(cd_state_t* state) {
   cd_error_t err;
 
@@ -230,6 +258,9 @@ cd_error_t cd_collect_roots(cd_state_t* state) {
   if (!cd_is_ok(err))
     return err;
 
+  if (state->all_threads)
+    return cd_collect_all_threads(state);
+
   return cd_obj_iterate_stack(state->core,
                               state->thread_id,
                               cd_collect_frame,
@@ -237,7 +268,132 @@ cd_error_t cd_collect_roots(cd_state_t* state) {
 }
 
 
+cd_error_t cd_collect_all_threads(cd_state_t* state) {
+  cd_error_t err;
+  cd_stack_scan_t scan;
+  pthread_t* threads;
+  unsigned int count;
+  int started;
+  int i;
+  int j;
+
+  err = cd_obj_get_thread_count(state->core, &count);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* Initialized lazily, do it before the workers start */
+  err = cd_obj_init_segments(state->core);
+  if (!cd_is_ok(err))
+    return err;
+
+  scan.state = state;
+  scan.count = count;
+  scan.next = 0;
+  scan.stacks = calloc(count == 0 ? 1 : count, sizeof(*scan.stacks));
+  if (scan.stacks == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_stack_t");
+
+  /* Unwind stacks in parallel, the first thread is the current one */
+  threads = NULL;
+  started = 1;
+  if (state->jobs > 1 && count > 1)
+    threads = calloc(state->jobs, sizeof(*threads));
+  if (threads != NULL) {
+    for (; started < state->jobs && started < scan.count; started++) {
+      if (pthread_create(&threads[started],
+                         NULL,
+                         cd_collect_stack_worker,
+                         &scan) != 0) {
+        break;
+      }
+    }
+  }
+  cd_collect_stack_worker(&scan);
+
+  for (i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  /*
+   * Collect frames in the order of threads, so that the output is stable.
+   * Frames unwound before an error are still used.
+   */
+  err = cd_ok();
+  for (i = 0; i < scan.count; i++) {
+    cd_stack_t* stack;
+
+    stack = &scan.stacks[i];
+    if (stack->err.code == kCDErrNoMem) {
+      err = stack->err;
+      goto done;
+    }
+
+    state->thread_id = i;
+    state->frame_start = state->frame_count;
+    for (j = 0; j < stack->count; j++) {
+      err = cd_collect_frame(state->core, &stack->frames[j], state);
+      if (!cd_is_ok(err))
+        goto done;
+    }
+  }
+
+done:
+  for (i = 0; i < scan.count; i++)
+    free(scan.stacks[i].frames);
+  free(scan.stacks);
+  return err;
+}
+
+
+void* cd_collect_stack_worker(void* arg) {
+  cd_stack_scan_t* scan;
+
+  scan = (cd_stack_scan_t*) arg;
+  for (;;) {
+    int i;
+
+    i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+    if (i >= scan->count)
+      break;
+
+    scan->stacks[i].err = cd_obj_iterate_stack(scan->state->core,
+                                               i,
+                                               cd_collect_push_frame,
+                                               &scan->stacks[i]);
+  }
+
+  return NULL;
+}
+
+
+cd_error_t cd_collect_push_frame(cd_obj_t* obj,
+                                 cd_frame_t* frame,
+                                 void* arg) {
+  cd_stack_t* stack;
+
+  stack = (cd_stack_t*) arg;
+  if (stack->count == stack->size) {
+    cd_frame_t* frames;
+    int size;
+
+    size = stack->size == 0 ? kCDStackFramesInitialSize : stack->size * 2;
+    frames = realloc(stack->frames, sizeof(*frames) * size);
+    if (frames == NULL)
+      return cd_error_str(kCDErrNoMem, "cd_frame_t");
+    stack->frames = frames;
+    stack->size = size;
+  }
+
+  stack->frames[stack->count++] = *frame;
+  return cd_ok();
+}
+
+
 cd_error_t cd_collect_addr(struct cd_state_s* state, intptr_t addr) {
+  /* Nothing to trace in a single object */
+  if (state->trace)
+    return cd_ok();
+
   return cd_queue_ptr(state,
                       &state->nodes.root,
                       (void*) addr,
@@ -247,3 +403,267 @@ cd_error_t cd_collect_addr(struct cd_state_s* state, intptr_t addr) {
                       0,
                       NULL);
 }
+
+
+cd_error_t cd_collect_heap(cd_state_t* state) {
+  cd_error_t err;
+  cd_heap_scan_t scan;
+  pthread_t* threads;
+  int started;
+  int i;
+  int j;
+
+  scan.state = state;
+  scan.pages = NULL;
+  scan.count = 0;
+  scan.size = 0;
+  scan.next = 0;
+  scan.failed = 0;
+
+  err = cd_collect_find_pages(state, &scan);
+  if (!cd_is_ok(err))
+    goto done;
+
+  /* Walk pages in parallel, the first thread is the current one */
+  threads = NULL;
+  started = 1;
+  if (state->jobs > 1)
+    threads = calloc(state->jobs, sizeof(*threads));
+  if (threads != NULL) {
+    for (; started < state->jobs; started++) {
+      if (pthread_create(&threads[started],
+                         NULL,
+                         cd_collect_heap_worker,
+                         &scan) != 0) {
+        break;
+      }
+    }
+  }
+  cd_collect_heap_worker(&scan);
+
+  for (i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (scan.failed) {
+    err = cd_error_str(kCDErrNoMem, "cd_heap_page_t objs");
+    goto done;
+  }
+
+  /*
+   * Queue objects in the order of pages, so that the output is stable.
+   * There are no edges from the root: only the objects that are retained
+   * by something else get a retainer, the rest stay unreachable.
+   */
+  for (i = 0; i < scan.count; i++) {
+    cd_heap_page_t* page;
+
+    page = &scan.pages[i];
+    for (j = 0; j < page->count; j += 2) {
+      cd_queue_ptr(state,
+                   NULL,
+                   page->objs[j],
+                   page->objs[j + 1],
+                   kCDEdgeElement,
+                   0,
+                   0,
+                   NULL);
+    }
+  }
+
+done:
+  for (i = 0; i < scan.count; i++)
+    free(scan.pages[i].objs);
+  free(scan.pages);
+  return err;
+}
+
+
+cd_error_t cd_collect_find_pages(cd_state_t* state, cd_heap_scan_t* scan) {
+  cd_error_t err;
+  uint64_t align;
+  int i;
+
+  err = cd_obj_init_segments(state->core);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* Pages are aligned, probe every aligned address for a chunk header */
+  align = cd_v8_MemoryChunk_alignment;
+  for (i = 0; i < state->core->segment_count; i++) {
+    cd_segment_t* seg;
+    uint64_t addr;
+
+    seg = &state->core->segments[i];
+    for (addr = (seg->start + align - 1) & ~(align - 1);
+         addr < seg->end;
+         addr += align) {
+      cd_heap_page_t page;
+
+      err = cd_collect_check_page(state, addr, &page);
+      if (!cd_is_ok(err))
+        continue;
+
+      if (scan->count == scan->size) {
+        cd_heap_page_t* pages;
+        int size;
+
+        size = scan->size == 0 ? kCDHeapPagesInitialSize : scan->size * 2;
+        pages = realloc(scan->pages, sizeof(*pages) * size);
+        if (pages == NULL)
+          return cd_error_str(kCDErrNoMem, "cd_heap_page_t");
+        scan->pages = pages;
+        scan->size = size;
+      }
+      scan->pages[scan->count++] = page;
+
+      /* Large object pages span several aligned chunks */
+      addr = ((page.end + align - 1) & ~(align - 1)) - align;
+    }
+  }
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_collect_check_page(cd_state_t* state,
+                                 uint64_t addr,
+                                 cd_heap_page_t* page) {
+  cd_error_t err;
+  uint64_t size;
+  uint64_t start;
+  uint64_t end;
+  void* map;
+  void* data;
+  int type;
+
+  err = cd_collect_read_word(
+      state,
+      addr + cd_v8_class_MemoryChunk__size__size_t,
+      &size);
+  if (!cd_is_ok(err))
+    return err;
+  err = cd_collect_read_word(
+      state,
+      addr + cd_v8_class_MemoryChunk__area_start__Address,
+      &start);
+  if (!cd_is_ok(err))
+    return err;
+  err = cd_collect_read_word(
+      state,
+      addr + cd_v8_class_MemoryChunk__area_end__Address,
+      &end);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (start <= addr || start >= end || end - addr > size)
+    return cd_error(kCDErrNotFound);
+
+  /* Whole area should be present in the core */
+  err = cd_obj_get(state->core, start, end - start, &data);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* And start with an object, whose map is a Map */
+  map = *(void**) data;
+  err = cd_v8_get_obj_type(state, map, NULL, &type);
+  if (!cd_is_ok(err))
+    return err;
+  if (type != CD_V8_TYPE(Map, MAP))
+    return cd_error(kCDErrNotFound);
+
+  page->start = start;
+  page->end = end;
+  page->data = data;
+  page->objs = NULL;
+  page->count = 0;
+  page->size = 0;
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_collect_read_word(cd_state_t* state,
+                                uint64_t addr,
+                                uint64_t* res) {
+  cd_error_t err;
+  void* ptr;
+
+  err = cd_obj_get(state->core, addr, state->ptr_size, &ptr);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (state->ptr_size == 8)
+    *res = *(uint64_t*) ptr;
+  else
+    *res = *(uint32_t*) ptr;
+
+  return cd_ok();
+}
+
+
+void* cd_collect_heap_worker(void* arg) {
+  cd_heap_scan_t* scan;
+
+  scan = (cd_heap_scan_t*) arg;
+  for (;;) {
+    int i;
+
+    i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+    if (i >= scan->count)
+      break;
+
+    if (!cd_is_ok(cd_collect_walk_page(scan->state, &scan->pages[i])))
+      __atomic_store_n(&scan->failed, 1, __ATOMIC_RELAXED);
+  }
+
+  return NULL;
+}
+
+
+cd_error_t cd_collect_walk_page(cd_state_t* state, cd_heap_page_t* page) {
+  uint64_t addr;
+  int size;
+
+  /*
+   * Objects are laid out back to back, the walk stops at the first one
+   * with an unknown size (e.g. at the allocation top of the new space).
+   */
+  for (addr = page->start; addr < page->end; addr += size) {
+    cd_error_t err;
+    void* obj;
+    void* map;
+    int type;
+
+    obj = (void*) (intptr_t) (addr + cd_v8_HeapObjectTag);
+    map = *(void**) (page->data + (addr - page->start));
+
+    err = cd_v8_get_obj_type(state, obj, map, &type);
+    if (!cd_is_ok(err))
+      break;
+
+    err = cd_v8_get_obj_size(state, obj, map, type, &size);
+    if (!cd_is_ok(err) || size <= 0 ||
+        (uint64_t) size > page->end - addr)
+      break;
+
+    if (type == CD_V8_TYPE(FreeSpace, FREE_SPACE))
+      continue;
+
+    if (page->count == page->size) {
+      void** objs;
+      int osize;
+
+      osize = page->size == 0 ? kCDHeapObjsInitialSize : page->size * 2;
+      objs = realloc(page->objs, sizeof(*objs) * osize);
+      if (objs == NULL)
+        return cd_error_str(kCDErrNoMem, "cd_heap_page_t objs");
+      page->objs = objs;
+      page->size = osize;
+    }
+    page->objs[page->count++] = obj;
+    page->objs[page->count++] = map;
+  }
+
+  return cd_ok();
+}
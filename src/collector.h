@@ -2,6 +2,7 @@
 #define SRC_COLLECTOR_H_
 
 #include "error.h"
+#include "obj-common.h"
 #include "queue.h"
 #include "v8helpers.h"
 
@@ -11,6 +12,10 @@
 struct cd_state_s;
 
 typedef struct cd_js_frame_s cd_js_frame_t;
+typedef struct cd_heap_page_s cd_heap_page_t;
+typedef struct cd_heap_scan_s cd_heap_scan_t;
+typedef struct cd_stack_s cd_stack_t;
+typedef struct cd_stack_scan_s cd_stack_scan_t;
 
 struct cd_js_frame_s {
   QUEUE member;
@@ -23,9 +28,51 @@ struct cd_js_frame_s {
   const char* name;
   int name_len;
 
+  /* Index of the thread in the core file */
+  int thread;
+
   cd_script_t script;
 };
 
+struct cd_heap_page_s {
+  uint64_t start;
+  uint64_t end;
+  char* data;
+
+  /* Pairs of tagged object pointer and its map */
+  void** objs;
+  int count;
+  int size;
+};
+
+struct cd_heap_scan_s {
+  struct cd_state_s* state;
+  cd_heap_page_t* pages;
+  int count;
+  int size;
+
+  /* Index of the next page to walk, shared by the threads */
+  int next;
+  int failed;
+};
+
+/* Unwound frames of a single thread, innermost first */
+struct cd_stack_s {
+  cd_frame_t* frames;
+  int count;
+  int size;
+  cd_error_t err;
+};
+
+struct cd_stack_scan_s {
+  struct cd_state_s* state;
+  cd_stack_t* stacks;
+  int count;
+
+  /* Index of the next thread to unwind, shared by the workers */
+  int next;
+};
+
 /* Collect roots on the stack of the core file */
 
 cd_error_t cd_collector_init(struct cd_state_s* state);
@@ -34,4 +81,7 @@ void cd_collector_destroy(struct cd_state_s* state);
 cd_error_t cd_collect_roots(struct cd_state_s* state);
 cd_error_t cd_collect_addr(struct cd_state_s* state, intptr_t addr);
 
+/* Walk all V8 heap pages found in the core file, queue every object */
+cd_error_t cd_collect_heap(struct cd_state_s* state);
+
 #endif  /* SRC_COLLECTOR_H_ */
@@ -1,20 +1,40 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
-#if defined(__FreeBSD__)
-# define _WITH_DPRINTF
-#endif
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 
 
-static const int kCDHashmapMaxSkip = 64;
-static const int kCDHashmapGrowRateLimit = 1048576;
-
-
+static const unsigned int kCDHashmapMinSize = 16;
+static const unsigned int kCDHashmapMaxSize = 0x80000000U;
+static const unsigned int kCDPtrmapMinBits = 4;
+static const unsigned int kCDPtrmapMaxBits = 31;
+static const unsigned int kCDArenaAlign = 8;
+
+
+static uint32_t cd_hashmap_hash(cd_hashmap_t* map,
+                                const char* key,
+                                unsigned int key_len);
+static int cd_hashmap_equal(cd_hashmap_t* map,
+                            cd_hashmap_item_t* item,
+                            uint32_t hash,
+                            const char* key,
+                            unsigned int key_len);
+static void cd_hashmap_place(cd_hashmap_t* map,
+                             cd_hashmap_item_t entry,
+                             uint32_t index,
+                             uint32_t dist);
+static int cd_hashmap_resize(cd_hashmap_t* map, unsigned int size);
+static cd_hashmap_item_t* cd_hashmap_find(cd_hashmap_t* map,
+                                          const char* key,
+                                          unsigned int key_len,
+                                          uint32_t* res);
+static int cd_ptrmap_grow(cd_ptrmap_shard_t* shard);
 static void cd_splay_destroy_rec(cd_splay_t* splay, cd_splay_node_t* node);
 static void cd_splay(cd_splay_t* splay,
                      cd_splay_node_t** g,
@@ -22,6 +42,14 @@ static void cd_splay(cd_splay_t* splay,
                      cd_splay_node_t** c);
 
 
+/* Up to 3/4 of the slots are used */
+#define CD_HASHMAP_LIMIT(size) ((size) - (size) / 4)
+
+/* Distance of the item at `index` from the slot its hash points to */
+#define CD_HASHMAP_DIST(map, item, index)                                     \
+    (((index) - (item)->hash) & (map)->mask)
+
+
 #define CD_MURMUR3_C1 0xcc9e2d51
 #define CD_MURMUR3_C2 0x1b873593
 
@@ -82,11 +110,20 @@ uint32_t cd_murmur3(const char* key, unsigned int len) {
 
 
 int cd_hashmap_init(cd_hashmap_t* map, unsigned int count, int ptr) {
-  map->items = calloc(count, sizeof(*map->items));
+  unsigned int size;
+
+  for (size = kCDHashmapMinSize; CD_HASHMAP_LIMIT(size) < count; size <<= 1) {
+    if (size >= kCDHashmapMaxSize)
+      return -1;
+  }
+
+  map->items = calloc(size, sizeof(*map->items));
   if (map->items == NULL)
     return -1;
 
-  map->count = count;
+  map->size = size;
+  map->mask = size - 1;
+  map->count = 0;
   map->ptr = ptr;
 
   return 0;
@@ -99,143 +136,467 @@ void cd_hashmap_destroy(cd_hashmap_t* map) {
 }
 
 
-int cd_hashmap_insert(cd_hashmap_t* map,
-                      const char* key,
-                      unsigned int key_len,
-                      void* value) {
-  uint32_t index;
+uint32_t cd_hashmap_hash(cd_hashmap_t* map,
+                         const char* key,
+                         unsigned int key_len) {
+  if (map->ptr)
+    return cd_murmur3((const char*) &key, key_len);
+  else
+    return cd_murmur3(key, key_len);
+}
 
-  do {
-    int skip;
-    cd_hashmap_item_t* items;
-    cd_hashmap_item_t* nitems;
-    unsigned int i;
-    unsigned int count;
-    unsigned int grow;
-
-    if (map->ptr)
-      index = cd_murmur3((const char*) &key, key_len) % map->count;
-    else
-      index = cd_murmur3(key, key_len) % map->count;
 
-    for (skip = 0;
-         skip < kCDHashmapMaxSkip && map->items[index].key != NULL;
-         skip++) {
-      cd_hashmap_item_t* item;
+int cd_hashmap_equal(cd_hashmap_t* map,
+                     cd_hashmap_item_t* item,
+                     uint32_t hash,
+                     const char* key,
+                     unsigned int key_len) {
+  if (item->hash != hash || item->key_len != key_len)
+    return 0;
+  if (map->ptr)
+    return item->key == key;
+  else
+    return memcmp(item->key, key, key_len) == 0;
+}
 
-      item = &map->items[index];
 
-      /* Equal entries - update */
-      if (key_len == item->key_len &&
-          (map->ptr ? item->key == key :
-                      (memcmp(item->key, key, key_len) == 0))) {
-        break;
-      }
+void cd_hashmap_place(cd_hashmap_t* map,
+                      cd_hashmap_item_t entry,
+                      uint32_t index,
+                      uint32_t dist) {
+  for (;; index = (index + 1) & map->mask, dist++) {
+    cd_hashmap_item_t* item;
+    cd_hashmap_item_t tmp;
+    uint32_t idist;
 
-      index = (index + 1) % map->count;
+    item = &map->items[index];
+    if (item->key == NULL) {
+      *item = entry;
+      map->count++;
+      return;
     }
 
-    if (skip != kCDHashmapMaxSkip)
-      break;
+    /* Take the slot from the entry that is closer to its home */
+    idist = CD_HASHMAP_DIST(map, item, index);
+    if (idist < dist) {
+      tmp = *item;
+      *item = entry;
+      entry = tmp;
+      dist = idist;
+    }
+  }
+}
 
-    /* Grow is needed */
-    if ((int) map->count < kCDHashmapGrowRateLimit)
-      grow = map->count;
-    else
-      grow = kCDHashmapGrowRateLimit;
 
-    nitems = calloc(map->count + grow, sizeof(*nitems));
-    if (nitems == NULL)
+int cd_hashmap_resize(cd_hashmap_t* map, unsigned int size) {
+  cd_hashmap_item_t* items;
+  cd_hashmap_item_t* swap;
+  unsigned int count;
+  unsigned int i;
+
+  items = calloc(size, sizeof(*items));
+  if (items == NULL)
+    return -1;
+
+  /* Stored hashes, no need to rehash the keys */
+  swap = map->items;
+  count = map->size;
+  map->items = items;
+  map->size = size;
+  map->mask = size - 1;
+  map->count = 0;
+  for (i = 0; i < count; i++)
+    if (swap[i].key != NULL)
+      cd_hashmap_place(map, swap[i], swap[i].hash & map->mask, 0);
+  free(swap);
+
+  return 0;
+}
+
+
+int cd_hashmap_reserve(cd_hashmap_t* map, unsigned int count) {
+  unsigned int size;
+
+  for (size = map->size; CD_HASHMAP_LIMIT(size) < count; size <<= 1) {
+    if (size >= kCDHashmapMaxSize)
       return -1;
+  }
 
-    /* Rehash */
-    items = map->items;
-    count = map->count;
-
-    map->count += grow;
-    map->items = nitems;
-    for (i = 0; i < count; i++) {
-      if (items[i].key == NULL)
-        continue;
-      cd_hashmap_insert(map,
-                        items[i].key,
-                        items[i].key_len,
-                        items[i].value);
+  if (size == map->size)
+    return 0;
+  return cd_hashmap_resize(map, size);
+}
+
+
+int cd_hashmap_insert(cd_hashmap_t* map,
+                      const char* key,
+                      unsigned int key_len,
+                      void* value) {
+  cd_hashmap_item_t entry;
+  uint32_t hash;
+  uint32_t index;
+  uint32_t dist;
+
+  hash = cd_hashmap_hash(map, key, key_len);
+  index = hash & map->mask;
+  for (dist = 0;; index = (index + 1) & map->mask, dist++) {
+    cd_hashmap_item_t* item;
+
+    item = &map->items[index];
+    if (item->key == NULL || CD_HASHMAP_DIST(map, item, index) < dist)
+      break;
+
+    /* Equal entries - update */
+    if (cd_hashmap_equal(map, item, hash, key, key_len)) {
+      item->value = value;
+      return 0;
     }
-    free(items);
+  }
 
-    /* Retry inserting */
-    continue;
-  } while (1);
+  entry.key = key;
+  entry.key_len = key_len;
+  entry.hash = hash;
+  entry.value = value;
 
-  map->items[index].key = key;
-  map->items[index].key_len = key_len;
-  map->items[index].value = value;
+  if (map->count >= CD_HASHMAP_LIMIT(map->size)) {
+    if (map->size >= kCDHashmapMaxSize)
+      return -1;
+    if (cd_hashmap_resize(map, map->size << 1) != 0)
+      return -1;
+    index = hash & map->mask;
+    dist = 0;
+  }
 
+  cd_hashmap_place(map, entry, index, dist);
   return 0;
 }
 
 
-void* cd_hashmap_get(cd_hashmap_t* map,
-                     const char* key,
-                     unsigned int key_len) {
+cd_hashmap_item_t* cd_hashmap_find(cd_hashmap_t* map,
+                                   const char* key,
+                                   unsigned int key_len,
+                                   uint32_t* res) {
+  uint32_t hash;
   uint32_t index;
+  uint32_t dist;
 
-  if (map->ptr)
-    index = cd_murmur3((const char*) &key, key_len) % map->count;
-  else
-    index = cd_murmur3(key, key_len) % map->count;
-
-  do {
+  hash = cd_hashmap_hash(map, key, key_len);
+  index = hash & map->mask;
+  for (dist = 0;; index = (index + 1) & map->mask, dist++) {
     cd_hashmap_item_t* item;
 
     item = &map->items[index];
 
-    /* Not found */
-    if (item->key == NULL)
+    /* Not found, the key would have taken this slot */
+    if (item->key == NULL || CD_HASHMAP_DIST(map, item, index) < dist)
       return NULL;
 
-    if (key_len == item->key_len &&
-        (map->ptr ? item->key == key :
-                    (memcmp(item->key, key, key_len) == 0))) {
-      return item->value;
+    if (cd_hashmap_equal(map, item, hash, key, key_len)) {
+      *res = index;
+      return item;
     }
+  }
+}
 
-    /* Move forward */
-    index = (index + 1) % map->count;
-  } while (1);
+
+void* cd_hashmap_get(cd_hashmap_t* map,
+                     const char* key,
+                     unsigned int key_len) {
+  cd_hashmap_item_t* item;
+  uint32_t index;
+
+  item = cd_hashmap_find(map, key, key_len, &index);
+  if (item == NULL)
+    return NULL;
+  return item->value;
 }
 
 
 void cd_hashmap_delete(cd_hashmap_t* map,
                        const char* key,
                        unsigned int key_len) {
+  cd_hashmap_item_t* item;
   uint32_t index;
+  uint32_t next;
 
-  if (map->ptr)
-    index = cd_murmur3((const char*) &key, key_len) % map->count;
-  else
-    index = cd_murmur3(key, key_len) % map->count;
+  item = cd_hashmap_find(map, key, key_len, &index);
+  if (item == NULL)
+    return;
 
-  do {
-    cd_hashmap_item_t* item;
+  /* Shift the rest of the chain back, so no probe stops at the hole */
+  for (next = (index + 1) & map->mask;
+       map->items[next].key != NULL &&
+           CD_HASHMAP_DIST(map, &map->items[next], next) != 0;
+       next = (next + 1) & map->mask) {
+    map->items[index] = map->items[next];
+    index = next;
+  }
 
-    item = &map->items[index];
+  memset(&map->items[index], 0, sizeof(map->items[index]));
+  map->count--;
+}
 
-    /* Not found */
-    if (item->key == NULL)
-      return;
 
-    if (key_len == item->key_len &&
-        (map->ptr ? item->key == key :
-                    (memcmp(item->key, key, key_len) == 0))) {
-      item->key = NULL;
-      return;
+#undef CD_HASHMAP_LIMIT
+#undef CD_HASHMAP_DIST
+
+
+/* Up to a half of the slots are used, most of the lookups are misses */
+#define CD_PTRMAP_LIMIT(size) ((size) / 2)
+
+/* Fibonacci hashing, the top bits are the best mixed ones */
+#define CD_PTRMAP_HASH(key) ((uint64_t) (key) * 0x9e3779b97f4a7c15ULL)
+#define CD_PTRMAP_SHARD(hash) ((hash) >> (64 - CD_PTRMAP_SHARD_BITS))
+#define CD_PTRMAP_INDEX(hash, shift)                                          \
+    ((uint32_t) (((hash) << CD_PTRMAP_SHARD_BITS) >> (shift)))
+
+
+int cd_ptrmap_init(cd_ptrmap_t* map, unsigned int count) {
+  int i;
+  unsigned int bits;
+
+  count /= CD_PTRMAP_SHARD_COUNT;
+  for (bits = kCDPtrmapMinBits; CD_PTRMAP_LIMIT(1U << bits) < count; bits++) {
+    if (bits >= kCDPtrmapMaxBits)
+      return -1;
+  }
+
+  for (i = 0; i < CD_PTRMAP_SHARD_COUNT; i++) {
+    cd_ptrmap_shard_t* shard;
+
+    shard = &map->shards[i];
+    shard->items = calloc(1U << bits, sizeof(*shard->items));
+    if (shard->items == NULL)
+      goto fatal;
+    shard->shift = 64 - bits;
+    shard->mask = (1U << bits) - 1;
+    shard->count = 0;
+
+    if (pthread_mutex_init(&map->locks[i], NULL) != 0) {
+      free(shard->items);
+      goto fatal;
     }
+  }
 
-    /* Move forward */
-    index = (index + 1) % map->count;
-  } while (1);
+  map->locked = 0;
+
+  return 0;
+
+fatal:
+  while (--i >= 0) {
+    free(map->shards[i].items);
+    pthread_mutex_destroy(&map->locks[i]);
+  }
+  return -1;
+}
+
+
+void cd_ptrmap_destroy(cd_ptrmap_t* map) {
+  int i;
+
+  for (i = 0; i < CD_PTRMAP_SHARD_COUNT; i++) {
+    free(map->shards[i].items);
+    map->shards[i].items = NULL;
+    pthread_mutex_destroy(&map->locks[i]);
+  }
+}
+
+
+cd_ptrmap_shard_t* cd_ptrmap_acquire(cd_ptrmap_t* map, uint64_t key) {
+  cd_ptrmap_shard_t* shard;
+
+  shard = &map->shards[CD_PTRMAP_SHARD(CD_PTRMAP_HASH(key))];
+  if (map->locked)
+    pthread_mutex_lock(&map->locks[shard - map->shards]);
+
+  return shard;
+}
+
+
+void cd_ptrmap_release(cd_ptrmap_t* map, cd_ptrmap_shard_t* shard) {
+  if (map->locked)
+    pthread_mutex_unlock(&map->locks[shard - map->shards]);
+}
+
+
+void cd_ptrmap_prefetch(cd_ptrmap_t* map, uint64_t key) {
+  cd_ptrmap_shard_t* shard;
+  cd_ptrmap_item_t* items;
+  uint64_t hash;
+  unsigned int shift;
+
+  /*
+   * No lock, the shard may be growing. Any mix of old and new `items` and
+   * `shift` gives an index within `items`, and prefetch does not fault.
+   */
+  hash = CD_PTRMAP_HASH(key);
+  shard = &map->shards[CD_PTRMAP_SHARD(hash)];
+  items = __atomic_load_n(&shard->items, __ATOMIC_RELAXED);
+  shift = __atomic_load_n(&shard->shift, __ATOMIC_RELAXED);
+  __builtin_prefetch(&items[CD_PTRMAP_INDEX(hash, shift)]);
+}
+
+
+void* cd_ptrmap_get(cd_ptrmap_shard_t* shard, uint64_t key) {
+  uint32_t index;
+
+  index = CD_PTRMAP_INDEX(CD_PTRMAP_HASH(key), shard->shift);
+  for (;; index = (index + 1) & shard->mask) {
+    cd_ptrmap_item_t* item;
+
+    item = &shard->items[index];
+    if (item->key == key)
+      return item->value;
+    if (item->key == 0)
+      return NULL;
+  }
+}
+
+
+int cd_ptrmap_grow(cd_ptrmap_shard_t* shard) {
+  cd_ptrmap_item_t* items;
+  cd_ptrmap_item_t* old;
+  unsigned int size;
+  unsigned int i;
+
+  size = shard->mask + 1;
+  if (64 - shard->shift >= kCDPtrmapMaxBits)
+    return -1;
+
+  items = calloc(size << 1, sizeof(*items));
+  if (items == NULL)
+    return -1;
+
+  /* Stores are atomic for `cd_ptrmap_prefetch` */
+  old = shard->items;
+  __atomic_store_n(&shard->items, items, __ATOMIC_RELAXED);
+  __atomic_store_n(&shard->shift, shard->shift - 1, __ATOMIC_RELAXED);
+  shard->mask = (size << 1) - 1;
+  shard->count = 0;
+
+  for (i = 0; i < size; i++)
+    if (old[i].key != 0)
+      cd_ptrmap_insert(shard, old[i].key, old[i].value);
+  free(old);
+
+  return 0;
+}
+
+
+int cd_ptrmap_insert(cd_ptrmap_shard_t* shard, uint64_t key, void* value) {
+  uint32_t index;
+
+  if (shard->count >= CD_PTRMAP_LIMIT(shard->mask + 1) &&
+      cd_ptrmap_grow(shard) != 0) {
+    return -1;
+  }
+
+  index = CD_PTRMAP_INDEX(CD_PTRMAP_HASH(key), shard->shift);
+  for (;; index = (index + 1) & shard->mask) {
+    cd_ptrmap_item_t* item;
+
+    item = &shard->items[index];
+    if (item->key == key) {
+      item->value = value;
+      return 0;
+    }
+    if (item->key == 0) {
+      item->key = key;
+      item->value = value;
+      shard->count++;
+      return 0;
+    }
+  }
+}
+
+
+#undef CD_PTRMAP_LIMIT
+#undef CD_PTRMAP_HASH
+#undef CD_PTRMAP_SHARD
+#undef CD_PTRMAP_INDEX
+
+
+void cd_arena_init(cd_arena_t* arena, unsigned int slab_size) {
+  arena->slabs = NULL;
+  arena->pos = NULL;
+  arena->end = NULL;
+  arena->slab_size = slab_size;
+  arena->stats.allocs = 0;
+  arena->stats.bytes = 0;
+  arena->stats.slabs = 0;
+}
+
+
+void cd_arena_destroy(cd_arena_t* arena) {
+  while (arena->slabs != NULL) {
+    cd_arena_slab_t* next;
+
+    next = arena->slabs->next;
+    free(arena->slabs);
+    arena->slabs = next;
+  }
+  arena->pos = NULL;
+  arena->end = NULL;
+}
+
+
+void* cd_arena_alloc(cd_arena_t* arena, unsigned int size) {
+  cd_arena_slab_t* slab;
+  unsigned int slab_size;
+  char* res;
+
+  size = (size + kCDArenaAlign - 1) & ~(kCDArenaAlign - 1);
+
+  if (arena->end - arena->pos < (ptrdiff_t) size) {
+    /* Big allocations get a slab of their own */
+    slab_size = arena->slab_size;
+    if (size > slab_size / 4)
+      slab_size = size;
+
+    slab = malloc(offsetof(cd_arena_slab_t, data) + slab_size);
+    if (slab == NULL)
+      return NULL;
+    arena->stats.slabs++;
+
+    slab->next = arena->slabs;
+    arena->slabs = slab;
+
+    /* Don't waste the rest of the current slab */
+    if (slab_size == size && arena->pos != NULL) {
+      arena->stats.allocs++;
+      arena->stats.bytes += size;
+      return (char*) slab->data;
+    }
+
+    arena->pos = (char*) slab->data;
+    arena->end = arena->pos + slab_size;
+  }
+
+  res = arena->pos;
+  arena->pos += size;
+  arena->stats.allocs++;
+  arena->stats.bytes += size;
+
+  return res;
+}
+
+
+void cd_arena_merge(cd_arena_t* arena, cd_arena_t* other) {
+  cd_arena_slab_t* last;
+
+  /* Take over the slabs, `arena` keeps allocating from its current one */
+  if (other->slabs != NULL) {
+    for (last = other->slabs; last->next != NULL; last = last->next)
+      ;
+    last->next = arena->slabs;
+    arena->slabs = other->slabs;
+  }
+
+  arena->stats.allocs += other->stats.allocs;
+  arena->stats.bytes += other->stats.bytes;
+  arena->stats.slabs += other->stats.slabs;
+
+  cd_arena_init(other, other->slab_size);
 }
 
 
@@ -243,6 +604,7 @@ int cd_writebuf_init(cd_writebuf_t* buf, int fd, unsigned int size) {
   buf->fd = fd;
   buf->off = 0;
   buf->size = size;
+  buf->written = 0;
   /* Trailing zero in snprintf */
   buf->buf = malloc(size + 1);
   if (buf->buf == NULL)
@@ -309,8 +671,109 @@ int cd_writebuf_put(cd_writebuf_t* buf, char* fmt, ...) {
 }
 
 
+void cd_writebuf_put_raw(cd_writebuf_t* buf,
+                         const char* str,
+                         unsigned int len) {
+  while (len > 0) {
+    unsigned int chunk;
+
+    chunk = buf->size - buf->off;
+    if (chunk > len)
+      chunk = len;
+
+    memcpy(buf->buf + buf->off, str, chunk);
+    buf->off += chunk;
+    str += chunk;
+    len -= chunk;
+
+    if (buf->off == buf->size)
+      cd_writebuf_flush(buf);
+  }
+}
+
+
+char* cd_writebuf_reserve(cd_writebuf_t* buf, unsigned int len) {
+  if (buf->size - buf->off < len)
+    cd_writebuf_flush(buf);
+  return buf->buf + buf->off;
+}
+
+
+void cd_writebuf_put_int(cd_writebuf_t* buf, int64_t num) {
+  static const char digits[] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+  char tmp[20];
+  char* ptr;
+  uint64_t val;
+
+  val = num < 0 ? -(uint64_t) num : (uint64_t) num;
+
+  /* Two digits at a time, from the end */
+  ptr = tmp + sizeof(tmp);
+  while (val >= 100) {
+    int i;
+
+    i = (val % 100) * 2;
+    val /= 100;
+    *(--ptr) = digits[i + 1];
+    *(--ptr) = digits[i];
+  }
+  if (val >= 10) {
+    *(--ptr) = digits[val * 2 + 1];
+    *(--ptr) = digits[val * 2];
+  } else {
+    *(--ptr) = '0' + val;
+  }
+
+  if (num < 0)
+    *(--ptr) = '-';
+
+  cd_writebuf_put_raw(buf, ptr, tmp + sizeof(tmp) - ptr);
+}
+
+
+void cd_writebuf_put_u32(cd_writebuf_t* buf, uint32_t num) {
+  char tmp[4];
+
+  /* Little-endian, regardless of the host */
+  tmp[0] = num & 0xff;
+  tmp[1] = (num >> 8) & 0xff;
+  tmp[2] = (num >> 16) & 0xff;
+  tmp[3] = (num >> 24) & 0xff;
+  cd_writebuf_put_raw(buf, tmp, sizeof(tmp));
+}
+
+
+void cd_writebuf_put_u64(cd_writebuf_t* buf, uint64_t num) {
+  cd_writebuf_put_u32(buf, (uint32_t) num);
+  cd_writebuf_put_u32(buf, (uint32_t) (num >> 32));
+}
+
+
 void cd_writebuf_flush(cd_writebuf_t* buf) {
-  dprintf(buf->fd, "%.*s", buf->off, buf->buf);
+  unsigned int off;
+
+  for (off = 0; off < buf->off; ) {
+    ssize_t r;
+
+    r = write(buf->fd, buf->buf + off, buf->off - off);
+    if (r == -1 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    off += r;
+  }
+
+  buf->written += buf->off;
   buf->off = 0;
 }
 
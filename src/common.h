@@ -1,11 +1,20 @@
 #ifndef SRC_COMMON_H
 #define SRC_COMMON_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stddef.h>
 
+#define CD_PTRMAP_SHARD_BITS 6
+#define CD_PTRMAP_SHARD_COUNT (1 << CD_PTRMAP_SHARD_BITS)
+
 typedef struct cd_hashmap_s cd_hashmap_t;
 typedef struct cd_hashmap_item_s cd_hashmap_item_t;
+typedef struct cd_ptrmap_s cd_ptrmap_t;
+typedef struct cd_ptrmap_shard_s cd_ptrmap_shard_t;
+typedef struct cd_ptrmap_item_s cd_ptrmap_item_t;
+typedef struct cd_arena_s cd_arena_t;
+typedef struct cd_arena_slab_s cd_arena_slab_t;
 typedef struct cd_writebuf_s cd_writebuf_t;
 typedef struct cd_splay_s cd_splay_t;
 typedef int (*cd_splay_sort_cb)(const void*, const void*);
@@ -14,10 +23,19 @@ typedef struct cd_splay_node_s cd_splay_node_t;
 struct cd_hashmap_item_s {
   const char* key;
   unsigned int key_len;
+  uint32_t hash;
   void* value;
 };
 
+/*
+ * Open addressing with Robin Hood linear probing over a power-of-two table.
+ * Hashes are stored in the items, so they are compared before the keys and
+ * are not recomputed on growth. Deletion shifts the rest of the probe chain
+ * back, there are no tombstones.
+ */
 struct cd_hashmap_s {
+  unsigned int size;
+  unsigned int mask;
   unsigned int count;
   cd_hashmap_item_t* items;
 
@@ -25,10 +43,62 @@ struct cd_hashmap_s {
   int ptr;
 };
 
+struct cd_ptrmap_item_s {
+  /* Zero - empty slot */
+  uint64_t key;
+  void* value;
+};
+
+struct cd_ptrmap_shard_s {
+  cd_ptrmap_item_t* items;
+  unsigned int shift;
+  unsigned int mask;
+  unsigned int count;
+};
+
+/*
+ * Map from non-zero addresses, split into independently locked shards.
+ * Keys are stored inline and hashed with a single multiplication, there is
+ * no deletion.
+ */
+struct cd_ptrmap_s {
+  cd_ptrmap_shard_t shards[CD_PTRMAP_SHARD_COUNT];
+  pthread_mutex_t locks[CD_PTRMAP_SHARD_COUNT];
+
+  /* If false - no locking is performed */
+  int locked;
+};
+
+/* Bump allocator, everything is released at once by cd_arena_destroy() */
+struct cd_arena_s {
+  cd_arena_slab_t* slabs;
+  char* pos;
+  char* end;
+  unsigned int slab_size;
+
+  struct {
+    uint64_t allocs;
+    uint64_t bytes;
+    uint64_t slabs;
+  } stats;
+};
+
+struct cd_arena_slab_s {
+  cd_arena_slab_t* next;
+
+  /* Keep the data aligned */
+  union {
+    double d;
+    void* p;
+    uint64_t u;
+  } data[1];
+};
+
 struct cd_writebuf_s {
   int fd;
   unsigned int off;
   unsigned int size;
+  uint64_t written;
 
   char* buf;
 };
@@ -48,9 +118,13 @@ struct cd_splay_node_s {
 
 uint32_t cd_murmur3(const char* str, unsigned int len);
 
+/* `count` is a hint, the number of items to fit without growing */
 int cd_hashmap_init(cd_hashmap_t* map, unsigned int count, int ptr);
 void cd_hashmap_destroy(cd_hashmap_t* map);
 
+/* Grow once to fit `count` items, instead of doubling on the way */
+int cd_hashmap_reserve(cd_hashmap_t* map, unsigned int count);
+
 int cd_hashmap_insert(cd_hashmap_t* map,
                       const char* key,
                       unsigned int key_len,
@@ -62,12 +136,47 @@ void cd_hashmap_delete(cd_hashmap_t* map,
                        const char* key,
                        unsigned int key_len);
 
+int cd_ptrmap_init(cd_ptrmap_t* map, unsigned int count);
+void cd_ptrmap_destroy(cd_ptrmap_t* map);
+
+/* Lookups and inserts are done on the shard, while it is acquired */
+cd_ptrmap_shard_t* cd_ptrmap_acquire(cd_ptrmap_t* map, uint64_t key);
+void cd_ptrmap_release(cd_ptrmap_t* map, cd_ptrmap_shard_t* shard);
+void* cd_ptrmap_get(cd_ptrmap_shard_t* shard, uint64_t key);
+int cd_ptrmap_insert(cd_ptrmap_shard_t* shard, uint64_t key, void* value);
+
+/* Hint that `key` is going to be looked up soon, needs no acquire */
+void cd_ptrmap_prefetch(cd_ptrmap_t* map, uint64_t key);
+
+void cd_arena_init(cd_arena_t* arena, unsigned int slab_size);
+void cd_arena_destroy(cd_arena_t* arena);
+
+void* cd_arena_alloc(cd_arena_t* arena, unsigned int size);
+void cd_arena_merge(cd_arena_t* arena, cd_arena_t* other);
+
 int cd_writebuf_init(cd_writebuf_t* buf, int fd, unsigned int size);
 void cd_writebuf_destroy(cd_writebuf_t* buf);
 
 int cd_writebuf_put(cd_writebuf_t* buf, char* fmt, ...);
 void cd_writebuf_flush(cd_writebuf_t* buf);
 
+/* No formatting, for the bulk of the output */
+void cd_writebuf_put_raw(cd_writebuf_t* buf, const char* str, unsigned int len);
+void cd_writebuf_put_int(cd_writebuf_t* buf, int64_t num);
+
+/*
+ * Room for `len` bytes (at most `buf->size`) to be written in place, then
+ * `buf->off` is advanced by the number of bytes actually written.
+ */
+char* cd_writebuf_reserve(cd_writebuf_t* buf, unsigned int len);
+
+/* Little-endian binary output */
+void cd_writebuf_put_u32(cd_writebuf_t* buf, uint32_t num);
+void cd_writebuf_put_u64(cd_writebuf_t* buf, uint64_t num);
+
+#define CD_WRITEBUF_PUT_LIT(buf, lit)                                         \
+    cd_writebuf_put_raw((buf), (lit), sizeof(lit) - 1)
+
 void cd_splay_init(cd_splay_t* splay, cd_splay_sort_cb sort_cb);
 void cd_splay_destroy(cd_splay_t* splay);
 
@@ -34,6 +34,7 @@ typedef enum cd_error_code_e cd_error_code_t;
     V(DwarfInvalidAugment, 0x1c)                                              \
     V(DwarfInstruction, 0x1d)                                                 \
     V(DwarfNoCFA, 0x1e)                                                       \
+    V(SnapshotOOB, 0x1f)                                                      \
 
 #define CD_ERROR_DECL(X, Y) kCDErr##X = Y,
 
@@ -1,6 +1,8 @@
 #ifndef SRC_OBJ_COMMON_H_
 #define SRC_OBJ_COMMON_H_
 
+#include <stdint.h>
+
 /* Forward declarations */
 struct cd_obj_s;
 
@@ -13,6 +15,9 @@ typedef cd_error_t (*cd_iterate_stack_cb)(struct cd_obj_s* obj,
 
 
 struct cd_obj_thread_s {
+  /* OS thread id, 0 if unknown */
+  int tid;
+
   struct {
     unsigned int count;
     /* XXX Support variable register count? */
@@ -11,11 +11,14 @@
 /* Forward declarations */
 struct cd_obj_s;
 struct cd_dwarf_cfa_s;
+struct cd_cache_s;
 
 typedef struct cd_obj_method_s cd_obj_method_t;
 typedef struct cd_segment_s cd_segment_t;
+typedef struct cd_seg_index_s cd_seg_index_t;
 typedef struct cd_sym_s cd_sym_t;
 typedef struct cd_obj_opts_s cd_obj_opts_t;
+typedef struct cd_obj_dso_s cd_obj_dso_t;
 
 typedef cd_error_t (*cd_obj_iterate_sym_cb)(struct cd_obj_s* obj,
                                             cd_sym_t* sym,
@@ -33,6 +36,8 @@ typedef int (*cd_obj_method_is_core_t)(struct cd_obj_s* obj);
 typedef cd_error_t (*cd_obj_method_get_thread_t)(struct cd_obj_s* obj,
                                                  unsigned int index,
                                                  cd_obj_thread_t* thread);
+typedef cd_error_t (*cd_obj_method_get_thread_count_t)(struct cd_obj_s* obj,
+                                                       unsigned int* count);
 typedef cd_error_t (*cd_obj_method_iterate_syms_t)(struct cd_obj_s* obj,
                                                    cd_obj_iterate_sym_cb cb,
                                                    void* arg);
@@ -45,6 +50,43 @@ typedef cd_error_t (*cd_obj_method_get_dbg_frame_t)(struct cd_obj_s* obj,
                                                     uint64_t* vmaddr);
 typedef cd_error_t (*cd_obj_method_use_binary_t)(struct cd_obj_s* obj,
                                                  struct cd_obj_s* binary);
+typedef cd_error_t (*cd_obj_method_get_sym_t)(struct cd_obj_s* obj,
+                                              const char* sym,
+                                              uint64_t* addr);
+typedef cd_error_t (*cd_obj_method_get_build_id_t)(struct cd_obj_s* obj,
+                                                   void** id,
+                                                   int* len);
+
+/*
+ * Immutable lookup table over segments, built once by `cd_obj_init_segments`.
+ * Both arrays are 1-based and use Eytzinger (BFS) order, so a lookup touches
+ * neighbouring cache lines on its way down. Only `last` is written after the
+ * build, and only with atomic stores, so concurrent readers are fine.
+ */
+struct cd_seg_index_s {
+  int count;
+  uint64_t* starts;
+  cd_segment_t** segs;
+
+  /* Eytzinger index of the last hit */
+  int last;
+
+  /* Bit per hashed 1MB granule that may hold heap, see CD_OBJ_MAY_HAVE */
+  uint64_t* filter;
+};
+
+#define CD_SEG_FILTER_BITS 16
+#define CD_SEG_FILTER_SHIFT 20
+
+#define CD_SEG_FILTER_INDEX(addr)                                             \
+    ((uint32_t) ((((uint64_t) (addr) >> CD_SEG_FILTER_SHIFT) *                \
+        0x9e3779b97f4a7c15ULL) >> (64 - CD_SEG_FILTER_BITS)))
+
+/* Zero only if no heap segment of the initialized `obj` contains `addr` */
+#define CD_OBJ_MAY_HAVE(obj, addr)                                            \
+    ((obj)->seg_index.filter == NULL ||                                       \
+     (((obj)->seg_index.filter[CD_SEG_FILTER_INDEX(addr) >> 6] >>             \
+         (CD_SEG_FILTER_INDEX(addr) & 63)) & 1))
 
 #define CD_OBJ_INTERNAL_FIELDS                                                \
     QUEUE member;                                                             \
@@ -55,14 +97,23 @@ typedef cd_error_t (*cd_obj_method_use_binary_t)(struct cd_obj_s* obj,
     size_t size;                                                              \
     int is_x64;                                                               \
     cd_hashmap_t syms;                                                        \
-    cd_splay_t sym_splay;                                                     \
+    cd_sym_t* sym_index;                                                      \
+    int sym_count;                                                            \
     int has_syms;                                                             \
+    int has_sym_names;                                                        \
     cd_segment_t* segments;                                                   \
     int segment_count;                                                        \
-    cd_splay_t seg_splay;                                                     \
+    cd_seg_index_t seg_index;                                                 \
     QUEUE dso;                                                                \
+    QUEUE lazy_dso;                                                           \
     int64_t aslr;                                                             \
     struct cd_dwarf_cfa_s* cfa;                                               \
+    /* Guards lazy initialization of `syms`, `cfa` and `lazy_dso` */          \
+    pthread_mutex_t lock;                                                     \
+    /* `--cache-dir`, and the mapped caches that `syms` and `cfa` use */      \
+    const char* cache_dir;                                                    \
+    struct cd_cache_s* sym_cache;                                             \
+    struct cd_cache_s* fde_cache;                                             \
 
 struct cd_obj_method_s {
   cd_obj_method_new_t obj_new;
@@ -73,6 +124,21 @@ struct cd_obj_method_s {
   cd_obj_method_iterate_segs_t obj_iterate_segs;
   cd_obj_method_get_dbg_frame_t obj_get_dbg_frame;
   cd_obj_method_use_binary_t obj_use_binary;
+
+  /*
+   * Optional, lookup by the object's own hash table. Returns unrelocated
+   * value, or `kCDErrSkip` if there is no such table.
+   */
+  cd_obj_method_get_sym_t obj_get_sym;
+
+  /* Optional, sorted FDE table for the `obj_get_dbg_frame`'s section */
+  cd_obj_method_get_dbg_frame_t obj_get_dbg_frame_hdr;
+
+  /* Optional, `obj_get_thread` is probed until it fails otherwise */
+  cd_obj_method_get_thread_count_t obj_get_thread_count;
+
+  /* Optional, objects without it are never cached */
+  cd_obj_method_get_build_id_t obj_get_build_id;
 };
 
 struct cd_segment_s {
@@ -80,6 +146,8 @@ struct cd_segment_s {
   uint64_t end;
   uint64_t fileoff;
   uint64_t sects;
+  int writable;
+  int mapped_file;
 
   char* ptr;
 };
@@ -96,11 +164,33 @@ struct cd_obj_opts_s {
   uint64_t reloc;
 };
 
+/*
+ * DSO known only by its path and mapped address range, it is opened by the
+ * first lookup that needs it.
+ */
+struct cd_obj_dso_s {
+  QUEUE member;
+  cd_obj_method_t* method;
+  const char* path;
+  uint64_t start;
+  uint64_t end;
+
+  /* NULL until opened, and if the opening has failed */
+  struct cd_obj_s* obj;
+  int opened;
+};
+
 
 struct cd_obj_s* cd_obj_new_ex(cd_obj_method_t* method,
                                const char* path,
                                cd_obj_opts_t* opts,
                                cd_error_t* err);
+cd_error_t cd_obj_add_lazy_dso(struct cd_obj_s* obj,
+                               cd_obj_method_t* method,
+                               const char* path,
+                               uint64_t start,
+                               uint64_t end,
+                               cd_obj_dso_t** res);
 cd_error_t cd_obj_internal_init(struct cd_obj_s* obj);
 void cd_obj_internal_free(struct cd_obj_s* obj);
 
@@ -115,8 +205,14 @@ cd_error_t cd_obj_get_dbg_frame(struct cd_obj_s* obj,
                                 void** res,
                                 uint64_t* size,
                                 uint64_t* vmaddr);
+cd_error_t cd_obj_get_dbg_frame_hdr(struct cd_obj_s* obj,
+                                    void** res,
+                                    uint64_t* size,
+                                    uint64_t* vmaddr);
+cd_error_t cd_obj_get_build_id(struct cd_obj_s* obj, void** id, int* len);
 
 /* Internal, mostly */
 cd_error_t cd_obj_init_segments(struct cd_obj_s* obj);
+cd_segment_t* cd_obj_find_segment(struct cd_obj_s* obj, uint64_t addr);
 
 #endif  /* SRC_OBJ_OBJ_INTERNAL_H_ */
@@ -1,3 +1,4 @@
+#include "cache.h"
 #include "common.h"
 #include "error.h"
 #include "obj.h"
@@ -16,6 +17,26 @@
 
 
 static const int kCDSymtabInitialSize = 16384;
+static const uint32_t kCDCachedSymNoName = 0xffffffff;
+
+typedef struct cd_obj_sym_list_s cd_obj_sym_list_t;
+typedef struct cd_obj_cached_sym_s cd_obj_cached_sym_t;
+
+struct cd_obj_sym_list_s {
+  cd_sym_t* list;
+  int count;
+  int size;
+};
+
+/*
+ * `kCDCacheSyms` payload: u64 count, `count` of these, and the names. Values
+ * are not relocated.
+ */
+struct cd_obj_cached_sym_s {
+  uint64_t value;
+  uint32_t name;
+  uint32_t nlen;
+};
 
 static cd_error_t cd_obj_count_segs(cd_obj_t* obj,
                                     cd_segment_t* seg,
@@ -26,14 +47,39 @@ static cd_error_t cd_obj_fill_segs(cd_obj_t* obj,
 static cd_error_t cd_obj_insert_seg_ends(cd_obj_t* obj,
                                          cd_segment_t* seg,
                                          void* arg);
-static int cd_segment_sort(const cd_segment_t* a, const cd_segment_t* b);
-static int cd_symbol_sort(const cd_sym_t* a, const cd_sym_t* b);
+static cd_error_t cd_obj_init_seg_index(cd_obj_t* obj);
+static int cd_obj_fill_seg_index(cd_seg_index_t* index,
+                                 cd_segment_t** sorted,
+                                 int i,
+                                 int k);
+static int cd_segment_sort(const cd_segment_t** a, const cd_segment_t** b);
+static cd_error_t cd_obj_init_seg_filter(cd_obj_t* obj);
 static cd_error_t cd_obj_init_syms(cd_obj_t* obj);
 static cd_error_t cd_obj_insert_syms(cd_obj_t* obj,
                                      cd_sym_t* sym,
                                      void* arg);
+static cd_error_t cd_obj_init_sym_names(cd_obj_t* obj);
+static cd_error_t cd_obj_insert_sym_names(cd_obj_t* obj,
+                                          cd_sym_t* sym,
+                                          void* arg);
+static int cd_obj_push_sym(cd_obj_sym_list_t* syms,
+                           const char* name,
+                           int nlen,
+                           uint64_t value);
+static cd_sym_t* cd_obj_sort_syms(cd_sym_t* list, cd_sym_t* tmp, int count);
+static int cd_obj_find_sym(cd_obj_t* obj, uint64_t addr, cd_sym_t* res);
+static int cd_obj_find_cached_sym(cd_obj_t* obj,
+                                  uint64_t addr,
+                                  cd_sym_t* res);
+static cd_error_t cd_obj_load_sym_cache(cd_obj_t* obj);
+static void cd_obj_store_sym_cache(cd_obj_t* obj);
 static cd_error_t cd_obj_init_dwarf(cd_obj_t* obj);
+static cd_error_t cd_obj_load_fde_cache(cd_obj_t* obj,
+                                        void** hdr,
+                                        uint64_t* hdr_size);
+static void cd_obj_store_fde_cache(cd_obj_t* obj);
 static cd_error_t cd_obj_init_aslr(cd_obj_t* obj, cd_obj_opts_t* opts);
+static cd_obj_t* cd_obj_open_lazy_dso(cd_obj_t* obj, cd_obj_dso_t* dso);
 
 
 /* Wrappers around method */
@@ -111,6 +157,25 @@ cd_error_t cd_obj_get_thread(cd_obj_t* obj,
 }
 
 
+cd_error_t cd_obj_get_thread_count(cd_obj_t* obj, unsigned int* count) {
+  cd_error_t err;
+  cd_obj_thread_t thread;
+
+  if (obj->method->obj_get_thread_count != NULL)
+    return obj->method->obj_get_thread_count(obj, count);
+
+  for (*count = 0;; (*count)++) {
+    err = cd_obj_get_thread(obj, *count, &thread);
+    if (err.code == kCDErrNotFound)
+      break;
+    if (!cd_is_ok(err))
+      return err;
+  }
+
+  return cd_ok();
+}
+
+
 cd_error_t cd_obj_iterate_syms(cd_obj_t* obj,
                                cd_obj_iterate_sym_cb cb,
                                void* arg) {
@@ -126,6 +191,16 @@ cd_error_t cd_obj_get_dbg_frame(cd_obj_t* obj,
 }
 
 
+cd_error_t cd_obj_get_dbg_frame_hdr(cd_obj_t* obj,
+                                    void** res,
+                                    uint64_t* size,
+                                    uint64_t* vmaddr) {
+  if (obj->method->obj_get_dbg_frame_hdr == NULL)
+    return cd_error(kCDErrNotFound);
+  return obj->method->obj_get_dbg_frame_hdr(obj, res, size, vmaddr);
+}
+
+
 cd_error_t cd_obj_iterate_segs(cd_obj_t* obj,
                                cd_obj_iterate_seg_cb cb,
                                void* arg) {
@@ -133,11 +208,17 @@ cd_error_t cd_obj_iterate_segs(cd_obj_t* obj,
 }
 
 
+cd_error_t cd_obj_get_build_id(cd_obj_t* obj, void** id, int* len) {
+  if (obj->method->obj_get_build_id == NULL)
+    return cd_error_str(kCDErrNotFound, "build-id");
+  return obj->method->obj_get_build_id(obj, id, len);
+}
+
+
 /* Just a common implementation */
 
 
 cd_error_t cd_obj_insert_syms(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
-  cd_sym_t* copy;
   uint64_t val;
 
   /* Skip empty symbols */
@@ -145,7 +226,40 @@ cd_error_t cd_obj_insert_syms(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
     return cd_ok();
 
   val = sym->value + obj->aslr;
+  if (cd_obj_push_sym(arg, sym->name, sym->nlen, val) != 0)
+    return cd_error_str(kCDErrNoMem, "cd_sym_t");
 
+  return cd_ok();
+}
+
+
+cd_error_t cd_obj_init_sym_names(cd_obj_t* obj) {
+  if (obj->has_sym_names)
+    return cd_ok();
+
+  /* Size of the address index is known, if it was built already */
+  if (cd_hashmap_init(&obj->syms,
+                      obj->has_syms ? obj->sym_count : kCDSymtabInitialSize,
+                      0) != 0) {
+    return cd_error_str(kCDErrNoMem, "cd_hashmap_t");
+  }
+  obj->has_sym_names = 1;
+
+  if (cd_obj_is_core(obj))
+    return cd_ok();
+
+  return cd_obj_iterate_syms(obj, cd_obj_insert_sym_names, NULL);
+}
+
+
+cd_error_t cd_obj_insert_sym_names(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
+  uint64_t val;
+
+  /* Skip empty symbols */
+  if (sym->nlen == 0 || sym->value == 0)
+    return cd_ok();
+
+  val = sym->value + obj->aslr;
   if (cd_hashmap_insert(&obj->syms,
                         sym->name,
                         sym->nlen,
@@ -153,17 +267,6 @@ cd_error_t cd_obj_insert_syms(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
     return cd_error_str(kCDErrNoMem, "cd_hashmap_insert");
   }
 
-  copy = malloc(sizeof(*copy));
-  if (copy == NULL)
-    return cd_error_str(kCDErrNoMem, "cd_sym_t");
-  *copy = *sym;
-
-  /* ASLR slide value */
-  copy->value = val;
-
-  if (cd_splay_insert(&obj->sym_splay, copy) != 0)
-    free(copy);
-
   return cd_ok();
 }
 
@@ -171,50 +274,304 @@ cd_error_t cd_obj_insert_syms(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
 cd_error_t cd_obj_insert_seg_ends(cd_obj_t* obj,
                                   cd_segment_t* seg,
                                   void* arg) {
-  cd_sym_t* copy;
-
-  copy = malloc(sizeof(*copy));
-  if (copy == NULL)
+  if (cd_obj_push_sym(arg, NULL, 0, obj->aslr + seg->end) != 0)
     return cd_error_str(kCDErrNoMem, "cd_sym_t");
 
-  copy->name = NULL;
-  copy->nlen = 0;
-  copy->value = obj->aslr + seg->end;
+  return cd_ok();
+}
 
-  if (cd_splay_insert(&obj->sym_splay, copy) != 0)
-    free(copy);
 
-  return cd_ok();
+int cd_obj_push_sym(cd_obj_sym_list_t* syms,
+                    const char* name,
+                    int nlen,
+                    uint64_t value) {
+  cd_sym_t* sym;
+
+  if (syms->count == syms->size) {
+    cd_sym_t* list;
+    int size;
+
+    size = syms->size == 0 ? kCDSymtabInitialSize : syms->size * 2;
+    list = realloc(syms->list, sizeof(*list) * size);
+    if (list == NULL)
+      return -1;
+    syms->list = list;
+    syms->size = size;
+  }
+
+  sym = &syms->list[syms->count++];
+  sym->name = name;
+  sym->nlen = nlen;
+  sym->value = value;
+  sym->sect = 0;
+
+  return 0;
 }
 
 
 cd_error_t cd_obj_init_syms(cd_obj_t* obj) {
   cd_error_t err;
+  cd_obj_sym_list_t syms;
+  cd_sym_t* tmp;
+  cd_sym_t* sorted;
+  int i;
+  int j;
 
   if (obj->has_syms)
     return cd_ok();
 
-  cd_splay_init(&obj->sym_splay,
-                (int (*)(const void*, const void*)) cd_symbol_sort);
-  obj->sym_splay.allocated = 1;
-
-  if (cd_hashmap_init(&obj->syms, kCDSymtabInitialSize, 0) != 0) {
-    cd_splay_destroy(&obj->sym_splay);
-    return cd_error_str(kCDErrNoMem, "cd_hashmap_t");
-  }
   obj->has_syms = 1;
+  obj->sym_index = NULL;
+  obj->sym_count = 0;
 
   if (cd_obj_is_core(obj))
     return cd_ok();
 
+  /* Sorted by a previous run */
+  err = cd_obj_load_sym_cache(obj);
+  if (cd_is_ok(err) || err.code != kCDErrNotFound)
+    return err;
+
+  syms.list = NULL;
+  syms.count = 0;
+  syms.size = 0;
+
   /* Insert seg_ends first, to not let `_end` overwrite them on linux */
-  err = cd_obj_iterate_segs((cd_obj_t*) obj,
-                            cd_obj_insert_seg_ends,
-                            NULL);
+  err = cd_obj_iterate_segs((cd_obj_t*) obj, cd_obj_insert_seg_ends, &syms);
+  if (cd_is_ok(err))
+    err = cd_obj_iterate_syms((cd_obj_t*) obj, cd_obj_insert_syms, &syms);
+  if (!cd_is_ok(err) || syms.count == 0)
+    goto done;
+
+  tmp = malloc(sizeof(*tmp) * syms.count);
+  if (tmp == NULL) {
+    err = cd_error_str(kCDErrNoMem, "cd_sym_t tmp");
+    goto done;
+  }
+
+  /* Stable, so the first of the symbols with the same value stays first */
+  sorted = cd_obj_sort_syms(syms.list, tmp, syms.count);
+  for (i = 0, j = 0; i < syms.count; i++)
+    if (j == 0 || sorted[i].value != sorted[j - 1].value)
+      sorted[j++] = sorted[i];
+
+  if (sorted == tmp)
+    free(syms.list);
+  else
+    free(tmp);
+  obj->sym_index = sorted;
+  obj->sym_count = j;
+  cd_obj_store_sym_cache(obj);
+
+  return cd_ok();
+
+done:
+  free(syms.list);
+  return err;
+}
+
+
+cd_error_t cd_obj_load_sym_cache(cd_obj_t* obj) {
+  cd_error_t err;
+  cd_cache_t* cache;
+  uint64_t count;
+
+  if (obj->cache_dir == NULL)
+    return cd_error_str(kCDErrNotFound, "cache dir");
+
+  cache = malloc(sizeof(*cache));
+  if (cache == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_cache_t");
+
+  err = cd_cache_open(obj, kCDCacheSyms, cache);
   if (!cd_is_ok(err))
-    return err;
+    goto failed_open;
+
+  if (cache->data_size < 8) {
+    err = cd_error_str(kCDErrNotFound, "cached syms count");
+    goto failed_count;
+  }
+  count = *(uint64_t*) cache->data;
+  if ((cache->data_size - 8) / sizeof(cd_obj_cached_sym_t) < count ||
+      count > INT32_MAX) {
+    err = cd_error_str(kCDErrNotFound, "cached syms count");
+    goto failed_count;
+  }
+
+  /* Searched in place by cd_obj_find_cached_sym(), stays mapped */
+  obj->sym_count = count;
+  obj->sym_cache = cache;
+  return cd_ok();
+
+failed_count:
+  cd_cache_close(cache);
 
-  return cd_obj_iterate_syms((cd_obj_t*) obj, cd_obj_insert_syms, NULL);
+failed_open:
+  free(cache);
+  return err;
+}
+
+
+void cd_obj_store_sym_cache(cd_obj_t* obj) {
+  cd_cache_writer_t writer;
+  cd_obj_cached_sym_t cached;
+  uint64_t count;
+  uint64_t names_size;
+  int i;
+
+  if (obj->cache_dir == NULL)
+    return;
+
+  names_size = 0;
+  for (i = 0; i < obj->sym_count; i++)
+    if (obj->sym_index[i].name != NULL)
+      names_size += obj->sym_index[i].nlen + 1;
+  if (names_size >= kCDCachedSymNoName)
+    return;
+
+  /* Best effort, the next run will just parse the symbols again */
+  if (!cd_is_ok(cd_cache_begin(obj, kCDCacheSyms, &writer)))
+    return;
+
+  count = obj->sym_count;
+  cd_writebuf_put_raw(&writer.buf, (char*) &count, sizeof(count));
+
+  names_size = 0;
+  for (i = 0; i < obj->sym_count; i++) {
+    cd_sym_t* sym;
+
+    sym = &obj->sym_index[i];
+    cached.value = sym->value - obj->aslr;
+    cached.nlen = sym->nlen;
+    if (sym->name == NULL) {
+      cached.name = kCDCachedSymNoName;
+    } else {
+      cached.name = names_size;
+      names_size += sym->nlen + 1;
+    }
+    cd_writebuf_put_raw(&writer.buf, (char*) &cached, sizeof(cached));
+  }
+
+  for (i = 0; i < obj->sym_count; i++) {
+    cd_sym_t* sym;
+
+    sym = &obj->sym_index[i];
+    if (sym->name == NULL)
+      continue;
+    cd_writebuf_put_raw(&writer.buf, sym->name, sym->nlen);
+    cd_writebuf_put_raw(&writer.buf, "", 1);
+  }
+
+  cd_cache_end(&writer);
+}
+
+
+cd_sym_t* cd_obj_sort_syms(cd_sym_t* list, cd_sym_t* tmp, int count) {
+  int counts[256];
+  int shift;
+  int i;
+
+  /* LSD radix sort by address, a byte at a time */
+  for (shift = 0; shift < 64; shift += 8) {
+    cd_sym_t* t;
+    int off;
+
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < count; i++)
+      counts[(list[i].value >> shift) & 0xff]++;
+
+    /* Every symbol has the same byte here, nothing to move */
+    if (counts[(list[0].value >> shift) & 0xff] == count)
+      continue;
+
+    for (i = 0, off = 0; i < 256; i++) {
+      int c;
+
+      c = counts[i];
+      counts[i] = off;
+      off += c;
+    }
+
+    for (i = 0; i < count; i++)
+      tmp[counts[(list[i].value >> shift) & 0xff]++] = list[i];
+
+    t = list;
+    list = tmp;
+    tmp = t;
+  }
+
+  return list;
+}
+
+
+int cd_obj_find_sym(cd_obj_t* obj, uint64_t addr, cd_sym_t* res) {
+  int lo;
+  int hi;
+
+  if (obj->sym_cache != NULL)
+    return cd_obj_find_cached_sym(obj, addr, res);
+
+  /* Find the first symbol above `addr` */
+  lo = 0;
+  hi = obj->sym_count;
+  while (lo < hi) {
+    int mid;
+
+    mid = lo + (hi - lo) / 2;
+    if (obj->sym_index[mid].value <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+    return 0;
+  *res = obj->sym_index[lo - 1];
+  return 1;
+}
+
+
+int cd_obj_find_cached_sym(cd_obj_t* obj, uint64_t addr, cd_sym_t* res) {
+  cd_obj_cached_sym_t* cached;
+  cd_obj_cached_sym_t* sym;
+  char* names;
+  uint64_t names_size;
+  int lo;
+  int hi;
+
+  cached = (cd_obj_cached_sym_t*) (obj->sym_cache->data + 8);
+  names = (char*) (cached + obj->sym_count);
+  names_size = obj->sym_cache->data + obj->sym_cache->data_size - names;
+
+  /* Same as above, values are not relocated */
+  lo = 0;
+  hi = obj->sym_count;
+  while (lo < hi) {
+    int mid;
+
+    mid = lo + (hi - lo) / 2;
+    if (cached[mid].value + obj->aslr <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+    return 0;
+  sym = &cached[lo - 1];
+
+  if (sym->name == kCDCachedSymNoName) {
+    res->name = NULL;
+  } else if (sym->name > names_size || sym->nlen > names_size - sym->name) {
+    /* Broken cache, do not read past the mapping */
+    return 0;
+  } else {
+    res->name = names + sym->name;
+  }
+  res->nlen = sym->nlen;
+  res->value = sym->value + obj->aslr;
+  res->sect = 0;
+  return 1;
 }
 
 
@@ -223,6 +580,10 @@ cd_error_t cd_obj_init_dwarf(cd_obj_t* obj) {
   void* dbg;
   uint64_t dbg_vmaddr;
   uint64_t dbg_size;
+  void* hdr;
+  uint64_t hdr_vmaddr;
+  uint64_t hdr_size;
+  int store;
 
   if (obj->cfa != NULL)
     return cd_ok();
@@ -233,22 +594,119 @@ cd_error_t cd_obj_init_dwarf(cd_obj_t* obj) {
   if (!cd_is_ok(err))
     return err;
 
-  err = cd_dwarf_parse_cfa(obj, dbg_vmaddr, dbg, dbg_size, &obj->cfa);
+  /* Without the sorted table every FDE is parsed upfront */
+  store = 0;
+  err = cd_obj_get_dbg_frame_hdr(obj, &hdr, &hdr_size, &hdr_vmaddr);
+  if (err.code == kCDErrNotFound) {
+    /* Table built by a previous run is relative to the section */
+    err = cd_obj_load_fde_cache(obj, &hdr, &hdr_size);
+    if (cd_is_ok(err)) {
+      hdr_vmaddr = dbg_vmaddr;
+    } else if (err.code == kCDErrNotFound) {
+      hdr = NULL;
+      hdr_size = 0;
+      hdr_vmaddr = 0;
+      store = 1;
+    } else {
+      return err;
+    }
+  } else if (!cd_is_ok(err)) {
+    return err;
+  }
+
+  err = cd_dwarf_parse_cfa(obj,
+                           dbg_vmaddr,
+                           dbg,
+                           dbg_size,
+                           hdr_vmaddr,
+                           hdr,
+                           hdr_size,
+                           &obj->cfa);
   if (!cd_is_ok(err))
     return err;
 
+  if (store)
+    cd_obj_store_fde_cache(obj);
+
   return cd_ok();
 }
 
 
+cd_error_t cd_obj_load_fde_cache(cd_obj_t* obj,
+                                 void** hdr,
+                                 uint64_t* hdr_size) {
+  cd_error_t err;
+  cd_cache_t* cache;
+
+  if (obj->cache_dir == NULL)
+    return cd_error_str(kCDErrNotFound, "cache dir");
+
+  cache = malloc(sizeof(*cache));
+  if (cache == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_cache_t");
+
+  err = cd_cache_open(obj, kCDCacheFDEs, cache);
+  if (!cd_is_ok(err)) {
+    free(cache);
+    return err;
+  }
+
+  /* The table is used in place */
+  obj->fde_cache = cache;
+  *hdr = cache->data;
+  *hdr_size = cache->data_size;
+  return cd_ok();
+}
+
+
+void cd_obj_store_fde_cache(cd_obj_t* obj) {
+  cd_cache_writer_t writer;
+  void* hdr;
+  uint64_t size;
+
+  if (obj->cache_dir == NULL)
+    return;
+
+  if (!cd_is_ok(cd_dwarf_build_hdr(obj->cfa, &hdr, &size)))
+    return;
+
+  /* Best effort, the next run will just parse every FDE again */
+  if (cd_is_ok(cd_cache_begin(obj, kCDCacheFDEs, &writer))) {
+    cd_writebuf_put_raw(&writer.buf, hdr, size);
+    cd_cache_end(&writer);
+  }
+  free(hdr);
+}
+
+
 cd_error_t cd_obj_get_sym(cd_obj_t* obj,
                           const char* sym,
                           uint64_t* addr) {
+  return cd_obj_get_sym_ex(obj, sym, addr, NULL);
+}
+
+
+cd_error_t cd_obj_get_sym_ex(cd_obj_t* obj,
+                             const char* sym,
+                             uint64_t* addr,
+                             cd_obj_t** owner) {
   cd_error_t err;
   void* res;
   QUEUE* q;
 
-  err = cd_obj_init_syms(obj);
+  /* Object's own hash table, if present, is much cheaper than the index */
+  err = cd_obj_get_hashed_sym(obj, sym, addr);
+  if (cd_is_ok(err)) {
+    if (owner != NULL)
+      *owner = obj;
+    return cd_ok();
+  }
+  if (err.code == kCDErrNotFound)
+    goto not_found;
+  if (err.code != kCDErrSkip)
+    return err;
+
+  err = cd_obj_init_sym_names(obj);
   if (!cd_is_ok(err))
     return err;
 
@@ -258,6 +716,8 @@ cd_error_t cd_obj_get_sym(cd_obj_t* obj,
     goto not_found;
 
   *addr = (uint64_t) res;
+  if (owner != NULL)
+    *owner = obj;
   return cd_ok();
 
 not_found:
@@ -266,7 +726,20 @@ not_found:
     cd_obj_t* dso;
 
     dso = container_of(q, cd_obj_t, member);
-    err = cd_obj_get_sym(dso, sym, addr);
+    err = cd_obj_get_sym_ex(dso, sym, addr, owner);
+    if (cd_is_ok(err) || err.code != kCDErrNotFound)
+      return err;
+  }
+
+  /* Not loaded yet, open them in the order of mapping */
+  QUEUE_FOREACH(q, &obj->lazy_dso) {
+    cd_obj_t* dso;
+
+    dso = cd_obj_open_lazy_dso(obj, container_of(q, cd_obj_dso_t, member));
+    if (dso == NULL)
+      continue;
+
+    err = cd_obj_get_sym_ex(dso, sym, addr, owner);
     if (cd_is_ok(err) || err.code != kCDErrNotFound)
       return err;
   }
@@ -275,6 +748,21 @@ not_found:
 }
 
 
+cd_error_t cd_obj_get_hashed_sym(cd_obj_t* obj,
+                                 const char* sym,
+                                 uint64_t* addr) {
+  cd_error_t err;
+
+  if (obj->method->obj_get_sym == NULL)
+    return cd_error(kCDErrSkip);
+
+  err = obj->method->obj_get_sym(obj, sym, addr);
+  if (cd_is_ok(err))
+    *addr += obj->aslr;
+  return err;
+}
+
+
 cd_error_t cd_obj_count_segs(cd_obj_t* obj,
                              cd_segment_t* seg,
                              void* arg) {
@@ -296,9 +784,6 @@ cd_error_t cd_obj_fill_segs(cd_obj_t* obj,
   /* Copy the segment */
   **ptr = *seg;
 
-  /* Fill the splay tree */
-  cd_splay_insert(&obj->seg_splay, *ptr);
-
   /* Move the pointer forward */
   *ptr = *ptr + 1;
 
@@ -314,8 +799,6 @@ cd_error_t cd_obj_init_segments(cd_obj_t* obj) {
   if (obj->segment_count != -1)
     return cd_ok();
 
-  cd_splay_init(&obj->seg_splay,
-                (int (*)(const void*, const void*)) cd_segment_sort);
   obj->segment_count = 0;
 
   err = cd_obj_iterate_segs(obj, cd_obj_count_segs, &obj->segment_count);
@@ -327,13 +810,162 @@ cd_error_t cd_obj_init_segments(cd_obj_t* obj) {
     return cd_error_str(kCDErrNoMem, "cd_segment_t");
 
   seg = obj->segments;
-  return cd_obj_iterate_segs(obj, cd_obj_fill_segs, &seg);
+  err = cd_obj_iterate_segs(obj, cd_obj_fill_segs, &seg);
+  if (!cd_is_ok(err))
+    return err;
+
+  return cd_obj_init_seg_index(obj);
+}
+
+
+int cd_obj_fill_seg_index(cd_seg_index_t* index,
+                          cd_segment_t** sorted,
+                          int i,
+                          int k) {
+  if (k > index->count)
+    return i;
+
+  /* In-order walk of the implicit tree assigns sorted entries to it */
+  i = cd_obj_fill_seg_index(index, sorted, i, 2 * k);
+  index->starts[k] = sorted[i]->start;
+  index->segs[k] = sorted[i];
+  i++;
+  return cd_obj_fill_seg_index(index, sorted, i, 2 * k + 1);
+}
+
+
+cd_error_t cd_obj_init_seg_index(cd_obj_t* obj) {
+  cd_seg_index_t* index;
+  cd_segment_t** sorted;
+  int i;
+  int j;
+
+  index = &obj->seg_index;
+  if (obj->segment_count == 0)
+    return cd_ok();
+
+  sorted = malloc(sizeof(*sorted) * obj->segment_count);
+  if (sorted == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_segment_t sorted");
+
+  for (i = 0; i < obj->segment_count; i++)
+    sorted[i] = &obj->segments[i];
+  qsort(sorted,
+        obj->segment_count,
+        sizeof(*sorted),
+        (int (*)(const void*, const void*)) cd_segment_sort);
+
+  /* Drop duplicate starts, the first segment in the object wins */
+  for (i = 1, j = 1; i < obj->segment_count; i++) {
+    if (sorted[i]->start == sorted[j - 1]->start)
+      continue;
+    sorted[j++] = sorted[i];
+  }
+
+  index->starts = malloc(sizeof(*index->starts) * (j + 1));
+  index->segs = malloc(sizeof(*index->segs) * (j + 1));
+  if (index->starts == NULL || index->segs == NULL) {
+    free(index->starts);
+    free(index->segs);
+    index->starts = NULL;
+    index->segs = NULL;
+    free(sorted);
+    return cd_error_str(kCDErrNoMem, "cd_seg_index_t");
+  }
+
+  index->count = j;
+  index->last = 1;
+  cd_obj_fill_seg_index(index, sorted, 0, 1);
+  free(sorted);
+
+  return cd_obj_init_seg_filter(obj);
+}
+
+
+cd_error_t cd_obj_init_seg_filter(cd_obj_t* obj) {
+  uint64_t* filter;
+  int size;
+  int i;
+
+  size = (1 << CD_SEG_FILTER_BITS) / 64;
+  filter = calloc(size, sizeof(*filter));
+  if (filter == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_seg_index_t filter");
+
+  for (i = 0; i < obj->segment_count; i++) {
+    cd_segment_t* seg;
+    uint64_t g;
+    uint64_t end;
+
+    /*
+     * Read-only file mappings never hold heap objects, but V8 protects some
+     * of its own anonymous pages, so these are kept.
+     */
+    seg = &obj->segments[i];
+    if (seg->start >= seg->end || (!seg->writable && seg->mapped_file))
+      continue;
+
+    /* Huge segments cover every bit anyway */
+    g = seg->start >> CD_SEG_FILTER_SHIFT;
+    end = (seg->end - 1) >> CD_SEG_FILTER_SHIFT;
+    if (end - g >= (1ULL << CD_SEG_FILTER_BITS)) {
+      memset(filter, 0xff, size * sizeof(*filter));
+      break;
+    }
+
+    for (; g <= end; g++) {
+      uint32_t bit;
+
+      bit = CD_SEG_FILTER_INDEX(g << CD_SEG_FILTER_SHIFT);
+      filter[bit >> 6] |= 1ULL << (bit & 63);
+    }
+  }
+
+  obj->seg_index.filter = filter;
+  return cd_ok();
+}
+
+
+cd_segment_t* cd_obj_find_segment(cd_obj_t* obj, uint64_t addr) {
+  cd_seg_index_t* index;
+  cd_segment_t* r;
+  int k;
+  int best;
+
+  index = &obj->seg_index;
+  if (index->count == 0)
+    return NULL;
+
+  /* Most reads hit the same segment as the previous one */
+  best = __atomic_load_n(&index->last, __ATOMIC_RELAXED);
+  r = index->segs[best];
+  if (r->start <= addr && addr < r->end)
+    return r;
+
+  /* Find the last segment with `start <= addr`, without branching on keys */
+  best = 0;
+  for (k = 1; k <= index->count; ) {
+    int le;
+
+#if defined(__GNUC__)
+    __builtin_prefetch(index->starts + 16 * k);
+#endif  /* defined(__GNUC__) */
+    le = index->starts[k] <= addr;
+    best = le ? k : best;
+    k = 2 * k + le;
+  }
+
+  /* Every segment starts after `addr` */
+  if (best == 0)
+    return NULL;
+
+  __atomic_store_n(&index->last, best, __ATOMIC_RELAXED);
+  return index->segs[best];
 }
 
 
 cd_error_t cd_obj_get(cd_obj_t* obj, uint64_t addr, uint64_t size, void** res) {
   cd_error_t err;
-  cd_segment_t idx;
   cd_segment_t* r;
 
   if (!cd_obj_is_core(obj))
@@ -343,11 +975,7 @@ cd_error_t cd_obj_get(cd_obj_t* obj, uint64_t addr, uint64_t size, void** res) {
   if (!cd_is_ok(err))
     return err;
 
-  if (obj->segment_count == 0)
-    return cd_error(kCDErrNotFound);
-
-  idx.start = addr;
-  r = cd_splay_find(&obj->seg_splay, &idx);
+  r = cd_obj_find_segment(obj, addr);
   if (r == NULL)
     return cd_error(kCDErrNotFound);
 
@@ -360,13 +988,12 @@ cd_error_t cd_obj_get(cd_obj_t* obj, uint64_t addr, uint64_t size, void** res) {
 }
 
 
-int cd_segment_sort(const cd_segment_t* a, const cd_segment_t* b) {
-  return a->start > b->start ? 1 : a->start == b->start ? 0 : -1;
-}
-
+int cd_segment_sort(const cd_segment_t** a, const cd_segment_t** b) {
+  if ((*a)->start != (*b)->start)
+    return (*a)->start > (*b)->start ? 1 : -1;
 
-int cd_symbol_sort(const cd_sym_t* a, const cd_sym_t* b) {
-  return a->value > b->value ? 1 : a->value == b->value ? 0 : -1;
+  /* Keep the object's order for equal starts */
+  return *a > *b ? 1 : *a == *b ? 0 : -1;
 }
 
 
@@ -375,27 +1002,44 @@ cd_error_t cd_obj_internal_init(cd_obj_t* obj) {
 
   /* Dynamic libraries */
   QUEUE_INIT(&obj->dso);
+  QUEUE_INIT(&obj->lazy_dso);
 
   obj->has_syms = 0;
+  obj->has_sym_names = 0;
   obj->segment_count = -1;
   obj->segments = NULL;
+  obj->seg_index.count = 0;
+  obj->seg_index.starts = NULL;
+  obj->seg_index.segs = NULL;
+  obj->seg_index.last = 0;
+  obj->seg_index.filter = NULL;
   obj->aslr = 0;
   obj->cfa = NULL;
+  obj->cache_dir = NULL;
+  obj->sym_cache = NULL;
+  obj->fde_cache = NULL;
+
+  if (pthread_mutex_init(&obj->lock, NULL) != 0)
+    return cd_error_str(kCDErrNoMem, "pthread_mutex_init(obj->lock)");
 
   return cd_ok();
 }
 
 
 void cd_obj_internal_free(cd_obj_t* obj) {
-  if (obj->has_syms) {
-    cd_splay_destroy(&obj->sym_splay);
-    cd_hashmap_destroy(&obj->syms);
-  }
+  if (obj->has_syms)
+    free(obj->sym_index);
   obj->has_syms = 0;
 
+  if (obj->has_sym_names)
+    cd_hashmap_destroy(&obj->syms);
+  obj->has_sym_names = 0;
+
   if (obj->segment_count != -1) {
     free(obj->segments);
-    cd_splay_destroy(&obj->seg_splay);
+    free(obj->seg_index.starts);
+    free(obj->seg_index.segs);
+    free(obj->seg_index.filter);
   }
 
   /* Free DSOs */
@@ -408,14 +1052,38 @@ void cd_obj_internal_free(cd_obj_t* obj) {
 
     dso->method->obj_free(dso);
   }
+  while (!QUEUE_EMPTY(&obj->lazy_dso)) {
+    QUEUE* q;
+    cd_obj_dso_t* dso;
+
+    q = QUEUE_HEAD(&obj->lazy_dso);
+    dso = container_of(q, cd_obj_dso_t, member);
+    QUEUE_REMOVE(q);
+
+    if (dso->obj != NULL)
+      cd_obj_free(dso->obj);
+    free(dso);
+  }
   if (obj->cfa != NULL) {
     cd_dwarf_free_cfa(obj->cfa);
     obj->cfa = NULL;
   }
+  if (obj->sym_cache != NULL) {
+    cd_cache_close(obj->sym_cache);
+    free(obj->sym_cache);
+    obj->sym_cache = NULL;
+  }
+  if (obj->fde_cache != NULL) {
+    cd_cache_close(obj->fde_cache);
+    free(obj->fde_cache);
+    obj->fde_cache = NULL;
+  }
 
   close(obj->fd);
   obj->fd = -1;
 
+  pthread_mutex_destroy(&obj->lock);
+
   if (!QUEUE_EMPTY(&obj->member))
     QUEUE_REMOVE(&obj->member);
 }
@@ -423,26 +1091,28 @@ void cd_obj_internal_free(cd_obj_t* obj) {
 
 cd_error_t cd_obj_lookup_ip(cd_obj_t* obj,
                             uint64_t addr,
-                            cd_sym_t** res,
+                            cd_sym_t* res,
                             cd_dwarf_fde_t** fde) {
   cd_error_t err;
-  cd_sym_t idx;
   QUEUE* q;
 
+  /* Stacks of several threads might be unwound at once */
+  pthread_mutex_lock(&obj->lock);
   err = cd_obj_init_syms(obj);
+  pthread_mutex_unlock(&obj->lock);
   if (!cd_is_ok(err))
     return err;
 
-  idx.value = addr;
-  *res = cd_splay_find(&obj->sym_splay, &idx);
-  if (*res == NULL)
+  if (!cd_obj_find_sym(obj, addr, res))
     goto not_found;
 
-  if ((*res)->name == NULL && (*res)->nlen == 0)
+  if (res->name == NULL && res->nlen == 0)
     goto not_found;
 
   /* Get FDE */
+  pthread_mutex_lock(&obj->lock);
   err = cd_obj_init_dwarf(obj);
+  pthread_mutex_unlock(&obj->lock);
   if (!cd_is_ok(err))
     return err;
 
@@ -474,6 +1144,24 @@ not_found:
       return err;
   }
 
+  /* Open only the DSO mapped at `addr` */
+  QUEUE_FOREACH(q, &obj->lazy_dso) {
+    cd_obj_dso_t* lazy;
+    cd_obj_t* dso;
+
+    lazy = container_of(q, cd_obj_dso_t, member);
+    if (addr < lazy->start || addr >= lazy->end)
+      continue;
+
+    dso = cd_obj_open_lazy_dso(obj, lazy);
+    if (dso == NULL)
+      continue;
+
+    err = cd_obj_lookup_ip(dso, addr, res, fde);
+    if (cd_is_ok(err) || err.code != kCDErrNotFound)
+      return err;
+  }
+
   return cd_error(kCDErrNotFound);
 }
 
@@ -499,10 +1187,8 @@ cd_error_t cd_obj_iterate_stack(cd_obj_t* obj,
   if (!cd_is_ok(err))
     return err;
 
-  while (cur.stack.top >= start &&
-         cur.stack.top < start + stack_size &&
-         cur.stack.frame > 0) {
-    cd_sym_t* sym;
+  while (cur.stack.top >= start && cur.stack.top < start + stack_size) {
+    cd_sym_t sym;
     cd_dwarf_fde_t* fde;
     cd_frame_t frame;
 
@@ -511,24 +1197,24 @@ cd_error_t cd_obj_iterate_stack(cd_obj_t* obj,
     err = cd_obj_lookup_ip(obj, last.regs.ip, &sym, &fde);
     if (err.code == kCDErrNotFound) {
       fde = NULL;
-      sym = NULL;
+      sym.name = NULL;
+      sym.nlen = 0;
     } else if (!cd_is_ok(err)) {
       return err;
     }
 
     frame.ip = last.regs.ip;
-    if (sym == NULL) {
-      frame.sym = NULL;
-      frame.sym_len = 0;
-    } else {
-      frame.sym = sym->name;
-      frame.sym_len = sym->nlen;
-    }
+    frame.sym = sym.name;
+    frame.sym_len = sym.nlen;
 
     /* No FDE case, just use defaults */
     if (fde == NULL) {
       uint64_t off;
 
+      /* Can't follow the frame pointer */
+      if (last.stack.frame < start || last.stack.frame >= start + stack_size)
+        break;
+
       off = last.stack.frame - start;
 
       /* Next frame */
@@ -573,6 +1259,97 @@ cd_error_t cd_obj_add_dso(cd_obj_t* obj, cd_obj_t* dso) {
 }
 
 
+cd_error_t cd_obj_add_lazy_dso(cd_obj_t* obj,
+                               cd_obj_method_t* method,
+                               const char* path,
+                               uint64_t start,
+                               uint64_t end,
+                               cd_obj_dso_t** res) {
+  cd_obj_dso_t* dso;
+
+  dso = malloc(sizeof(*dso));
+  if (dso == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_obj_dso_t");
+
+  dso->method = method;
+  dso->path = path;
+  dso->start = start;
+  dso->end = end;
+  dso->obj = NULL;
+  dso->opened = 0;
+  QUEUE_INSERT_TAIL(&obj->lazy_dso, &dso->member);
+
+  if (res != NULL)
+    *res = dso;
+  return cd_ok();
+}
+
+
+cd_obj_t* cd_obj_open_lazy_dso(cd_obj_t* obj, cd_obj_dso_t* dso) {
+  cd_obj_t* res;
+
+  /* Stacks of several threads might hit the same DSO */
+  pthread_mutex_lock(&obj->lock);
+  if (!dso->opened) {
+    cd_error_t err;
+    cd_obj_opts_t opts;
+
+    /* Missing or broken DSOs are just skipped */
+    opts.parent = NULL;
+    opts.reloc = dso->start;
+    dso->obj = cd_obj_new_ex(dso->method, dso->path, &opts, &err);
+    if (dso->obj != NULL)
+      dso->obj->cache_dir = obj->cache_dir;
+    dso->opened = 1;
+  }
+  res = dso->obj;
+  pthread_mutex_unlock(&obj->lock);
+
+  return res;
+}
+
+
+cd_error_t cd_obj_iterate_dsos(cd_obj_t* obj,
+                               cd_obj_iterate_dso_cb cb,
+                               void* arg) {
+  cd_error_t err;
+  QUEUE* q;
+
+  QUEUE_FOREACH(q, &obj->dso) {
+    err = cb(container_of(q, cd_obj_t, member), arg);
+    if (!cd_is_ok(err))
+      goto done;
+  }
+
+  QUEUE_FOREACH(q, &obj->lazy_dso) {
+    cd_obj_t* dso;
+
+    dso = cd_obj_open_lazy_dso(obj, container_of(q, cd_obj_dso_t, member));
+    if (dso == NULL)
+      continue;
+
+    err = cb(dso, arg);
+    if (!cd_is_ok(err))
+      goto done;
+  }
+
+  return cd_ok();
+
+done:
+  return err.code == kCDErrSkip ? cd_ok() : err;
+}
+
+
+void cd_obj_set_cache_dir(cd_obj_t* obj, const char* dir) {
+  QUEUE* q;
+
+  /* Lazy DSOs get it when opened */
+  obj->cache_dir = dir;
+  QUEUE_FOREACH(q, &obj->dso)
+    cd_obj_set_cache_dir(container_of(q, cd_obj_t, member), dir);
+}
+
+
 cd_error_t cd_obj_add_binary(cd_obj_t* obj, cd_obj_t* dso) {
   /*
    * No other DSOs found when loading the core, use link info from the
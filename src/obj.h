@@ -13,6 +13,8 @@ struct cd_dwarf_fde_s;
 
 typedef struct cd_obj_s cd_obj_t;
 
+typedef cd_error_t (*cd_obj_iterate_dso_cb)(cd_obj_t* dso, void* arg);
+
 struct cd_obj_s {
   CD_OBJ_INTERNAL_FIELDS
 };
@@ -25,16 +27,32 @@ int cd_obj_is_x64(cd_obj_t* obj);
 int cd_obj_is_core(cd_obj_t* obj);
 cd_error_t cd_obj_add_binary(cd_obj_t* obj, cd_obj_t* dso);
 cd_error_t cd_obj_add_dso(cd_obj_t* obj, cd_obj_t* dso);
+/* Open lazy DSOs on the way, `kCDErrSkip` from `cb` stops the iteration */
+cd_error_t cd_obj_iterate_dsos(cd_obj_t* obj,
+                               cd_obj_iterate_dso_cb cb,
+                               void* arg);
+/* Objects and their DSOs will use the cache in `dir`, see `cache.h` */
+void cd_obj_set_cache_dir(cd_obj_t* obj, const char* dir);
 
 cd_error_t cd_obj_get(cd_obj_t* obj, uint64_t addr, uint64_t size, void** res);
 cd_error_t cd_obj_get_sym(cd_obj_t* obj, const char* sym, uint64_t* addr);
+/* Lookup in `obj` only, `kCDErrSkip` if it has no hash table of symbols */
+cd_error_t cd_obj_get_hashed_sym(cd_obj_t* obj,
+                                 const char* sym,
+                                 uint64_t* addr);
+/* Same as `cd_obj_get_sym`, `owner` is the object (or DSO) defining it */
+cd_error_t cd_obj_get_sym_ex(cd_obj_t* obj,
+                             const char* sym,
+                             uint64_t* addr,
+                             cd_obj_t** owner);
 cd_error_t cd_obj_lookup_ip(cd_obj_t* obj,
                             uint64_t addr,
-                            cd_sym_t** sym,
+                            cd_sym_t* sym,
                             struct cd_dwarf_fde_s** fde);
 cd_error_t cd_obj_get_thread(cd_obj_t* obj,
                              unsigned int index,
                              cd_obj_thread_t* thread);
+cd_error_t cd_obj_get_thread_count(cd_obj_t* obj, unsigned int* count);
 cd_error_t cd_obj_iterate_stack(cd_obj_t* obj,
                                 int thread_id,
                                 cd_iterate_stack_cb cb,
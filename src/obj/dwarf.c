@@ -10,17 +10,37 @@
 #include <string.h>
 #include <stdio.h>
 
+static const int kCDDwarfRowsInitialSize = 64;
+static const int kCDDwarfRowsInitialCount = 8;
+
 static void cd_dwarf_free_cie(cd_dwarf_cie_t* fde);
 static void cd_dwarf_free_fde(cd_dwarf_fde_t* fde);
 static cd_error_t cd_dwarf_parse_cie_aug(cd_dwarf_cie_t* cie,
                                          char** data,
                                          uint64_t size);
+static cd_error_t cd_dwarf_parse_hdr(cd_dwarf_cfa_t* cfa,
+                                     uint64_t addr,
+                                     char* data,
+                                     uint64_t size);
 static cd_error_t cd_dwarf_parse_cie(cd_dwarf_cfa_t* cfa,
                                      char** data,
                                      uint64_t size);
+static cd_error_t cd_dwarf_parse_cie_header(cd_dwarf_cfa_t* cfa,
+                                            char** data,
+                                            uint64_t* size,
+                                            cd_dwarf_cie_t** res);
+static cd_error_t cd_dwarf_find_cie(cd_dwarf_cfa_t* cfa,
+                                    char* ptr,
+                                    cd_dwarf_cie_t** res);
 static cd_error_t cd_dwarf_parse_fde(cd_dwarf_cfa_t* cfa,
                                      char** data,
                                      uint64_t size);
+static cd_error_t cd_dwarf_find_fde(cd_dwarf_cfa_t* cfa,
+                                    uint64_t addr,
+                                    cd_dwarf_fde_t** res);
+static cd_error_t cd_dwarf_lookup_fde(cd_dwarf_cfa_t* cfa,
+                                      uint64_t addr,
+                                      cd_dwarf_fde_t** res);
 static cd_error_t cd_dwarf_leb128(char** data, uint64_t size, uint64_t* res);
 static cd_error_t cd_dwarf_sleb128(char** data, uint64_t size, int64_t* res);
 static cd_error_t cd_dwarf_read(char** data,
@@ -33,9 +53,18 @@ cd_error_t cd_dwarf_run(cd_dwarf_cie_t* cie,
                         uint64_t instr_len,
                         uint64_t rip,
                         cd_dwarf_state_t* prev,
-                        cd_dwarf_state_t* state);
+                        cd_dwarf_state_t* state,
+                        cd_dwarf_rows_t* rows);
+static int cd_dwarf_push_row(cd_dwarf_rows_t* rows, cd_dwarf_state_t* state);
+static cd_error_t cd_dwarf_get_rows(cd_dwarf_fde_t* fde,
+                                    cd_dwarf_rows_t** res);
+static cd_error_t cd_dwarf_compile_fde(cd_dwarf_fde_t* fde,
+                                       cd_dwarf_rows_t** res);
+static cd_dwarf_state_t* cd_dwarf_find_row(cd_dwarf_rows_t* rows,
+                                           uint64_t loc);
 static int cd_dwarf_sort_cie(cd_dwarf_cie_t* a, cd_dwarf_cie_t* b);
 static int cd_dwarf_sort_fde(cd_dwarf_fde_t* a, cd_dwarf_fde_t* b);
+static int cd_dwarf_sort_hdr(const int32_t* a, const int32_t* b);
 static cd_error_t cd_dwarf_treg(cd_obj_thread_t* thread,
                                 cd_dwarf_reg_t reg,
                                 uint64_t** res);
@@ -57,6 +86,9 @@ cd_error_t cd_dwarf_parse_cfa(cd_obj_t* obj,
                               uint64_t sect_addr,
                               void* data,
                               uint64_t size,
+                              uint64_t hdr_addr,
+                              void* hdr,
+                              uint64_t hdr_size,
                               cd_dwarf_cfa_t** res) {
   cd_dwarf_cfa_t* cfa;
   cd_error_t err;
@@ -69,11 +101,40 @@ cd_error_t cd_dwarf_parse_cfa(cd_obj_t* obj,
   QUEUE_INIT(&cfa->cies);
   cfa->obj = obj;
   cfa->start = (char*) data;
+  cfa->size = size;
   cfa->sect_addr = sect_addr;
+  cfa->hdr.addr = 0;
+  cfa->hdr.table = NULL;
+  cfa->hdr.count = 0;
 
   cd_splay_init(&cfa->cie_splay, (cd_splay_sort_cb) cd_dwarf_sort_cie);
   cd_splay_init(&cfa->fde_splay, (cd_splay_sort_cb) cd_dwarf_sort_fde);
 
+  QUEUE_INIT(&cfa->rows);
+  if (cd_hashmap_init(&cfa->rows_map, kCDDwarfRowsInitialSize, 1) != 0) {
+    cd_splay_destroy(&cfa->cie_splay);
+    cd_splay_destroy(&cfa->fde_splay);
+    free(cfa);
+    return cd_error_str(kCDErrNoMem, "cd_dwarf_cfa_t rows_map");
+  }
+  if (pthread_mutex_init(&cfa->lock, NULL) != 0) {
+    cd_hashmap_destroy(&cfa->rows_map);
+    cd_splay_destroy(&cfa->cie_splay);
+    cd_splay_destroy(&cfa->fde_splay);
+    free(cfa);
+    return cd_error_str(kCDErrNoMem, "pthread_mutex_init(cfa->lock)");
+  }
+
+  /* Use the sorted table if it is usable, everything else is lazy then */
+  if (hdr != NULL) {
+    err = cd_dwarf_parse_hdr(cfa, hdr_addr, hdr, hdr_size);
+    if (cd_is_ok(err)) {
+      *res = cfa;
+      return cd_ok();
+    }
+    cfa->hdr.table = NULL;
+  }
+
   /* Parse CIEs one-by-one */
   end = (char*) data + size;
   while (data < end) {
@@ -102,12 +163,86 @@ void cd_dwarf_free_cfa(cd_dwarf_cfa_t* cfa) {
 
     cd_dwarf_free_cie(cie);
   }
+  while (!QUEUE_EMPTY(&cfa->rows)) {
+    cd_dwarf_rows_t* rows;
+
+    q = QUEUE_HEAD(&cfa->rows);
+    QUEUE_REMOVE(q);
+    rows = container_of(q, cd_dwarf_rows_t, member);
+
+    free(rows->list);
+    free(rows);
+  }
+  cd_hashmap_destroy(&cfa->rows_map);
   cd_splay_destroy(&cfa->cie_splay);
   cd_splay_destroy(&cfa->fde_splay);
+  pthread_mutex_destroy(&cfa->lock);
   free(cfa);
 }
 
 
+cd_error_t cd_dwarf_build_hdr(cd_dwarf_cfa_t* cfa, void** res, uint64_t* size) {
+  QUEUE* q;
+  QUEUE* r;
+  char* hdr;
+  int32_t* table;
+  uint64_t count;
+  uint64_t i;
+
+  if (cfa->hdr.table != NULL)
+    return cd_error_str(kCDErrSkip, "eh_frame_hdr is present");
+
+  count = 0;
+  QUEUE_FOREACH(q, &cfa->cies)
+    QUEUE_FOREACH(r, &container_of(q, cd_dwarf_cie_t, member)->fdes)
+      count++;
+  if (count > UINT32_MAX)
+    return cd_error_str(kCDErrSkip, "eh_frame_hdr count");
+
+  *size = 12 + count * 8;
+  hdr = malloc(*size);
+  if (hdr == NULL)
+    return cd_error_str(kCDErrNoMem, "eh_frame_hdr");
+
+  /* Version, encodings of: eh_frame_ptr, fde_count, table */
+  hdr[0] = 1;
+  hdr[1] = kCDDwarfEncUData4;
+  hdr[2] = kCDDwarfEncUData4;
+  hdr[3] = kCDDwarfEncDatarel | kCDDwarfEncSData4;
+  *(uint32_t*) (hdr + 4) = 0;
+  *(uint32_t*) (hdr + 8) = count;
+
+  table = (int32_t*) (hdr + 12);
+  i = 0;
+  QUEUE_FOREACH(q, &cfa->cies) {
+    QUEUE_FOREACH(r, &container_of(q, cd_dwarf_cie_t, member)->fdes) {
+      cd_dwarf_fde_t* fde;
+      int64_t loc;
+      int64_t off;
+
+      fde = container_of(r, cd_dwarf_fde_t, member);
+      loc = fde->init_loc - cfa->sect_addr;
+      off = fde->start - cfa->start;
+      if (loc < INT32_MIN || loc > INT32_MAX || off > INT32_MAX) {
+        free(hdr);
+        return cd_error_str(kCDErrSkip, "eh_frame_hdr entry");
+      }
+
+      table[i * 2] = loc;
+      table[i * 2 + 1] = off;
+      i++;
+    }
+  }
+  qsort(table,
+        count,
+        sizeof(*table) * 2,
+        (int (*)(const void*, const void*)) cd_dwarf_sort_hdr);
+
+  *res = hdr;
+  return cd_ok();
+}
+
+
 void cd_dwarf_free_cie(cd_dwarf_cie_t* cie) {
   QUEUE* q;
   while (!QUEUE_EMPTY(&cie->fdes)) {
@@ -302,14 +437,96 @@ cd_error_t cd_dwarf_parse_cie_aug(cd_dwarf_cie_t* cie,
 }
 
 
+cd_error_t cd_dwarf_parse_hdr(cd_dwarf_cfa_t* cfa,
+                              uint64_t addr,
+                              char* data,
+                              uint64_t size) {
+  cd_error_t err;
+  char* end;
+  uint8_t ptr_enc;
+  uint8_t count_enc;
+  uint8_t table_enc;
+  uint64_t tmp;
+
+  end = data + size;
+  if (size < 4)
+    return cd_error_str(kCDErrDwarfOOB, "eh_frame_hdr header");
+
+  /* Only the table that linkers emit: 32-bit offsets from the header */
+  ptr_enc = *(uint8_t*) (data + 1);
+  count_enc = *(uint8_t*) (data + 2);
+  table_enc = *(uint8_t*) (data + 3);
+  if (*(uint8_t*) data != 1 ||
+      ptr_enc == 0xff ||
+      count_enc == 0xff ||
+      (count_enc & kCDDwarfEncAppMask) != 0 ||
+      table_enc != (kCDDwarfEncDatarel | kCDDwarfEncSData4)) {
+    return cd_error_str(kCDErrSkip, "eh_frame_hdr encoding");
+  }
+  data += 4;
+
+  err = cd_dwarf_read(&data, end - data, ptr_enc, cfa->obj->is_x64, &tmp);
+  if (!cd_is_ok(err))
+    return err;
+  err = cd_dwarf_read(&data,
+                      end - data,
+                      count_enc,
+                      cfa->obj->is_x64,
+                      &cfa->hdr.count);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (data > end || (uint64_t) (end - data) / 8 < cfa->hdr.count)
+    return cd_error_str(kCDErrDwarfOOB, "eh_frame_hdr table");
+
+  cfa->hdr.addr = addr;
+  cfa->hdr.table = (int32_t*) data;
+
+  return cd_ok();
+}
+
+
 cd_error_t cd_dwarf_parse_cie(cd_dwarf_cfa_t* cfa,
                               char** data,
                               uint64_t size) {
   cd_error_t err;
   cd_dwarf_cie_t* cie;
+
+  err = cd_dwarf_parse_cie_header(cfa, data, &size, &cie);
+  if (!cd_is_ok(err))
+    return err;
+
+  do {
+    char* start;
+
+    start = *data;
+    err = cd_dwarf_parse_fde(cfa, data, size);
+    if (err.code == kCDErrSkip) {
+      /* Revert lookup */
+      *data = start;
+    } else {
+      size -= *data - start;
+    }
+  } while (cd_is_ok(err));
+  if (!cd_is_ok(err) && err.code != kCDErrSkip)
+    return err;
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_dwarf_parse_cie_header(cd_dwarf_cfa_t* cfa,
+                                     char** data,
+                                     uint64_t* psize,
+                                     cd_dwarf_cie_t** res) {
+  cd_error_t err;
+  cd_dwarf_cie_t* cie;
   char* end;
+  uint64_t size;
   int x64;
 
+  size = *psize;
+
   cie = malloc(sizeof(*cie));
   if (cie == NULL)
     return cd_error_str(kCDErrNoMem, "cd_dwarf_cie_t");
@@ -389,23 +606,11 @@ cd_error_t cd_dwarf_parse_cie(cd_dwarf_cfa_t* cfa,
     goto fatal;
   }
 
-  do {
-    char* start;
-
-    start = *data;
-    err = cd_dwarf_parse_fde(cfa, data, size);
-    if (err.code == kCDErrSkip) {
-      /* Revert lookup */
-      *data = start;
-    } else {
-      size -= *data - start;
-    }
-  } while (cd_is_ok(err));
-  if (!cd_is_ok(err) && err.code != kCDErrSkip)
-    goto fatal;
-
+  /* FDEs are owned by the CIE, and freed with it */
   QUEUE_INSERT_TAIL(&cfa->cies, &cie->member);
 
+  *psize = size;
+  *res = cie;
   return cd_ok();
 
 fatal:
@@ -414,11 +619,33 @@ fatal:
 }
 
 
+cd_error_t cd_dwarf_find_cie(cd_dwarf_cfa_t* cfa,
+                             char* ptr,
+                             cd_dwarf_cie_t** res) {
+  cd_dwarf_cie_t idx;
+  uint64_t size;
+
+  idx.start = ptr;
+  *res = cd_splay_find(&cfa->cie_splay, &idx);
+  if (*res != NULL && (*res)->start == ptr)
+    return cd_ok();
+
+  /* All CIEs are parsed upfront without the table */
+  if (cfa->hdr.table == NULL ||
+      ptr < cfa->start ||
+      ptr >= cfa->start + cfa->size) {
+    return cd_error_str(kCDErrNotFound, "cd_dwarf_cie_t in splay");
+  }
+
+  size = cfa->start + cfa->size - ptr;
+  return cd_dwarf_parse_cie_header(cfa, &ptr, &size, res);
+}
+
+
 cd_error_t cd_dwarf_parse_fde(cd_dwarf_cfa_t* cfa, char** data, uint64_t size) {
   cd_error_t err;
   cd_dwarf_fde_t* fde;
   cd_dwarf_cie_t* cie;
-  cd_dwarf_cie_t idx;
   char* end;
   char* cie_ptr;
   int x64;
@@ -428,6 +655,8 @@ cd_error_t cd_dwarf_parse_fde(cd_dwarf_cfa_t* cfa, char** data, uint64_t size) {
   if (fde == NULL)
     return cd_error_str(kCDErrNoMem, "cd_dwarf_fde_t");
 
+  fde->start = *data;
+
   /* TODO(indutny): bounds checks */
 
   fde->len = *(uint32_t*) *data;
@@ -468,12 +697,11 @@ cd_error_t cd_dwarf_parse_fde(cd_dwarf_cfa_t* cfa, char** data, uint64_t size) {
     goto fatal;
   }
 
-  /* Find existing CIE */
+  /* Find existing CIE, or parse it if lazy */
   cie_ptr -= fde->cie_off;
-  idx.start = cie_ptr;
-  cie = cd_splay_find(&cfa->cie_splay, &idx);
-  if (cie == NULL || cie->start != cie_ptr)
-    return cd_error_str(kCDErrNotFound, "cd_dwarf_cie_t in splay");
+  err = cd_dwarf_find_cie(cfa, cie_ptr, &cie);
+  if (!cd_is_ok(err))
+    goto fatal;
 
   fde->cie = cie;
 
@@ -560,12 +788,87 @@ int cd_dwarf_sort_fde(cd_dwarf_fde_t* a, cd_dwarf_fde_t* b) {
 }
 
 
+int cd_dwarf_sort_hdr(const int32_t* a, const int32_t* b) {
+  return a[0] > b[0] ? 1 : a[0] < b[0] ? -1 : 0;
+}
+
+
 cd_error_t cd_dwarf_get_fde(cd_dwarf_cfa_t* cfa,
                             uint64_t addr,
                             cd_dwarf_fde_t** res) {
+  cd_error_t err;
+
+  pthread_mutex_lock(&cfa->lock);
+  err = cd_dwarf_find_fde(cfa, addr, res);
+  pthread_mutex_unlock(&cfa->lock);
+
+  return err;
+}
+
+
+cd_error_t cd_dwarf_find_fde(cd_dwarf_cfa_t* cfa,
+                             uint64_t addr,
+                             cd_dwarf_fde_t** res) {
   cd_dwarf_fde_t idx;
 
   idx.init_loc = addr;
+  *res = cd_splay_find(&cfa->fde_splay, &idx);
+  if (cfa->hdr.table == NULL) {
+    if (*res == NULL)
+      return cd_error_str(kCDErrNotFound, "cd_dwarf_fde_t in splay");
+    return cd_ok();
+  }
+
+  /* Parsed FDEs are cached in the splay, but there may be gaps between them */
+  if (*res != NULL && addr < (*res)->init_loc + (*res)->range)
+    return cd_ok();
+
+  return cd_dwarf_lookup_fde(cfa, addr, res);
+}
+
+
+cd_error_t cd_dwarf_lookup_fde(cd_dwarf_cfa_t* cfa,
+                               uint64_t addr,
+                               cd_dwarf_fde_t** res) {
+  cd_error_t err;
+  cd_dwarf_fde_t idx;
+  uint64_t lo;
+  uint64_t hi;
+  uint64_t fde_addr;
+  char* data;
+
+  /* Find the last entry with initial location <= addr */
+  lo = 0;
+  hi = cfa->hdr.count;
+  while (lo < hi) {
+    uint64_t mid;
+
+    mid = lo + (hi - lo) / 2;
+    if (cfa->hdr.addr + cfa->hdr.table[mid * 2] <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return cd_error_str(kCDErrNotFound, "cd_dwarf_fde_t in eh_frame_hdr");
+
+  /* Might be parsed already, if `addr` is past its range */
+  idx.init_loc = cfa->hdr.addr + cfa->hdr.table[(lo - 1) * 2];
+  *res = cd_splay_find(&cfa->fde_splay, &idx);
+  if (*res != NULL && (*res)->init_loc == idx.init_loc)
+    return cd_ok();
+
+  fde_addr = cfa->hdr.addr + cfa->hdr.table[(lo - 1) * 2 + 1];
+  if (fde_addr < cfa->sect_addr || fde_addr >= cfa->sect_addr + cfa->size)
+    return cd_error_str(kCDErrDwarfOOB, "eh_frame_hdr FDE address");
+
+  data = cfa->start + (fde_addr - cfa->sect_addr);
+  err = cd_dwarf_parse_fde(cfa, &data, cfa->start + cfa->size - data);
+  if (err.code == kCDErrSkip)
+    return cd_error_str(kCDErrNotFound, "cd_dwarf_fde_t in eh_frame_hdr");
+  if (!cd_is_ok(err))
+    return err;
+
   *res = cd_splay_find(&cfa->fde_splay, &idx);
   if (*res == NULL)
     return cd_error_str(kCDErrNotFound, "cd_dwarf_fde_t in splay");
@@ -579,7 +882,8 @@ cd_error_t cd_dwarf_run(cd_dwarf_cie_t* cie,
                         uint64_t instr_len,
                         uint64_t rip,
                         cd_dwarf_state_t* prev,
-                        cd_dwarf_state_t* state) {
+                        cd_dwarf_state_t* state,
+                        cd_dwarf_rows_t* rows) {
   cd_error_t err;
   char* end;
   char* ptr;
@@ -670,15 +974,15 @@ cd_error_t cd_dwarf_run(cd_dwarf_cie_t* cie,
       case kCDDwarfCFADefCFAOffset:
         err = cd_dwarf_leb128(&ptr, end - ptr, &arg0);
         break;
-      case kCDDwarfCFADefCFAExpression:
-        /* XXX Block?! */
-        abort();
+      case kCDDwarfCFAGNUArgsSize:
+        /* Only matters for the callee-popped arguments, ignored */
+        err = cd_dwarf_leb128(&ptr, end - ptr, &arg0);
         break;
+      /* DWARF expressions are not supported */
+      case kCDDwarfCFADefCFAExpression:
       case kCDDwarfCFAExpression:
       case kCDDwarfCFAValExpression:
-        err = cd_dwarf_leb128(&ptr, end - ptr, &arg0);
-        /* XXX arg1 - Block?! */
-        abort();
+        err = cd_error_num(kCDErrDwarfInstruction, opcode);
         break;
       case kCDDwarfCFAOffsetExtendedSF:
       case kCDDwarfCFADefCFASF:
@@ -705,6 +1009,11 @@ cd_error_t cd_dwarf_run(cd_dwarf_cie_t* cie,
       case kCDDwarfCFAAdvanceLoc1:
       case kCDDwarfCFAAdvanceLoc2:
       case kCDDwarfCFAAdvanceLoc4:
+        /* Rules are final for the current location */
+        if (rows != NULL && cd_dwarf_push_row(rows, state) != 0) {
+          err = cd_error_str(kCDErrNoMem, "dwarf rows");
+          goto fatal;
+        }
         state->loc += arg0;
         break;
       case kCDDwarfCFADefCFA:
@@ -785,7 +1094,10 @@ cd_error_t cd_dwarf_run(cd_dwarf_cie_t* cie,
           err = cd_error_str(kCDErrDwarfOOB, "dwarf history is empty");
           goto fatal;
         }
-        *state = history[--history_off];
+        /* Rules only, the location is not part of the remembered state */
+        history_off--;
+        state->cfa = history[history_off].cfa;
+        memcpy(state->regs, history[history_off].regs, sizeof(state->regs));
         break;
       default:
         break;
@@ -913,15 +1225,64 @@ cd_error_t cd_dwarf_load(cd_dwarf_state_t* state,
 }
 
 
-cd_error_t cd_dwarf_fde_run(cd_dwarf_fde_t* fde,
-                            char* stack,
-                            uint64_t stack_size,
-                            uint64_t stack_off,
-                            cd_obj_thread_t* othread,
-                            cd_obj_thread_t* nthread) {
+int cd_dwarf_push_row(cd_dwarf_rows_t* rows, cd_dwarf_state_t* state) {
+  /* Zero advance, the row is overwritten */
+  if (rows->count != 0 && rows->list[rows->count - 1].loc == state->loc) {
+    rows->list[rows->count - 1] = *state;
+    return 0;
+  }
+
+  if (rows->count == rows->size) {
+    cd_dwarf_state_t* list;
+    int size;
+
+    size = rows->size == 0 ? kCDDwarfRowsInitialCount : rows->size * 2;
+    list = realloc(rows->list, sizeof(*list) * size);
+    if (list == NULL)
+      return -1;
+    rows->list = list;
+    rows->size = size;
+  }
+
+  rows->list[rows->count++] = *state;
+  return 0;
+}
+
+
+cd_error_t cd_dwarf_get_rows(cd_dwarf_fde_t* fde, cd_dwarf_rows_t** res) {
   cd_error_t err;
+
+  pthread_mutex_lock(&fde->cie->cfa->lock);
+  err = cd_dwarf_compile_fde(fde, res);
+  pthread_mutex_unlock(&fde->cie->cfa->lock);
+
+  return err;
+}
+
+
+cd_error_t cd_dwarf_compile_fde(cd_dwarf_fde_t* fde, cd_dwarf_rows_t** res) {
+  cd_error_t err;
+  cd_dwarf_cfa_t* cfa;
+  cd_dwarf_rows_t* rows;
   cd_dwarf_state_t ist;
   cd_dwarf_state_t fst;
+  int i;
+
+  cfa = fde->cie->cfa;
+  rows = cd_hashmap_get(&cfa->rows_map, (const char*) fde, sizeof(fde));
+  if (rows != NULL) {
+    *res = rows;
+    return cd_ok();
+  }
+
+  rows = malloc(sizeof(*rows));
+  if (rows == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_dwarf_rows_t");
+  rows->count = 0;
+  rows->size = 0;
+  rows->list = NULL;
+  rows->end = UINT64_MAX;
+  rows->end_opcode = 0;
 
   memset(&ist, 0, sizeof(ist));
 
@@ -929,43 +1290,127 @@ cd_error_t cd_dwarf_fde_run(cd_dwarf_fde_t* fde,
   err = cd_dwarf_run(fde->cie,
                      fde->cie->instrs,
                      fde->cie->instr_len,
-                     othread->regs.ip,
+                     UINT64_MAX,
                      NULL,
-                     &ist);
+                     &ist,
+                     NULL);
   if (!cd_is_ok(err))
-    return err;
+    goto fatal;
 
-  /* Copy default values */
+  /* Copy default values, locations are not relocated */
   fst = ist;
-  fst.loc = fde->init_loc + fde->cie->cfa->obj->aslr;
+  fst.loc = fde->init_loc;
 
-  /* Get FDE specific stuff */
+  /* Execute everything, recording a row on each advance */
   err = cd_dwarf_run(fde->cie,
                      fde->instrs,
                      fde->instr_len,
-                     othread->regs.ip,
-                     NULL,
-                     &fst);
+                     UINT64_MAX,
+                     &ist,
+                     &fst,
+                     rows);
+  if (err.code == kCDErrDwarfInstruction) {
+    /*
+     * Rows recorded so far are final, the rules at the current location
+     * are not: lookups at or past it fail with the same error.
+     */
+    rows->end = fst.loc;
+    rows->end_opcode = err.num;
+  } else if (!cd_is_ok(err)) {
+    goto fatal;
+  } else if (cd_dwarf_push_row(rows, &fst) != 0) {
+    /* The last row lasts until the end of FDE */
+    err = cd_error_str(kCDErrNoMem, "dwarf rows");
+    goto fatal;
+  }
+
+  /* cd_dwarf_find_row() relies on it */
+  for (i = 1; i < rows->count; i++) {
+    if (rows->list[i - 1].loc >= rows->list[i].loc) {
+      err = cd_error_str(kCDErrDwarfOOB, "dwarf rows are out of order");
+      goto fatal;
+    }
+  }
+
+  if (cd_hashmap_insert(&cfa->rows_map,
+                        (const char*) fde,
+                        sizeof(fde),
+                        rows) != 0) {
+    err = cd_error_str(kCDErrNoMem, "cd_hashmap_insert(rows_map)");
+    goto fatal;
+  }
+  QUEUE_INSERT_TAIL(&cfa->rows, &rows->member);
+
+  *res = rows;
+  return cd_ok();
+
+fatal:
+  free(rows->list);
+  free(rows);
+  return err;
+}
+
+
+cd_dwarf_state_t* cd_dwarf_find_row(cd_dwarf_rows_t* rows, uint64_t loc) {
+  int lo;
+  int hi;
+
+  /* Find the last row starting at or before `loc` */
+  lo = 0;
+  hi = rows->count;
+  while (lo < hi) {
+    int mid;
+
+    mid = lo + (hi - lo) / 2;
+    if (rows->list[mid].loc <= loc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  /* Before the first advance, the first row applies */
+  return &rows->list[lo == 0 ? 0 : lo - 1];
+}
+
+
+cd_error_t cd_dwarf_fde_run(cd_dwarf_fde_t* fde,
+                            char* stack,
+                            uint64_t stack_size,
+                            uint64_t stack_off,
+                            cd_obj_thread_t* othread,
+                            cd_obj_thread_t* nthread) {
+  cd_error_t err;
+  cd_dwarf_rows_t* rows;
+  cd_dwarf_state_t* fst;
+  uint64_t loc;
+
+  /* Instructions are executed once per FDE, and cached in `cfa` */
+  err = cd_dwarf_get_rows(fde, &rows);
   if (!cd_is_ok(err))
     return err;
 
-  if (fst.cfa.type == kCDDwarfLocNone)
+  loc = othread->regs.ip - fde->cie->cfa->obj->aslr;
+  if (rows->count == 0 || loc >= rows->end)
+    return cd_error_num(kCDErrDwarfInstruction, rows->end_opcode);
+  fst = cd_dwarf_find_row(rows, loc);
+
+  if (fst->cfa.type == kCDDwarfLocNone)
     return cd_error_str(kCDErrDwarfNoCFA, "No CFA in CIE and FDE");
 
   /* Get new stack top */
   err = cd_dwarf_oreg(othread,
                       fde->cie->cfa->obj->is_x64,
-                      fst.cfa.reg,
+                      fst->cfa.reg,
                       &nthread->stack.top);
   if (!cd_is_ok(err))
     return err;
-  nthread->stack.top += fst.cfa.off;
+  nthread->stack.top += fst->cfa.off;
 
   stack += nthread->stack.top - stack_off;
   stack_size -= nthread->stack.top - stack_off;
 
   /* Get IP */
-  err = cd_dwarf_load(&fst,
+  err = cd_dwarf_load(fst,
                       othread,
                       nthread,
                       kCDDwarfRegIP,
@@ -976,7 +1421,7 @@ cd_error_t cd_dwarf_fde_run(cd_dwarf_fde_t* fde,
     return err;
 
   /* Get frame ptr */
-  err = cd_dwarf_load(&fst,
+  err = cd_dwarf_load(fst,
                       othread,
                       nthread,
                       kCDDwarfRegFrame,
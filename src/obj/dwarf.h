@@ -17,6 +17,7 @@ typedef struct cd_dwarf_fde_s cd_dwarf_fde_t;
 typedef enum cd_dwarf_enc_e cd_dwarf_enc_t;
 typedef enum cd_dwarf_cfa_instr_e cd_dwarf_cfa_instr_t;
 typedef struct cd_dwarf_state_s cd_dwarf_state_t;
+typedef struct cd_dwarf_rows_s cd_dwarf_rows_t;
 typedef enum cd_dwarf_loc_type_e cd_dwarf_loc_type_t;
 typedef struct cd_dwarf_loc_s cd_dwarf_loc_t;
 typedef enum cd_dwarf_reg_e cd_dwarf_reg_t;
@@ -26,13 +27,31 @@ struct cd_dwarf_cfa_s {
 
   struct cd_obj_s* obj;
   char* start;
+  uint64_t size;
   uint64_t sect_addr;
 
+  /*
+   * `.eh_frame_hdr`'s sorted table of (initial location, FDE address) pairs.
+   * When present, CIEs and FDEs are parsed on demand.
+   */
+  struct {
+    uint64_t addr;
+    int32_t* table;
+    uint64_t count;
+  } hdr;
+
   /* CIE file offset splay */
   cd_splay_t cie_splay;
 
   /* FDE memory offset splay */
   cd_splay_t fde_splay;
+
+  /* FDE => compiled `cd_dwarf_rows_t`, and the list of them for freeing */
+  cd_hashmap_t rows_map;
+  QUEUE rows;
+
+  /* Splays and `rows_map` are filled on demand, and are guarded by it */
+  pthread_mutex_t lock;
 };
 
 struct cd_dwarf_cie_s {
@@ -61,6 +80,7 @@ struct cd_dwarf_cie_s {
 struct cd_dwarf_fde_s {
   QUEUE member;
 
+  char* start;
   cd_dwarf_cie_t* cie;
   uint64_t len;
   uint64_t cie_off;
@@ -129,6 +149,7 @@ enum cd_dwarf_cfa_instr_e {
   kCDDwarfCFAValOffsetSF = 0x15,
   kCDDwarfCFAValExpression = 0x16,
   kCDDwarfCFALoUser = 0x17,
+  kCDDwarfCFAGNUArgsSize = 0x2e,
   kCDDwarfCFAHiUser = 0x3f
 };
 
@@ -153,6 +174,19 @@ struct cd_dwarf_state_s {
   cd_dwarf_loc_t regs[32];
 };
 
+/* FDE's instructions executed once, a row per distinct location */
+struct cd_dwarf_rows_s {
+  QUEUE member;
+
+  int count;
+  int size;
+  cd_dwarf_state_t* list;
+
+  /* Rows apply below `end`, an unsupported instruction was met there */
+  uint64_t end;
+  int end_opcode;
+};
+
 enum cd_dwarf_reg_e {
   kCDDwarfRegFrame,
   kCDDwarfRegStack,
@@ -164,9 +198,18 @@ cd_error_t cd_dwarf_parse_cfa(struct cd_obj_s* obj,
                               uint64_t sect_addr,
                               void* data,
                               uint64_t size,
+                              uint64_t hdr_addr,
+                              void* hdr,
+                              uint64_t hdr_size,
                               cd_dwarf_cfa_t** res);
 void cd_dwarf_free_cfa(cd_dwarf_cfa_t* cfa);
 
+/*
+ * `.eh_frame_hdr` image for the fully parsed section, for `hdr_addr` equal to
+ * the `sect_addr`. `kCDErrSkip` if the section already has one.
+ */
+cd_error_t cd_dwarf_build_hdr(cd_dwarf_cfa_t* cfa, void** res, uint64_t* size);
+
 cd_error_t cd_dwarf_get_fde(cd_dwarf_cfa_t* cfa,
                             uint64_t addr,
                             cd_dwarf_fde_t** res);
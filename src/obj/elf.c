@@ -14,6 +14,10 @@
 # include <elf.h>
 #endif  /* __linux__ */
 
+#ifndef SHT_GNU_HASH
+# define SHT_GNU_HASH 0x6ffffff6
+#endif  /* SHT_GNU_HASH */
+
 #if defined(__FreeBSD__)
 # include <sys/user.h>
 # include <machine/reg.h>
@@ -32,7 +36,10 @@ typedef struct reg32 cd_reg32_t;
 #include "common.h"
 #include "obj-internal.h"
 
+static const int kCDElfThreadsInitialSize = 16;
+
 typedef struct cd_elf_obj_s cd_elf_obj_t;
+typedef struct cd_elf_thread_s cd_elf_thread_t;
 
 typedef cd_error_t (*cd_elf_obj_iterate_sh_cb)(cd_elf_obj_t* obj,
                                                Elf64_Shdr* shdr,
@@ -59,6 +66,17 @@ static cd_error_t cd_elf_obj_load_dsos_iterate(cd_elf_obj_t* obj,
                                                char* desc,
                                                void* arg);
 static int cd_elf_obj_is_core(cd_elf_obj_t* obj);
+static int cd_elf_obj_is_mapped_file(cd_elf_obj_t* obj,
+                                     uint64_t start,
+                                     uint64_t end);
+static cd_error_t cd_elf_obj_init_threads(cd_elf_obj_t* obj);
+static cd_error_t cd_elf_obj_init_threads_iterate(cd_elf_obj_t* obj,
+                                                  Elf64_Nhdr* nhdr,
+                                                  char* desc,
+                                                  void* arg);
+static cd_error_t cd_elf_obj_read_thread(cd_elf_obj_t* obj,
+                                         cd_elf_thread_t* ethread,
+                                         cd_obj_thread_t* thread);
 static cd_error_t cd_elf_obj_get_build_id_iterate(cd_elf_obj_t* obj,
                                                   Elf64_Nhdr* nhdr,
                                                   char* desc,
@@ -66,7 +84,29 @@ static cd_error_t cd_elf_obj_get_build_id_iterate(cd_elf_obj_t* obj,
 static cd_error_t cd_elf_obj_get_build_id(cd_elf_obj_t* obj,
                                           void** id,
                                           int* len);
-
+static cd_error_t cd_elf_obj_get_shdr(cd_elf_obj_t* obj,
+                                      int index,
+                                      Elf64_Shdr* res);
+static cd_error_t cd_elf_obj_init_dyn(cd_elf_obj_t* obj);
+static cd_error_t cd_elf_obj_init_dyn_sh(cd_elf_obj_t* obj,
+                                         Elf64_Shdr* shdr,
+                                         void* arg);
+static int cd_elf_obj_dyn_sym_eq(cd_elf_obj_t* obj,
+                                 uint32_t index,
+                                 const char* name,
+                                 uint64_t* value);
+static uint32_t cd_elf_gnu_hash(const char* name);
+static uint32_t cd_elf_sysv_hash(const char* name);
+static uint64_t cd_elf_read_u64(const char* p);
+static uint32_t cd_elf_read_u32(const char* p);
+
+
+/* NT_PRSTATUS note of a core file */
+struct cd_elf_thread_s {
+  int tid;
+  char* desc;
+  uint64_t desc_size;
+};
 
 struct cd_elf_obj_s {
   CD_OBJ_INTERNAL_FIELDS
@@ -75,6 +115,22 @@ struct cd_elf_obj_s {
   Elf64_Ehdr* h64;
   Elf32_Ehdr* h32;
   const char* shstrtab;
+
+  /* Dynamic symbols and their hash table, for the lookups by name */
+  struct {
+    int init;
+    uint32_t* gnu_hash;
+    uint32_t* hash;
+    char* syms;
+    uint64_t entsize;
+    uint64_t count;
+    const char* strtab;
+  } dyn;
+
+  /* Threads of the core file, in the order of notes */
+  cd_elf_thread_t* threads;
+  unsigned int thread_count;
+  unsigned int thread_size;
 };
 
 
@@ -133,6 +189,10 @@ cd_elf_obj_t* cd_elf_obj_new(int fd, cd_obj_opts_t* opts, cd_error_t* err) {
   }
 
   obj->is_x64 = obj->h64->e_ident[EI_CLASS] == ELFCLASS64;
+  obj->dyn.init = 0;
+  obj->threads = NULL;
+  obj->thread_count = 0;
+  obj->thread_size = 0;
 
   if (obj->is_x64) {
     obj->header = *obj->h64;
@@ -170,6 +230,10 @@ cd_elf_obj_t* cd_elf_obj_new(int fd, cd_obj_opts_t* opts, cd_error_t* err) {
   }
 
   if (cd_elf_obj_is_core(obj)) {
+    *err = cd_elf_obj_init_threads(obj);
+    if (!cd_is_ok(*err))
+      goto failed_magic2;
+
     *err = cd_elf_obj_load_dsos(obj);
     if (!cd_is_ok(*err))
       goto failed_magic2;
@@ -179,6 +243,7 @@ cd_elf_obj_t* cd_elf_obj_new(int fd, cd_obj_opts_t* opts, cd_error_t* err) {
   return obj;
 
 failed_magic2:
+  free(obj->threads);
   munmap(obj->addr, obj->size);
   obj->addr = NULL;
 
@@ -194,6 +259,7 @@ failed_malloc:
 
 
 void cd_elf_obj_free(cd_elf_obj_t* obj) {
+  free(obj->threads);
   munmap(obj->addr, obj->size);
   obj->addr = NULL;
 
@@ -221,7 +287,9 @@ cd_error_t cd_elf_obj_iterate_segs(cd_elf_obj_t* obj,
   for (i = 0; i < obj->header.e_phnum; i++, ptr += obj->header.e_phentsize) {
     uint64_t vmaddr;
     uint64_t vmsize;
+    uint64_t filesize;
     uint64_t fileoff;
+    int writable;
 
     if (obj->is_x64) {
       Elf64_Phdr* phdr;
@@ -230,6 +298,8 @@ cd_error_t cd_elf_obj_iterate_segs(cd_elf_obj_t* obj,
       fileoff = phdr->p_offset;
       vmaddr = phdr->p_vaddr;
       vmsize = phdr->p_memsz;
+      filesize = phdr->p_filesz;
+      writable = (phdr->p_flags & PF_W) != 0;
     } else {
       Elf32_Phdr* phdr;
 
@@ -237,6 +307,18 @@ cd_error_t cd_elf_obj_iterate_segs(cd_elf_obj_t* obj,
       fileoff = phdr->p_offset;
       vmaddr = phdr->p_vaddr;
       vmsize = phdr->p_memsz;
+      filesize = phdr->p_filesz;
+      writable = (phdr->p_flags & PF_W) != 0;
+    }
+
+    /* Only the dumped part of the memory could be read from the core */
+    if (cd_elf_obj_is_core(obj)) {
+      if (fileoff > obj->size)
+        filesize = 0;
+      else if (filesize > obj->size - fileoff)
+        filesize = obj->size - fileoff;
+      if (vmsize > filesize)
+        vmsize = filesize;
     }
 
     seg.start = vmaddr;
@@ -244,6 +326,9 @@ cd_error_t cd_elf_obj_iterate_segs(cd_elf_obj_t* obj,
     seg.fileoff = fileoff;
     seg.ptr = (char*) obj->addr + fileoff;
     seg.sects = 1;
+    seg.writable = writable;
+    seg.mapped_file = !cd_elf_obj_is_core(obj) ||
+                      cd_elf_obj_is_mapped_file(obj, seg.start, seg.end);
 
     err = cb((cd_obj_t*) obj, &seg, arg);
     if (!cd_is_ok(err))
@@ -443,6 +528,7 @@ cd_error_t cd_elf_obj_iterate_notes(cd_elf_obj_t* obj,
                                     void* arg) {
   cd_error_t err;
   int i;
+  int align;
   char* ptr;
 
   ptr = obj->addr + obj->header.e_phoff;
@@ -475,6 +561,7 @@ cd_error_t cd_elf_obj_iterate_notes(cd_elf_obj_t* obj,
 
     ent = obj->addr + phdr->p_offset;
     end = ent + phdr->p_filesz;
+    align = phdr->p_align == 8 ? 8 : 4;
 
     /* Iterate through actual notes */
     while (ent < end) {
@@ -498,27 +585,14 @@ cd_error_t cd_elf_obj_iterate_notes(cd_elf_obj_t* obj,
         ent += sizeof(*nhdr32);
       }
 
-      /* Don't forget alignment */
+      /* Don't forget alignment, cores use 4 bytes even on x64 */
       ent += nhdr->n_namesz;
-#if defined(__linux__)
-      if (obj->is_x64) {
-        if ((nhdr->n_namesz & 7) != 0)
-          ent += 8 - (nhdr->n_namesz & 7);
-        desc = ent;
-        ent += nhdr->n_descsz;
-        if ((nhdr->n_descsz & 7) != 0)
-          ent += 8 - (nhdr->n_descsz & 7);
-      } else {
-#else
-      if (1) {
-#endif  /* __linux__ */
-        if ((nhdr->n_namesz & 3) != 0)
-          ent += 4 - (nhdr->n_namesz & 3);
-        desc = ent;
-        ent += nhdr->n_descsz;
-        if ((nhdr->n_descsz & 3) != 0)
-          ent += 4 - (nhdr->n_descsz & 3);
-      }
+      if ((nhdr->n_namesz & (align - 1)) != 0)
+        ent += align - (nhdr->n_namesz & (align - 1));
+      desc = ent;
+      ent += nhdr->n_descsz;
+      if ((nhdr->n_descsz & (align - 1)) != 0)
+        ent += align - (nhdr->n_descsz & (align - 1));
 
       err = cb(obj, nhdr, desc, arg);
       if (!cd_is_ok(err))
@@ -530,51 +604,78 @@ cd_error_t cd_elf_obj_iterate_notes(cd_elf_obj_t* obj,
 }
 
 
-typedef struct cd_elf_obj_get_thread_s cd_elf_obj_get_thread_t;
-
-struct cd_elf_obj_get_thread_s {
-  unsigned int index;
-  cd_obj_thread_t* thread;
-};
+cd_error_t cd_elf_obj_init_threads(cd_elf_obj_t* obj) {
+  return cd_elf_obj_iterate_notes(obj, cd_elf_obj_init_threads_iterate, NULL);
+}
 
 
-cd_error_t cd_elf_obj_get_thread_iterate(cd_elf_obj_t* obj,
-                                         Elf64_Nhdr* nhdr,
-                                         char* desc,
-                                         void* arg) {
-  cd_error_t err;
-  cd_elf_obj_get_thread_t* st;
-  cd_obj_thread_t* thread;
-  unsigned int i;
-  cd_segment_t idx;
-  cd_segment_t* r;
+cd_error_t cd_elf_obj_init_threads_iterate(cd_elf_obj_t* obj,
+                                           Elf64_Nhdr* nhdr,
+                                           char* desc,
+                                           void* arg) {
+  cd_elf_thread_t* thread;
 
   if (nhdr->n_type != NT_PRSTATUS)
     return cd_ok();
 
-  st = (cd_elf_obj_get_thread_t*) arg;
-  thread = st->thread;
-
-  if (st->index != 0) {
-    st->index--;
-    return cd_ok();
+  if (obj->thread_count == obj->thread_size) {
+    cd_elf_thread_t* threads;
+    unsigned int size;
+
+    size = obj->thread_size == 0 ? kCDElfThreadsInitialSize :
+                                   obj->thread_size * 2;
+    threads = realloc(obj->threads, sizeof(*threads) * size);
+    if (threads == NULL)
+      return cd_error_str(kCDErrNoMem, "cd_elf_thread_t");
+    obj->threads = threads;
+    obj->thread_size = size;
   }
 
+  thread = &obj->threads[obj->thread_count++];
+  thread->desc = desc;
+  thread->desc_size = nhdr->n_descsz;
+
+  /* `pr_pid` of `struct prstatus` */
+#if defined(__linux__)
+  thread->tid = (int32_t) cd_elf_read_u32(desc + (obj->is_x64 ? 32 : 24));
+#elif defined(__FreeBSD__)
+  thread->tid = (int32_t) cd_elf_read_u32(desc + (obj->is_x64 ? 40 : 24));
+#else
+  thread->tid = 0;
+#endif
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_elf_obj_read_thread(cd_elf_obj_t* obj,
+                                  cd_elf_thread_t* ethread,
+                                  cd_obj_thread_t* thread) {
+  cd_error_t err;
+  unsigned int i;
+  cd_segment_t* r;
+  char* desc;
+  uint64_t desc_size;
+
+  desc = ethread->desc;
+  desc_size = ethread->desc_size;
+  thread->tid = ethread->tid;
+
 #if defined(__linux__)
   if (obj->is_x64) {
     desc += 112;
-    thread->regs.count = (nhdr->n_descsz - 112) / sizeof(uint64_t);
+    thread->regs.count = (desc_size - 112) / sizeof(uint64_t);
     for (i = 0; i < thread->regs.count; i++)
-      thread->regs.values[i] = *((uint64_t*) desc + i);
+      thread->regs.values[i] = cd_elf_read_u64(desc + i * 8);
 
     thread->regs.ip = thread->regs.values[16];
     thread->stack.frame = thread->regs.values[4];
     thread->stack.top = thread->regs.values[19];
   } else {
     desc += 96;
-    thread->regs.count = (nhdr->n_descsz - 96) / sizeof(uint32_t);
+    thread->regs.count = (desc_size - 96) / sizeof(uint32_t);
     for (i = 0; i < thread->regs.count; i++)
-      thread->regs.values[i] = *((uint32_t*) desc + i);
+      thread->regs.values[i] = cd_elf_read_u32(desc + i * 4);
 
     thread->regs.ip = thread->regs.values[12];
     thread->stack.frame = thread->regs.values[5];
@@ -660,40 +761,35 @@ cd_error_t cd_elf_obj_get_thread_iterate(cd_elf_obj_t* obj,
   if (!cd_is_ok(err))
     return err;
 
-  if (obj->segment_count == 0)
-    return cd_error(kCDErrNotFound);
-
-  idx.start = thread->stack.top;
-  r = cd_splay_find(&obj->seg_splay, &idx);
+  r = cd_obj_find_segment((cd_obj_t*) obj, thread->stack.top);
   if (r == NULL)
     return cd_error(kCDErrNotFound);
   thread->stack.bottom = r->end;
 
-  return cd_error(kCDErrSkip);
+  return cd_ok();
 }
 
 
 cd_error_t cd_elf_obj_get_thread(cd_elf_obj_t* obj,
                                  unsigned int index,
                                  cd_obj_thread_t* thread) {
-  cd_error_t err;
-  cd_elf_obj_get_thread_t state;
-
   if (!cd_elf_obj_is_core(obj))
     return cd_error_num(kCDErrNotCore, obj->header.e_type);
 
-  state.index = index;
-  state.thread = thread;
+  if (index >= obj->thread_count)
+    return cd_error_str(kCDErrNotFound, "thread info");
 
-  err = cd_elf_obj_iterate_notes(obj,
-                                 cd_elf_obj_get_thread_iterate,
-                                 &state);
-  if (err.code == kCDErrSkip)
-    return cd_ok();
-  if (!cd_is_ok(err))
-    return err;
+  return cd_elf_obj_read_thread(obj, &obj->threads[index], thread);
+}
+
+
+cd_error_t cd_elf_obj_get_thread_count(cd_elf_obj_t* obj,
+                                       unsigned int* count) {
+  if (!cd_elf_obj_is_core(obj))
+    return cd_error_num(kCDErrNotCore, obj->header.e_type);
 
-  return cd_error_str(kCDErrNotFound, "thread info");
+  *count = obj->thread_count;
+  return cd_ok();
 }
 
 
@@ -708,23 +804,25 @@ static cd_error_t cd_elf_obj_load_dsos_nt_file(cd_elf_obj_t* obj,
   } fhdr;
   uint64_t i;
   char* paths;
+  cd_obj_dso_t* last;
 
   if (nhdr->n_type != NT_FILE)
     return cd_ok();
 
   /* XXX Check OOBs */
   if (obj->is_x64) {
-    fhdr.count = ((uint64_t*) desc)[0];
-    fhdr.page_size = ((uint64_t*) desc)[1];
+    fhdr.count = cd_elf_read_u64(desc + 0);
+    fhdr.page_size = cd_elf_read_u64(desc + 8);
     desc += 16;
     paths = desc + 3 * fhdr.count * 8;
   } else {
-    fhdr.count = ((uint32_t*) desc)[0];
-    fhdr.page_size = ((uint32_t*) desc)[1];
+    fhdr.count = cd_elf_read_u32(desc + 0);
+    fhdr.page_size = cd_elf_read_u32(desc + 4);
     desc += 8;
     paths = desc + 3 * fhdr.count * 4;
   }
 
+  last = NULL;
   for (i = 0; i < fhdr.count; i++) {
     struct {
       uint64_t start;
@@ -733,35 +831,42 @@ static cd_error_t cd_elf_obj_load_dsos_nt_file(cd_elf_obj_t* obj,
       char* path;
     } line;
     cd_error_t err;
-    cd_obj_t* image;
-    cd_obj_opts_t opts;
 
     if (obj->is_x64) {
-      line.start = ((uint64_t*) desc)[0];
-      line.end = ((uint64_t*) desc)[1];
-      line.fileoff = ((uint64_t*) desc)[2];
+      line.start = cd_elf_read_u64(desc + 0);
+      line.end = cd_elf_read_u64(desc + 8);
+      line.fileoff = cd_elf_read_u64(desc + 16);
       line.path = paths;
       desc += 8 * 3;
     } else {
-      line.start = ((uint32_t*) desc)[0];
-      line.end = ((uint32_t*) desc)[1];
-      line.fileoff = ((uint32_t*) desc)[2];
+      line.start = cd_elf_read_u32(desc + 0);
+      line.end = cd_elf_read_u32(desc + 4);
+      line.fileoff = cd_elf_read_u32(desc + 8);
       line.path = paths;
       desc += 4 * 3;
     }
     paths += strlen(paths) + 1;
     line.fileoff *= fhdr.page_size;
 
-    /* Ignore minor sections */
-    if (line.fileoff != 0)
+    /* Minor sections follow the first one, extend its range */
+    if (line.fileoff != 0) {
+      if (last != NULL &&
+          strcmp(last->path, line.path) == 0 &&
+          line.end > last->end) {
+        last->end = line.end;
+      }
       continue;
+    }
 
-    opts.parent = (cd_obj_t*) obj;
-    opts.reloc = line.start;
-
-    image = cd_obj_new_ex(cd_elf_obj_method, line.path, &opts, &err);
+    /* Opened on demand by `cd_obj_lookup_ip` and `cd_obj_get_sym` */
+    err = cd_obj_add_lazy_dso((cd_obj_t*) obj,
+                              cd_elf_obj_method,
+                              line.path,
+                              line.start,
+                              line.end,
+                              &last);
     if (!cd_is_ok(err))
-      continue;
+      return err;
   }
 
   return cd_error(kCDErrSkip);
@@ -777,7 +882,7 @@ static cd_error_t cd_elf_obj_load_dsos_vmmap(cd_elf_obj_t* obj,
   char* ptr;
   char* end;
   struct kinfo_vmentry* entry;
-  const char* last;
+  cd_obj_dso_t* last;
 
   if (nhdr->n_type != NT_PROCSTAT_VMMAP)
     return cd_ok();
@@ -788,25 +893,30 @@ static cd_error_t cd_elf_obj_load_dsos_vmmap(cd_elf_obj_t* obj,
   /* Skip some initial word */
   for (ptr = desc + 4; ptr < end; ptr += entry->kve_structsize) {
     cd_error_t err;
-    cd_obj_t* image;
-    cd_obj_opts_t opts;
 
     entry = (struct kinfo_vmentry*) ptr;
 
-    if (entry->kve_type != KVME_TYPE_VNODE || entry->kve_offset != 0)
+    if (entry->kve_type != KVME_TYPE_VNODE)
       continue;
 
-    /* Filter out duplicates */
-    if (last != NULL && strcmp(last, entry->kve_path) == 0)
+    /* Filter out duplicates, and extend the range of the DSO */
+    if (last != NULL && strcmp(last->path, entry->kve_path) == 0) {
+      if (entry->kve_end > last->end)
+        last->end = entry->kve_end;
+      continue;
+    }
+    if (entry->kve_offset != 0)
       continue;
-    last = entry->kve_path;
-
-    opts.parent = (cd_obj_t*) obj;
-    opts.reloc = entry->kve_start;
 
-    image = cd_obj_new_ex(cd_elf_obj_method, entry->kve_path, &opts, &err);
+    /* Opened on demand by `cd_obj_lookup_ip` and `cd_obj_get_sym` */
+    err = cd_obj_add_lazy_dso((cd_obj_t*) obj,
+                              cd_elf_obj_method,
+                              entry->kve_path,
+                              entry->kve_start,
+                              entry->kve_end,
+                              &last);
     if (!cd_is_ok(err))
-      continue;
+      return err;
   }
 
   return cd_error(kCDErrSkip);
@@ -857,6 +967,81 @@ cd_error_t cd_elf_obj_load_dsos(cd_elf_obj_t* obj) {
 }
 
 
+typedef struct cd_elf_obj_find_file_s cd_elf_obj_find_file_t;
+
+struct cd_elf_obj_find_file_s {
+  uint64_t start;
+  uint64_t end;
+  int found;
+};
+
+
+#if defined(NT_FILE)
+static cd_error_t cd_elf_obj_find_file_iterate(cd_elf_obj_t* obj,
+                                               Elf64_Nhdr* nhdr,
+                                               char* desc,
+                                               void* arg) {
+  cd_elf_obj_find_file_t* st;
+  uint64_t count;
+  uint64_t i;
+
+  if (nhdr->n_type != NT_FILE)
+    return cd_ok();
+
+  st = (cd_elf_obj_find_file_t*) arg;
+
+  /* Same layout as in `cd_elf_obj_load_dsos_nt_file` */
+  if (obj->is_x64) {
+    count = cd_elf_read_u64(desc);
+    desc += 16;
+  } else {
+    count = cd_elf_read_u32(desc);
+    desc += 8;
+  }
+
+  for (i = 0; i < count; i++) {
+    uint64_t start;
+    uint64_t end;
+
+    if (obj->is_x64) {
+      start = cd_elf_read_u64(desc + 0);
+      end = cd_elf_read_u64(desc + 8);
+      desc += 8 * 3;
+    } else {
+      start = cd_elf_read_u32(desc + 0);
+      end = cd_elf_read_u32(desc + 4);
+      desc += 4 * 3;
+    }
+
+    if (st->start >= start && st->end <= end) {
+      st->found = 1;
+      break;
+    }
+  }
+
+  return cd_error(kCDErrSkip);
+}
+#endif  /* NT_FILE */
+
+
+/* Without the NT_FILE note all segments are treated as anonymous memory */
+int cd_elf_obj_is_mapped_file(cd_elf_obj_t* obj,
+                              uint64_t start,
+                              uint64_t end) {
+  cd_elf_obj_find_file_t st;
+
+  st.start = start;
+  st.end = end;
+  st.found = 0;
+
+#if defined(NT_FILE)
+  cd_elf_obj_iterate_notes(obj, cd_elf_obj_find_file_iterate, &st);
+#endif  /* NT_FILE */
+
+  return st.found;
+}
+
+
 typedef struct cd_elf_obj_get_build_id_s cd_elf_obj_get_build_id_t;
 
 struct cd_elf_obj_get_build_id_s {
@@ -886,6 +1071,10 @@ cd_error_t cd_elf_obj_get_build_id(cd_elf_obj_t* obj, void** id, int* len) {
   cd_elf_obj_get_build_id_t st;
   cd_error_t err;
 
+  /* NT_GNU_BUILD_ID is NT_PRPSINFO in cores */
+  if (cd_elf_obj_is_core(obj))
+    return cd_error_str(kCDErrNotFound, "GNU_BUILD_ID");
+
   st.id = id;
   st.len = len;
 
@@ -911,20 +1100,303 @@ cd_error_t cd_elf_obj_get_dbg(cd_elf_obj_t* obj,
 }
 
 
+cd_error_t cd_elf_obj_get_dbg_hdr(cd_elf_obj_t* obj,
+                                  void** res,
+                                  uint64_t* size,
+                                  uint64_t* vmaddr) {
+  return cd_elf_obj_get_section(obj,
+                                ".eh_frame_hdr",
+                                (char**) res,
+                                size,
+                                vmaddr);
+}
+
+
 cd_error_t cd_elf_obj_use_binary(cd_elf_obj_t* obj, cd_elf_obj_t* binary) {
   return cd_ok();
 }
 
 
+cd_error_t cd_elf_obj_get_sym(cd_elf_obj_t* obj,
+                              const char* name,
+                              uint64_t* value) {
+  cd_error_t err;
+  uint32_t h;
+  uint32_t i;
+
+  err = cd_elf_obj_init_dyn(obj);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (obj->dyn.gnu_hash != NULL) {
+    uint32_t nbuckets;
+    uint32_t symoffset;
+    uint32_t bloom_size;
+    uint32_t bloom_shift;
+    uint32_t* buckets;
+    uint32_t* chain;
+    uint64_t word;
+    uint64_t mask;
+    int bits;
+
+    nbuckets = obj->dyn.gnu_hash[0];
+    symoffset = obj->dyn.gnu_hash[1];
+    bloom_size = obj->dyn.gnu_hash[2];
+    bloom_shift = obj->dyn.gnu_hash[3];
+    if (nbuckets == 0 || bloom_size == 0)
+      return cd_error_str(kCDErrNotFound, name);
+
+    h = cd_elf_gnu_hash(name);
+
+    /* Bloom filter rejects most of the misses */
+    bits = obj->is_x64 ? 64 : 32;
+    if (obj->is_x64) {
+      word = ((uint64_t*) (obj->dyn.gnu_hash + 4))[(h / bits) % bloom_size];
+      buckets = obj->dyn.gnu_hash + 4 + bloom_size * 2;
+    } else {
+      word = (obj->dyn.gnu_hash + 4)[(h / bits) % bloom_size];
+      buckets = obj->dyn.gnu_hash + 4 + bloom_size;
+    }
+    mask = (1ULL << (h % bits)) | (1ULL << ((h >> bloom_shift) % bits));
+    if ((word & mask) != mask)
+      return cd_error_str(kCDErrNotFound, name);
+
+    chain = buckets + nbuckets;
+    i = buckets[h % nbuckets];
+    if (i < symoffset)
+      return cd_error_str(kCDErrNotFound, name);
+
+    /* Chain ends with a hash that has the lowest bit set */
+    for (; i < obj->dyn.count; i++) {
+      uint32_t h2;
+
+      h2 = chain[i - symoffset];
+      if ((h | 1) == (h2 | 1) && cd_elf_obj_dyn_sym_eq(obj, i, name, value))
+        return cd_ok();
+      if ((h2 & 1) != 0)
+        break;
+    }
+
+    return cd_error_str(kCDErrNotFound, name);
+  }
+
+  if (obj->dyn.hash != NULL) {
+    uint32_t nbucket;
+    uint32_t nchain;
+    uint32_t* bucket;
+    uint32_t* chain;
+
+    nbucket = obj->dyn.hash[0];
+    nchain = obj->dyn.hash[1];
+    if (nbucket == 0)
+      return cd_error_str(kCDErrNotFound, name);
+
+    bucket = obj->dyn.hash + 2;
+    chain = bucket + nbucket;
+
+    h = cd_elf_sysv_hash(name);
+    for (i = bucket[h % nbucket];
+         i != 0 && i < nchain && i < obj->dyn.count;
+         i = chain[i]) {
+      if (cd_elf_obj_dyn_sym_eq(obj, i, name, value))
+        return cd_ok();
+    }
+
+    return cd_error_str(kCDErrNotFound, name);
+  }
+
+  /* No hash table, let the caller build an index */
+  return cd_error(kCDErrSkip);
+}
+
+
+cd_error_t cd_elf_obj_init_dyn(cd_elf_obj_t* obj) {
+  cd_error_t err;
+  Elf64_Shdr shdr;
+  int link;
+
+  if (obj->dyn.init)
+    return cd_ok();
+
+  obj->dyn.init = 1;
+  obj->dyn.gnu_hash = NULL;
+  obj->dyn.hash = NULL;
+  obj->dyn.syms = NULL;
+  obj->dyn.count = 0;
+
+  /* Cores have no sections */
+  if (cd_elf_obj_is_core(obj))
+    return cd_ok();
+
+  link = -1;
+  err = cd_elf_obj_iterate_sh(obj, cd_elf_obj_init_dyn_sh, &link);
+  if (!cd_is_ok(err))
+    return err;
+  if (link == -1)
+    return cd_ok();
+
+  /* Hash table links to the symbol table, and it - to the string table */
+  err = cd_elf_obj_get_shdr(obj, link, &shdr);
+  if (cd_is_ok(err) && shdr.sh_entsize != 0) {
+    obj->dyn.syms = obj->addr + shdr.sh_offset;
+    obj->dyn.entsize = shdr.sh_entsize;
+    obj->dyn.count = shdr.sh_size / shdr.sh_entsize;
+    err = cd_elf_obj_get_shdr(obj, shdr.sh_link, &shdr);
+  }
+  if (!cd_is_ok(err) || obj->dyn.syms == NULL) {
+    obj->dyn.gnu_hash = NULL;
+    obj->dyn.hash = NULL;
+    return cd_ok();
+  }
+  obj->dyn.strtab = obj->addr + shdr.sh_offset;
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_elf_obj_init_dyn_sh(cd_elf_obj_t* obj,
+                                  Elf64_Shdr* shdr,
+                                  void* arg) {
+  int* link;
+
+  link = (int*) arg;
+
+  /* Prefer .gnu.hash, it has a bloom filter */
+  if (shdr->sh_type == SHT_GNU_HASH) {
+    obj->dyn.gnu_hash = (uint32_t*) (obj->addr + shdr->sh_offset);
+    obj->dyn.hash = NULL;
+    *link = shdr->sh_link;
+  } else if (shdr->sh_type == SHT_HASH && obj->dyn.gnu_hash == NULL) {
+    obj->dyn.hash = (uint32_t*) (obj->addr + shdr->sh_offset);
+    *link = shdr->sh_link;
+  }
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_elf_obj_get_shdr(cd_elf_obj_t* obj,
+                               int index,
+                               Elf64_Shdr* res) {
+  char* ptr;
+
+  if (index <= 0 || index >= obj->header.e_shnum)
+    return cd_error_str(kCDErrNotFound, "section index");
+
+  ptr = obj->addr + obj->header.e_shoff + index * obj->header.e_shentsize;
+  if (obj->is_x64) {
+    *res = *(Elf64_Shdr*) ptr;
+  } else {
+    Elf32_Shdr* shdr32;
+
+    shdr32 = (Elf32_Shdr*) ptr;
+    res->sh_name = shdr32->sh_name;
+    res->sh_type = shdr32->sh_type;
+    res->sh_offset = shdr32->sh_offset;
+    res->sh_size = shdr32->sh_size;
+    res->sh_link = shdr32->sh_link;
+    res->sh_entsize = shdr32->sh_entsize;
+  }
+
+  return cd_ok();
+}
+
+
+int cd_elf_obj_dyn_sym_eq(cd_elf_obj_t* obj,
+                          uint32_t index,
+                          const char* name,
+                          uint64_t* value) {
+  char* ent;
+  uint32_t st_name;
+  uint64_t st_value;
+  uint16_t st_shndx;
+
+  ent = obj->dyn.syms + index * obj->dyn.entsize;
+  if (obj->is_x64) {
+    Elf64_Sym* sym;
+
+    sym = (Elf64_Sym*) ent;
+    st_name = sym->st_name;
+    st_value = sym->st_value;
+    st_shndx = sym->st_shndx;
+  } else {
+    Elf32_Sym* sym;
+
+    sym = (Elf32_Sym*) ent;
+    st_name = sym->st_name;
+    st_value = sym->st_value;
+    st_shndx = sym->st_shndx;
+  }
+
+  /* Undefined symbols are resolved in other objects */
+  if (st_shndx == SHN_UNDEF || st_value == 0)
+    return 0;
+  if (strcmp(obj->dyn.strtab + st_name, name) != 0)
+    return 0;
+
+  *value = st_value;
+  return 1;
+}
+
+
+uint32_t cd_elf_gnu_hash(const char* name) {
+  uint32_t h;
+
+  for (h = 5381; *name != '\0'; name++)
+    h = h * 33 + (unsigned char) *name;
+
+  return h;
+}
+
+
+uint32_t cd_elf_sysv_hash(const char* name) {
+  uint32_t h;
+  uint32_t g;
+
+  for (h = 0; *name != '\0'; name++) {
+    h = (h << 4) + (unsigned char) *name;
+    g = h & 0xf0000000;
+    if (g != 0)
+      h ^= g >> 24;
+    h &= ~g;
+  }
+
+  return h;
+}
+
+
+/* Notes are only `p_align`-aligned, read their fields with memcpy */
+uint64_t cd_elf_read_u64(const char* p) {
+  uint64_t res;
+
+  memcpy(&res, p, sizeof(res));
+  return res;
+}
+
+
+uint32_t cd_elf_read_u32(const char* p) {
+  uint32_t res;
+
+  memcpy(&res, p, sizeof(res));
+  return res;
+}
+
+
 cd_obj_method_t cd_elf_obj_method_def = {
   .obj_new = (cd_obj_method_new_t) cd_elf_obj_new,
   .obj_free = (cd_obj_method_free_t) cd_elf_obj_free,
   .obj_is_core = (cd_obj_method_is_core_t) cd_elf_obj_is_core,
   .obj_get_thread = (cd_obj_method_get_thread_t) cd_elf_obj_get_thread,
+  .obj_get_thread_count =
+      (cd_obj_method_get_thread_count_t) cd_elf_obj_get_thread_count,
   .obj_iterate_syms = (cd_obj_method_iterate_syms_t) cd_elf_obj_iterate_syms,
   .obj_iterate_segs = (cd_obj_method_iterate_segs_t) cd_elf_obj_iterate_segs,
   .obj_get_dbg_frame = (cd_obj_method_get_dbg_frame_t) cd_elf_obj_get_dbg,
-  .obj_use_binary = (cd_obj_method_use_binary_t) cd_elf_obj_use_binary
+  .obj_get_dbg_frame_hdr =
+      (cd_obj_method_get_dbg_frame_t) cd_elf_obj_get_dbg_hdr,
+  .obj_use_binary = (cd_obj_method_use_binary_t) cd_elf_obj_use_binary,
+  .obj_get_sym = (cd_obj_method_get_sym_t) cd_elf_obj_get_sym,
+  .obj_get_build_id = (cd_obj_method_get_build_id_t) cd_elf_obj_get_build_id
 };
 
 cd_obj_method_t* cd_elf_obj_method = &cd_elf_obj_method_def;
@@ -325,6 +325,7 @@ cd_error_t cd_mach_iterate_segs_lcmd_cb(cd_mach_obj_t* obj,
   uint64_t vmsize;
   uint64_t fileoff;
   uint64_t sects;
+  int writable;
   cd_segment_t seg;
   cd_mach_iterate_segs_t* st;
 
@@ -339,6 +340,7 @@ cd_error_t cd_mach_iterate_segs_lcmd_cb(cd_mach_obj_t* obj,
     vmsize = seg->vmsize;
     fileoff = seg->fileoff;
     sects = seg->nsects;
+    writable = (seg->initprot & VM_PROT_WRITE) != 0;
   } else if (cmd->cmd == LC_SEGMENT_64) {
     struct segment_command_64* seg;
 
@@ -348,6 +350,7 @@ cd_error_t cd_mach_iterate_segs_lcmd_cb(cd_mach_obj_t* obj,
     vmsize = seg->vmsize;
     fileoff = seg->fileoff;
     sects = seg->nsects;
+    writable = (seg->initprot & VM_PROT_WRITE) != 0;
   } else {
     /* Continue */
     return cd_ok();
@@ -357,6 +360,10 @@ cd_error_t cd_mach_iterate_segs_lcmd_cb(cd_mach_obj_t* obj,
   seg.end = vmaddr + vmsize;
   seg.fileoff = fileoff;
   seg.sects = sects;
+  seg.writable = writable;
+
+  /* Mach-O cores do not tell file mappings apart */
+  seg.mapped_file = !cd_mach_obj_is_core(obj);
   seg.ptr = (char*) obj->header + fileoff;
 
   return st->cb((cd_obj_t*) obj, &seg, st->arg);
@@ -531,6 +538,9 @@ cd_error_t cd_mach_get_thread_lcmd_cb(cd_mach_obj_t* obj,
       continue;
     }
 
+    /* LC_THREAD has no thread id */
+    thread->tid = 0;
+
     state = (struct x86_thread_state*) (ptr + 8);
     if (obj->is_x64) {
       thread->regs.count = 21;
@@ -0,0 +1,401 @@
+#include "snapshot.h"
+#include "common.h"
+#include "error.h"
+#include "queue.h"
+#include "state.h"
+#include "strings.h"
+#include "visitor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+
+static cd_error_t cd_snapshot_write_json(cd_state_t* state,
+                                         cd_writebuf_t* buf);
+static cd_error_t cd_snapshot_write_binary(cd_state_t* state,
+                                           cd_writebuf_t* buf);
+static cd_error_t cd_snapshot_convert_json(const unsigned char* data,
+                                           uint64_t size,
+                                           cd_writebuf_t* buf);
+static void cd_snapshot_json_header(cd_writebuf_t* buf,
+                                    uint64_t node_count,
+                                    uint64_t edge_count);
+static void cd_snapshot_json_row(cd_writebuf_t* buf,
+                                 const int* fields,
+                                 int count,
+                                 int last);
+static void cd_snapshot_json_footer(cd_writebuf_t* buf);
+static void cd_snapshot_pad(cd_writebuf_t* buf, uint64_t* off);
+static uint32_t cd_snapshot_read_u32(const unsigned char* ptr);
+static uint64_t cd_snapshot_read_u64(const unsigned char* ptr);
+
+
+static const int kCDNodeFieldCount = 6;
+static const int kCDEdgeFieldCount = 3;
+
+
+cd_error_t cd_snapshot_write(cd_state_t* state,
+                             cd_writebuf_t* buf,
+                             cd_snapshot_format_t format) {
+  if (format == kCDSnapshotBinary)
+    return cd_snapshot_write_binary(state, buf);
+  else
+    return cd_snapshot_write_json(state, buf);
+}
+
+
+cd_error_t cd_snapshot_write_json(cd_state_t* state, cd_writebuf_t* buf) {
+  QUEUE* q;
+  int fields[6];
+  int i;
+
+  cd_snapshot_json_header(buf, state->nodes.id, state->edges.count);
+
+  /* Print all accumulated nodes */
+  CD_WRITEBUF_PUT_LIT(buf, "  \"nodes\": [\n");
+  QUEUE_FOREACH(q, &state->nodes.list) {
+    cd_node_t* node;
+
+    node = container_of(q, cd_node_t, member);
+    fields[0] = node->type;
+    fields[1] = node->name;
+    fields[2] = node->id;
+    fields[3] = node->size;
+    fields[4] = node->edge_count;
+    fields[5] = 0;
+    cd_snapshot_json_row(buf,
+                         fields,
+                         kCDNodeFieldCount,
+                         q == QUEUE_PREV(&state->nodes.list));
+  }
+  CD_WRITEBUF_PUT_LIT(buf, "  ],\n");
+
+  /* Print all accumulated edges */
+  CD_WRITEBUF_PUT_LIT(buf, "  \"edges\": [\n");
+  for (i = 0; i < state->edges.count; i++) {
+    cd_edge_t* edge;
+
+    edge = &state->edges.list[i];
+    fields[0] = edge->type;
+    fields[1] = edge->name;
+    fields[2] = edge->to * kCDNodeFieldCount;
+    cd_snapshot_json_row(buf,
+                         fields,
+                         kCDEdgeFieldCount,
+                         i == state->edges.count - 1);
+  }
+  CD_WRITEBUF_PUT_LIT(buf, "  ],\n");
+
+  /* Print all accumulated strings */
+  CD_WRITEBUF_PUT_LIT(buf,
+                      "  \"trace_function_infos\": [],\n"
+                      "  \"trace_tree\": [],\n"
+                      "  \"strings\": [ ");
+  cd_strings_print(&state->strings, buf);
+  cd_snapshot_json_footer(buf);
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_snapshot_write_binary(cd_state_t* state, cd_writebuf_t* buf) {
+  QUEUE* q;
+  uint64_t nodes_off;
+  uint64_t edges_off;
+  uint64_t strings_off;
+  uint64_t data_off;
+  uint64_t data_size;
+  uint64_t off;
+  int i;
+
+  data_size = 0;
+  for (i = 0; i < state->strings.count; i++)
+    data_size += state->strings.items[i]->len;
+
+  nodes_off = CD_SNAPSHOT_HEADER_SIZE;
+  edges_off = nodes_off + (uint64_t) state->nodes.id * kCDNodeFieldCount * 4;
+  strings_off = edges_off + (uint64_t) state->edges.count *
+                kCDEdgeFieldCount * 4;
+  strings_off = (strings_off + 7) & ~7ULL;
+  data_off = strings_off + ((uint64_t) state->strings.count + 1) * 8;
+
+  /* Header */
+  cd_writebuf_put_raw(buf, CD_SNAPSHOT_MAGIC, sizeof(CD_SNAPSHOT_MAGIC));
+  cd_writebuf_put_u32(buf, CD_SNAPSHOT_VERSION);
+  cd_writebuf_put_u32(buf, kCDNodeFieldCount);
+  cd_writebuf_put_u32(buf, kCDEdgeFieldCount);
+  cd_writebuf_put_u32(buf, 0);
+  cd_writebuf_put_u64(buf, state->nodes.id);
+  cd_writebuf_put_u64(buf, state->edges.count);
+  cd_writebuf_put_u64(buf, state->strings.count);
+  cd_writebuf_put_u64(buf, nodes_off);
+  cd_writebuf_put_u64(buf, edges_off);
+  cd_writebuf_put_u64(buf, strings_off);
+  cd_writebuf_put_u64(buf, data_off);
+  cd_writebuf_put_u64(buf, data_off + data_size);
+
+  QUEUE_FOREACH(q, &state->nodes.list) {
+    cd_node_t* node;
+
+    node = container_of(q, cd_node_t, member);
+    cd_writebuf_put_u32(buf, node->type);
+    cd_writebuf_put_u32(buf, node->name);
+    cd_writebuf_put_u32(buf, node->id);
+    cd_writebuf_put_u32(buf, node->size);
+    cd_writebuf_put_u32(buf, node->edge_count);
+    cd_writebuf_put_u32(buf, 0);
+  }
+
+  for (i = 0; i < state->edges.count; i++) {
+    cd_edge_t* edge;
+
+    edge = &state->edges.list[i];
+    cd_writebuf_put_u32(buf, edge->type);
+    cd_writebuf_put_u32(buf, edge->name);
+    cd_writebuf_put_u32(buf, edge->to);
+  }
+
+  off = (uint64_t) state->edges.count * kCDEdgeFieldCount * 4;
+  cd_snapshot_pad(buf, &off);
+
+  /* String offsets, the last one is the end of the data */
+  off = 0;
+  for (i = 0; i < state->strings.count; i++) {
+    cd_writebuf_put_u64(buf, off);
+    off += state->strings.items[i]->len;
+  }
+  cd_writebuf_put_u64(buf, off);
+
+  for (i = 0; i < state->strings.count; i++) {
+    cd_strings_item_t* item;
+
+    item = state->strings.items[i];
+    cd_writebuf_put_raw(buf, item->str, item->len);
+  }
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_snapshot_convert(const char* path, cd_writebuf_t* buf) {
+  cd_error_t err;
+  struct stat sbuf;
+  void* addr;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return cd_error_num(kCDErrFileNotFound, errno);
+
+  if (fstat(fd, &sbuf) != 0) {
+    err = cd_error_num(kCDErrFStat, errno);
+    goto failed_fstat;
+  }
+
+  if (sbuf.st_size < CD_SNAPSHOT_HEADER_SIZE) {
+    err = cd_error(kCDErrNotEnoughMagic);
+    goto failed_fstat;
+  }
+
+  addr = mmap(NULL, sbuf.st_size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    err = cd_error_num(kCDErrMmap, errno);
+    goto failed_fstat;
+  }
+
+  err = cd_snapshot_convert_json(addr, sbuf.st_size, buf);
+  munmap(addr, sbuf.st_size);
+
+failed_fstat:
+  close(fd);
+  return err;
+}
+
+
+cd_error_t cd_snapshot_convert_json(const unsigned char* data,
+                                    uint64_t size,
+                                    cd_writebuf_t* buf) {
+  uint64_t node_count;
+  uint64_t edge_count;
+  uint64_t string_count;
+  uint64_t nodes_off;
+  uint64_t edges_off;
+  uint64_t strings_off;
+  uint64_t data_off;
+  const unsigned char* ptr;
+  int fields[6];
+  uint64_t i;
+  int j;
+
+  if (memcmp(data, CD_SNAPSHOT_MAGIC, sizeof(CD_SNAPSHOT_MAGIC)) != 0)
+    return cd_error_str(kCDErrInvalidMagic, "snapshot magic");
+  if (cd_snapshot_read_u32(data + 8) != CD_SNAPSHOT_VERSION ||
+      cd_snapshot_read_u32(data + 12) != kCDNodeFieldCount ||
+      cd_snapshot_read_u32(data + 16) != kCDEdgeFieldCount) {
+    return cd_error_str(kCDErrInvalidMagic, "snapshot version");
+  }
+
+  node_count = cd_snapshot_read_u64(data + 24);
+  edge_count = cd_snapshot_read_u64(data + 32);
+  string_count = cd_snapshot_read_u64(data + 40);
+  nodes_off = cd_snapshot_read_u64(data + 48);
+  edges_off = cd_snapshot_read_u64(data + 56);
+  strings_off = cd_snapshot_read_u64(data + 64);
+  data_off = cd_snapshot_read_u64(data + 72);
+
+  /* Counts are bounded by the size, so the products below can't overflow */
+  if (node_count > size || edge_count > size || string_count > size ||
+      nodes_off > size || edges_off > size || strings_off > size ||
+      data_off > size ||
+      node_count * kCDNodeFieldCount * 4 > size - nodes_off ||
+      edge_count * kCDEdgeFieldCount * 4 > size - edges_off ||
+      (string_count + 1) * 8 > size - strings_off) {
+    return cd_error_str(kCDErrSnapshotOOB, "snapshot sections");
+  }
+
+  cd_snapshot_json_header(buf, node_count, edge_count);
+
+  CD_WRITEBUF_PUT_LIT(buf, "  \"nodes\": [\n");
+  ptr = data + nodes_off;
+  for (i = 0; i < node_count; i++) {
+    for (j = 0; j < kCDNodeFieldCount; j++, ptr += 4)
+      fields[j] = cd_snapshot_read_u32(ptr);
+    cd_snapshot_json_row(buf, fields, kCDNodeFieldCount, i == node_count - 1);
+  }
+  CD_WRITEBUF_PUT_LIT(buf, "  ],\n");
+
+  CD_WRITEBUF_PUT_LIT(buf, "  \"edges\": [\n");
+  ptr = data + edges_off;
+  for (i = 0; i < edge_count; i++) {
+    for (j = 0; j < kCDEdgeFieldCount; j++, ptr += 4)
+      fields[j] = cd_snapshot_read_u32(ptr);
+    fields[2] *= kCDNodeFieldCount;
+    cd_snapshot_json_row(buf, fields, kCDEdgeFieldCount, i == edge_count - 1);
+  }
+  CD_WRITEBUF_PUT_LIT(buf, "  ],\n");
+
+  CD_WRITEBUF_PUT_LIT(buf,
+                      "  \"trace_function_infos\": [],\n"
+                      "  \"trace_tree\": [],\n"
+                      "  \"strings\": [ ");
+  ptr = data + strings_off;
+  for (i = 0; i < string_count; i++, ptr += 8) {
+    uint64_t start;
+    uint64_t end;
+
+    start = cd_snapshot_read_u64(ptr);
+    end = cd_snapshot_read_u64(ptr + 8);
+    if (start > end || end > size - data_off)
+      return cd_error_str(kCDErrSnapshotOOB, "snapshot string");
+
+    cd_strings_print_json(buf,
+                          (const char*) data + data_off + start,
+                          end - start);
+    if (i != string_count - 1)
+      CD_WRITEBUF_PUT_LIT(buf, ", ");
+  }
+  cd_snapshot_json_footer(buf);
+
+  return cd_ok();
+}
+
+
+void cd_snapshot_json_header(cd_writebuf_t* buf,
+                             uint64_t node_count,
+                             uint64_t edge_count) {
+  cd_writebuf_put(
+      buf,
+      "{\n"
+      "  \"snapshot\": {\n"
+      "    \"title\": \"heapdump by core2dump\",\n"
+      "    \"uid\": %d,\n"
+      "    \"meta\": {\n"
+      "      \"node_fields\": [\n"
+      "        \"type\", \"name\", \"id\", \"self_size\", \"edge_count\",\n"
+      "        \"trace_node_id\"\n"
+      "      ],\n"
+      "      \"node_types\": [\n"
+      "        [ \"hidden\", \"array\", \"string\", \"object\", \"code\",\n"
+      "          \"closure\", \"regexp\", \"number\", \"native\",\n"
+      "          \"synthetic\", \"concatenated string\", \"sliced string\" ],\n"
+      "        \"string\", \"number\", \"number\", \"number\", \"number\",\n"
+      "        \"number\"\n"
+      "      ],\n"
+      "      \"edge_fields\": [ \"type\", \"name_or_index\", \"to_node\" ],\n"
+      "      \"edge_types\": [\n"
+      "        [ \"context\", \"element\", \"property\", \"internal\",\n"
+      "          \"hidden\", \"shortcut\", \"weak\" ],\n"
+      "        \"string_or_number\", \"node\"\n"
+      "      ],\n"
+      "      \"trace_function_info_fields\": [\n"
+      "        \"function_id\", \"name\", \"script_name\", \"script_id\",\n"
+      "        \"line\", \"column\"\n"
+      "      ],\n"
+      "      \"trace_node_fields\": [\n"
+      "        \"id\", \"function_info_index\", \"count\", \"size\",\n"
+      "        \"children\"\n"
+      "      ]\n"
+      "    },\n"
+      "    \"node_count\": %llu,\n"
+      "    \"edge_count\": %llu,\n"
+      "    \"trace_function_count\": %d\n"
+      "  },\n",
+      42,
+      (unsigned long long) node_count,
+      (unsigned long long) edge_count,
+      0);
+}
+
+
+void cd_snapshot_json_row(cd_writebuf_t* buf,
+                          const int* fields,
+                          int count,
+                          int last) {
+  int i;
+
+  CD_WRITEBUF_PUT_LIT(buf, "    ");
+  for (i = 0; i < count; i++) {
+    if (i != 0)
+      CD_WRITEBUF_PUT_LIT(buf, ", ");
+    cd_writebuf_put_int(buf, fields[i]);
+  }
+
+  if (last)
+    CD_WRITEBUF_PUT_LIT(buf, "\n");
+  else
+    CD_WRITEBUF_PUT_LIT(buf, ",\n");
+}
+
+
+void cd_snapshot_json_footer(cd_writebuf_t* buf) {
+  CD_WRITEBUF_PUT_LIT(buf, " ]\n}\n");
+}
+
+
+void cd_snapshot_pad(cd_writebuf_t* buf, uint64_t* off) {
+  static const char zero[8];
+
+  if ((*off & 7) == 0)
+    return;
+
+  cd_writebuf_put_raw(buf, zero, 8 - (*off & 7));
+  *off = (*off + 7) & ~7ULL;
+}
+
+
+uint32_t cd_snapshot_read_u32(const unsigned char* ptr) {
+  return (uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) |
+         ((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+
+uint64_t cd_snapshot_read_u64(const unsigned char* ptr) {
+  return (uint64_t) cd_snapshot_read_u32(ptr) |
+         ((uint64_t) cd_snapshot_read_u32(ptr + 4) << 32);
+}
@@ -0,0 +1,46 @@
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include "common.h"
+#include "error.h"
+
+/* Forward-declarations */
+struct cd_state_s;
+
+/*
+ * Binary snapshot, all integers are little-endian:
+ *
+ *   header (88 bytes):
+ *     char magic[8] = "C2DSNAP\0"
+ *     u32 version, node_fields, edge_fields, reserved
+ *     u64 node_count, edge_count, string_count
+ *     u64 nodes_off, edges_off, strings_off, string_data_off, size
+ *   nodes: u32[node_count * node_fields]
+ *     type, name, id, self_size, edge_count, trace_node_id
+ *   edges: u32[edge_count * edge_fields]
+ *     type, name_or_index, to_node (index of the node, not the offset)
+ *   strings: u64[string_count + 1], offsets into the string data
+ *   string data: UTF-8, not terminated
+ *
+ * Sections are 8-byte aligned, so the file could be mmap()-ed and used as is.
+ */
+
+#define CD_SNAPSHOT_MAGIC "C2DSNAP"
+#define CD_SNAPSHOT_VERSION 1
+#define CD_SNAPSHOT_HEADER_SIZE 88
+
+typedef enum cd_snapshot_format_e cd_snapshot_format_t;
+
+enum cd_snapshot_format_e {
+  kCDSnapshotJSON,
+  kCDSnapshotBinary
+};
+
+cd_error_t cd_snapshot_write(struct cd_state_s* state,
+                             cd_writebuf_t* buf,
+                             cd_snapshot_format_t format);
+
+/* Print binary snapshot at `path` as JSON */
+cd_error_t cd_snapshot_convert(const char* path, cd_writebuf_t* buf);
+
+#endif  /* SRC_SNAPSHOT_H_ */
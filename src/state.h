@@ -12,25 +12,67 @@ typedef struct cd_state_s cd_state_t;
 struct cd_state_s {
   cd_obj_t* core;
   int thread_id;
+  int all_threads;
+
+  /* Only frames are collected, the visitor is not initialized */
+  int trace;
+
   int output;
   int ptr_size;
+  int jobs;
+
+  /* Nodes and frames */
+  cd_arena_t arena;
 
   /* Collector's stuff */
   QUEUE frames;
   int frame_count;
 
+  /* `frame_count` before the first frame of the current thread */
+  int frame_start;
+
   QUEUE queue;
   struct {
     int id;
     int count;
     cd_node_t root;
     QUEUE list;
-    cd_hashmap_t map;
+    QUEUE failed;
+    cd_ptrmap_t map;
   } nodes;
+
+  /* Map pointer => cd_map_info_t */
+  cd_ptrmap_t maps;
+
+  /* Property keys of the collector and the serial traversal */
+  cd_key_cache_t* keys;
+
   struct {
-    cd_hashmap_t map;
+    /* Appended during the traversal, first one is for the collector */
+    cd_edge_list_t* pending;
+    int pending_count;
+
+    /* Sorted by `from`, built by cd_visit_roots() */
+    cd_edge_t* list;
     int count;
+
+    /* Indexes into `list`, grouped by `to`, built by cd_visitor_incoming() */
+    int* incoming;
+    int* incoming_offsets;
   } edges;
+  struct {
+    int count;
+    cd_visitor_worker_t* list;
+
+    /* Nodes queued, but not yet visited */
+    int pending;
+
+    /* Idle workers wait on `cond` until `gen` changes */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int idle;
+    int gen;
+  } workers;
 
   cd_strings_t strings;
 };
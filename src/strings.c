@@ -1,73 +1,307 @@
 #include "strings.h"
 #include "common.h"
 #include "error.h"
-#include "queue.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#endif  /* defined(__SSE2__) */
+
+
+typedef struct cd_strings_hash_s cd_strings_hash_t;
+
+/* MurmurHash3 state, the input may come in several parts */
+struct cd_strings_hash_s {
+  uint32_t hash;
+  uint32_t chunk;
+  unsigned int chunk_len;
+  unsigned int len;
+};
+
+
+static const unsigned int kCDStringsInitialSize = 65536;
+static const int kCDStringsSlabSize = 262144;  /* 256kb */
+static const int kCDJsonVectorSize = 16;
+static const int kCDJsonMaxEscape = 6;
+
+
+static uint32_t cd_strings_hash(const char* left,
+                                int left_len,
+                                const char* right,
+                                int right_len);
+static void cd_strings_hash_update(cd_strings_hash_t* st,
+                                   const char* str,
+                                   int len);
+static cd_strings_item_t* cd_strings_find(cd_strings_t* strings,
+                                          uint32_t hash,
+                                          const char* left,
+                                          int left_len,
+                                          const char* right,
+                                          int right_len);
+static void cd_strings_insert(cd_strings_t* strings, cd_strings_item_t* item);
+static int cd_strings_grow(cd_strings_t* strings, unsigned int size);
+static cd_error_t cd_strings_intern(cd_strings_t* strings,
+                                    const char** res,
+                                    int* index,
+                                    const char* left,
+                                    int left_len,
+                                    const char* right,
+                                    int right_len);
+#if defined(__SSE2__)
+static unsigned int cd_strings_json_special(const unsigned char* p);
+#endif  /* defined(__SSE2__) */
+static int cd_strings_json_escape(const unsigned char** pp,
+                                  const unsigned char* end,
+                                  char* out);
+
+
+/* Escaped in JSON output, see `cd_strings_json_escape` */
+#define CD_JSON_IS_SPECIAL(c)                                                 \
+    ((c) < 0x20 || (c) == '"' || (c) == '\\' || (c) == '/' ||                \
+     ((c) & 0xe0) == 0xc0)
+
+
+#define CD_MURMUR3_C1 0xcc9e2d51
+#define CD_MURMUR3_C2 0x1b873593
 
-static const int kCDStringsInitialSize = 65536;
-
-
-static cd_error_t cd_strings_add(cd_strings_t* strings,
-                                 cd_strings_item_t* item,
-                                 const char** res,
-                                 int* index);
-static void cd_strings_print_json(cd_strings_t* strings,
-                                  cd_writebuf_t* buf,
-                                  cd_strings_item_t* item);
 
 cd_error_t cd_strings_init(cd_strings_t* strings) {
-  QUEUE_INIT(&strings->queue);
-
-  if (cd_hashmap_init(&strings->map, kCDStringsInitialSize, 0) != 0)
-    return cd_error_str(kCDErrNoMem, "cd_hashmap_t strings");
+  strings->table = calloc(kCDStringsInitialSize, sizeof(*strings->table));
+  if (strings->table == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_strings_t table");
+  strings->mask = kCDStringsInitialSize - 1;
+
+  if (pthread_mutex_init(&strings->lock, NULL) != 0) {
+    free(strings->table);
+    return cd_error_str(kCDErrNoMem, "cd_strings_t lock");
+  }
 
+  cd_arena_init(&strings->arena, kCDStringsSlabSize);
+  strings->items = NULL;
   strings->count = 0;
+  strings->size = 0;
 
   return cd_ok();
 }
 
 
 void cd_strings_destroy(cd_strings_t* strings) {
-  while (!QUEUE_EMPTY(&strings->queue)) {
-    QUEUE* q;
+  /* Items are allocated in the arena */
+  cd_arena_destroy(&strings->arena);
+
+  free(strings->items);
+  free(strings->table);
+  strings->items = NULL;
+  strings->table = NULL;
+  pthread_mutex_destroy(&strings->lock);
+}
+
+
+uint32_t cd_strings_hash(const char* left,
+                         int left_len,
+                         const char* right,
+                         int right_len) {
+  cd_strings_hash_t st;
+  uint32_t hash;
+  uint32_t k;
+
+  st.hash = 0;
+  st.chunk = 0;
+  st.chunk_len = 0;
+  st.len = 0;
+  cd_strings_hash_update(&st, left, left_len);
+  cd_strings_hash_update(&st, right, right_len);
+
+  hash = st.hash;
+  if (st.chunk_len != 0) {
+    k = st.chunk;
+    k *= CD_MURMUR3_C1;
+    k = (k << 15) | (k >> 17);
+    k *= CD_MURMUR3_C2;
+    hash ^= k;
+  }
+
+  hash ^= st.len;
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+
+void cd_strings_hash_update(cd_strings_hash_t* st, const char* str, int len) {
+  const unsigned char* p;
+  const unsigned char* end;
+
+  p = (const unsigned char*) str;
+  end = p + len;
+  st->len += len;
+
+  /* Chunks are little-endian, so that the split does not change the hash */
+  while (p != end) {
+    uint32_t k;
+
+    if (st->chunk_len == 0 && end - p >= 4) {
+      k = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+      p += 4;
+    } else {
+      st->chunk |= (uint32_t) *(p++) << (8 * st->chunk_len);
+      if (++st->chunk_len != 4)
+        continue;
+      k = st->chunk;
+      st->chunk = 0;
+      st->chunk_len = 0;
+    }
+
+    k *= CD_MURMUR3_C1;
+    k = (k << 15) | (k >> 17);
+    k *= CD_MURMUR3_C2;
+
+    st->hash ^= k;
+    st->hash = (st->hash << 13) | (st->hash >> 19);
+    st->hash *= 5;
+    st->hash += 0xe6546b64;
+  }
+}
+
+
+#undef CD_MURMUR3_C1
+#undef CD_MURMUR3_C2
+
+
+cd_strings_item_t* cd_strings_find(cd_strings_t* strings,
+                                   uint32_t hash,
+                                   const char* left,
+                                   int left_len,
+                                   const char* right,
+                                   int right_len) {
+  uint32_t index;
+
+  for (index = hash & strings->mask;
+       strings->table[index] != NULL;
+       index = (index + 1) & strings->mask) {
     cd_strings_item_t* item;
 
-    q = QUEUE_HEAD(&strings->queue);
-    QUEUE_REMOVE(q);
+    item = strings->table[index];
+    if (item->hash == hash &&
+        item->len == left_len + right_len &&
+        memcmp(item->str, left, left_len) == 0 &&
+        memcmp(item->str + left_len, right, right_len) == 0) {
+      return item;
+    }
+  }
+
+  return NULL;
+}
+
+
+void cd_strings_insert(cd_strings_t* strings, cd_strings_item_t* item) {
+  uint32_t index;
 
-    item = container_of(q, cd_strings_item_t, member);
-    free(item);
+  for (index = item->hash & strings->mask;
+       strings->table[index] != NULL;
+       index = (index + 1) & strings->mask) {
   }
+  strings->table[index] = item;
+}
+
+
+int cd_strings_grow(cd_strings_t* strings, unsigned int size) {
+  cd_strings_item_t** table;
+  int i;
+
+  table = calloc(size, sizeof(*table));
+  if (table == NULL)
+    return -1;
+
+  /* Hashes are stored, nothing is rehashed */
+  free(strings->table);
+  strings->table = table;
+  strings->mask = size - 1;
+  for (i = 0; i < strings->count; i++)
+    cd_strings_insert(strings, strings->items[i]);
 
-  cd_hashmap_destroy(&strings->map);
+  return 0;
 }
 
 
-cd_error_t cd_strings_add(cd_strings_t* strings,
-                          cd_strings_item_t* item,
-                          const char** res,
-                          int* index) {
-  int r;
+cd_error_t cd_strings_intern(cd_strings_t* strings,
+                             const char** res,
+                             int* index,
+                             const char* left,
+                             int left_len,
+                             const char* right,
+                             int right_len) {
+  cd_error_t err;
+  cd_strings_item_t* item;
+  uint32_t hash;
+
+  /* Outside of the lock, it is the most of the work on a hit */
+  hash = cd_strings_hash(left, left_len, right, right_len);
+
+  pthread_mutex_lock(&strings->lock);
 
-  r = cd_hashmap_insert(&strings->map, item->str, item->len, item);
-  if (r != 0) {
-    free(item);
-    return cd_error_str(kCDErrNoMem, "hashmap insert strings.map failure");
+  /* Check if the string is already known */
+  item = cd_strings_find(strings, hash, left, left_len, right, right_len);
+  if (item != NULL)
+    goto done;
+
+  /* Up to a half of the table is used */
+  if ((unsigned int) strings->count >= (strings->mask + 1) / 2 &&
+      cd_strings_grow(strings, (strings->mask + 1) * 2) != 0) {
+    err = cd_error_str(kCDErrNoMem, "cd_strings_t table");
+    goto fatal;
+  }
+
+  if (strings->count == strings->size) {
+    cd_strings_item_t** items;
+    int size;
+
+    size = strings->size == 0 ? (int) kCDStringsInitialSize :
+                                strings->size * 2;
+    items = realloc(strings->items, sizeof(*items) * size);
+    if (items == NULL) {
+      err = cd_error_str(kCDErrNoMem, "cd_strings_t items");
+      goto fatal;
+    }
+    strings->items = items;
+    strings->size = size;
+  }
+
+  /* Copy both parts into the arena, and insert into the table */
+  item = cd_arena_alloc(&strings->arena,
+                        sizeof(*item) + left_len + right_len + 1);
+  if (item == NULL) {
+    err = cd_error_str(kCDErrNoMem, "strdup failure");
+    goto fatal;
   }
+  memcpy(item->str, left, left_len);
+  memcpy(item->str + left_len, right, right_len);
+  item->len = left_len + right_len;
+  item->str[item->len] = '\0';
+  item->hash = hash;
   item->index = strings->count++;
 
-  QUEUE_INSERT_TAIL(&strings->queue, &item->member);
+  strings->items[item->index] = item;
+  cd_strings_insert(strings, item);
 
+done:
   if (res != NULL)
     *res = item->str;
   if (index != NULL)
     *index = item->index;
+  err = cd_ok();
 
-  return cd_ok();
+fatal:
+  pthread_mutex_unlock(&strings->lock);
+  return err;
 }
 
 
@@ -76,29 +310,7 @@ cd_error_t cd_strings_copy(cd_strings_t* strings,
                            int* index,
                            const char* str,
                            int len) {
-  cd_strings_item_t* item;
-
-  /* Check if the string is already known */
-  item = cd_hashmap_get(&strings->map, str, len);
-  if (item != NULL) {
-    if (index != NULL)
-      *index = item->index;
-    if (res != NULL)
-      *res = item->str;
-
-    /* Return existing string */
-    return cd_ok();
-  }
-
-  /* Duplicate string and insert into the list and hashmap */
-  item = malloc(sizeof(*item) + len + 1);
-  if (item == NULL)
-    return cd_error_str(kCDErrNoMem, "strdup failure");
-  memcpy(item->str, str, len);
-  item->len = len;
-  item->str[item->len] = '\0';
-
-  return cd_strings_add(strings, item, res, index);
+  return cd_strings_intern(strings, res, index, str, len, "", 0);
 }
 
 
@@ -109,133 +321,190 @@ cd_error_t cd_strings_concat(cd_strings_t* strings,
                              int left_len,
                              const char* right,
                              int right_len) {
-  cd_strings_item_t* item;
-  cd_strings_item_t* cached;
+  /* Looked up by parts, joined only if it is a new string */
+  return cd_strings_intern(strings,
+                           res,
+                           index,
+                           left,
+                           left_len,
+                           right,
+                           right_len);
+}
 
-  /* Duplicate string and insert into the list and hashmap */
-  item = malloc(sizeof(*item) + left_len + right_len + 1);
-  if (item == NULL)
-    return cd_error_str(kCDErrNoMem, "cd_strings_item_t concat");
 
-  memcpy(item->str, left, left_len);
-  memcpy(item->str + left_len, right, right_len);
-  item->len = left_len + right_len;
-  item->str[item->len] = '\0';
+cd_error_t cd_strings_reorder(cd_strings_t* strings, int* map, int count) {
+  cd_strings_item_t** items;
+  int i;
 
-  /* Check if the string is already known */
-  cached = cd_hashmap_get(&strings->map, item->str, item->len);
-  if (cached != NULL) {
-    free(item);
-    if (index != NULL)
-      *index = cached->index;
-    if (res != NULL)
-      *res = cached->str;
-
-    /* Return existing string */
-    return cd_ok();
+  items = calloc(count, sizeof(*items));
+  if (items == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_strings_item_t reorder");
+
+  /* Drop strings without a new index, and sort the rest */
+  for (i = 0; i < strings->count; i++) {
+    cd_strings_item_t* item;
+
+    /* Unused items stay in the arena until destroy */
+    item = strings->items[i];
+    if (map[item->index] == -1)
+      continue;
+
+    item->index = map[item->index];
+    items[item->index] = item;
   }
 
+  free(strings->items);
+  strings->items = items;
+  strings->count = count;
+  strings->size = count;
 
-  return cd_strings_add(strings, item, res, index);
+  /* Rebuild the table without the dropped items */
+  memset(strings->table, 0, sizeof(*strings->table) * (strings->mask + 1));
+  for (i = 0; i < count; i++)
+    cd_strings_insert(strings, items[i]);
+
+  return cd_ok();
 }
 
 
 void cd_strings_print(cd_strings_t* strings, cd_writebuf_t* buf) {
-  QUEUE* q;
+  int i;
 
-  QUEUE_FOREACH(q, &strings->queue) {
+  for (i = 0; i < strings->count; i++) {
     cd_strings_item_t* item;
 
-    item = container_of(q, cd_strings_item_t, member);
-    cd_strings_print_json(strings, buf, item);
-    if (q != QUEUE_PREV(&strings->queue))
-      cd_writebuf_put(buf, ", ");
+    item = strings->items[i];
+    cd_strings_print_json(buf, item->str, item->len);
+    if (i != strings->count - 1)
+      CD_WRITEBUF_PUT_LIT(buf, ", ");
   }
 }
 
 
-void cd_strings_print_json(cd_strings_t* strings,
-                           cd_writebuf_t* buf,
-                           cd_strings_item_t* item) {
-  int i;
-  int size;
-  static char storage[1024];
-  char* str;
-  char* ptr;
-
-  /* Calculate string size */
-  size = 0;
-  for (i = 0; i < item->len; i++) {
-    unsigned char c;
-
-    c = (unsigned char) item->str[i];
-    /* \" \\ \/ \b \f \r \n \t */
-    if (c == '"' || c == '\\' || c == '/' || c == 8 || c == 9 ||
-        c == 10 || c == 12 || c == 13) {
-      size += 2;
-
-    /* Two-byte char, encode as \uXXXX */
-    } else if ((c & 0xe0) == 0xc0 || c < 32) {
-      if (c < 32 || i == item->len - 1)
-        size += 6;
-      else
-        size += 5;
-    } else {
-      size++;
+void cd_strings_print_json(cd_writebuf_t* buf, const char* data, int len) {
+  const unsigned char* p;
+  const unsigned char* end;
+  char* out;
+
+  p = (const unsigned char*) data;
+  end = p + len;
+
+  CD_WRITEBUF_PUT_LIT(buf, "\"");
+  while (p != end) {
+#if defined(__SSE2__)
+    /* Skip a clean run a vector at a time, the tail is done below */
+    if (end - p >= kCDJsonVectorSize) {
+      unsigned int mask;
+      int n;
+
+      out = cd_writebuf_reserve(buf, kCDJsonVectorSize);
+      mask = cd_strings_json_special(p);
+
+      /* Store all of it, but keep only the clean prefix */
+      _mm_storeu_si128((__m128i*) out, _mm_loadu_si128((const __m128i*) p));
+      n = mask == 0 ? kCDJsonVectorSize : __builtin_ctz(mask);
+      buf->off += n;
+      p += n;
+      if (n == kCDJsonVectorSize)
+        continue;
     }
-  }
+#endif  /* defined(__SSE2__) */
 
-  /* Allocate enough space */
-  if (size + 1 > (int) sizeof(storage))
-    str = malloc(size + 1);
-  else
-    str = storage;
-
-  /* Encode string */
-  for (ptr = str, i = 0; i < item->len; i++) {
-    unsigned char c;
-
-    c = (unsigned char) item->str[i];
-    /* \" \\ \/ \b \f \r \n \t */
-    if (c == '"' || c == '\\' || c == '/' || c == 8 || c == 9 ||
-        c == 10 || c == 12 || c == 13) {
-      *(ptr++) = '\\';
-      if (c == 8)
-        *(ptr++) = 'b';
-      else if (c == 9)
-        *(ptr++) = 't';
-      else if (c == 10)
-        *(ptr++) = 'n';
-      else if (c == 12)
-        *(ptr++) = 'f';
-      else if (c == 13)
-        *(ptr++) = 'r';
-      else
-        *(ptr++) = c;
-    /* Two-byte char, encode as \uXXXX */
-    } else if ((c & 0xe0) == 0xc0 || c < 32) {
-      unsigned char s;
-
-      *(ptr++) = '\\';
-      *(ptr++) = 'u';
-
-      if (c < 32) {
-        ptr += sprintf(ptr, "00%02x", c);
-      } else {
-        if (i == item->len - 1)
-          s = 0;
-        else
-          s = (unsigned char) item->str[i++];
-        ptr += sprintf(ptr, "%02x%02x", c, s);
-      }
-
-    } else {
-      *(ptr++) = c;
+    out = cd_writebuf_reserve(buf, kCDJsonMaxEscape);
+    if (!CD_JSON_IS_SPECIAL(*p)) {
+      *out = *(p++);
+      buf->off++;
+      continue;
     }
+
+    buf->off += cd_strings_json_escape(&p, end, out);
   }
+  CD_WRITEBUF_PUT_LIT(buf, "\"");
+}
+
+
+#if defined(__SSE2__)
+unsigned int cd_strings_json_special(const unsigned char* p) {
+  __m128i v;
+  __m128i r;
 
-  cd_writebuf_put(buf, "\"%.*s\"", size, str);
+  v = _mm_loadu_si128((const __m128i*) p);
+
+  /* Control characters: c <= 0x1f */
+  r = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0x1f)),
+                     _mm_set1_epi8(0x1f));
+  r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('"')));
+  r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  r = _mm_or_si128(r, _mm_cmpeq_epi8(v, _mm_set1_epi8('/')));
+
+  /* Lead bytes of two-byte sequences: (c & 0xe0) == 0xc0 */
+  r = _mm_or_si128(r,
+                   _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0xe0)),
+                                  _mm_set1_epi8(0xc0)));
+
+  return _mm_movemask_epi8(r);
+}
+#endif  /* defined(__SSE2__) */
+
+
+int cd_strings_json_escape(const unsigned char** pp,
+                           const unsigned char* end,
+                           char* out) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char* p;
+  unsigned int code;
+  char esc;
+
+  p = *pp;
+  code = *(p++);
+
+  /* \" \\ \/ \b \f \r \n \t */
+  switch (code) {
+    case '"':
+    case '\\':
+    case '/':
+      esc = code;
+      break;
+    case 8:
+      esc = 'b';
+      break;
+    case 9:
+      esc = 't';
+      break;
+    case 10:
+      esc = 'n';
+      break;
+    case 12:
+      esc = 'f';
+      break;
+    case 13:
+      esc = 'r';
+      break;
+    default:
+      esc = 0;
+      break;
+  }
+  if (esc != 0) {
+    out[0] = '\\';
+    out[1] = esc;
+    *pp = p;
+    return 2;
+  }
 
-  if (str != storage)
-    free(str);
+  /*
+   * Two-byte char, encode as \uXXXX. A lead byte without a continuation
+   * one is taken as Latin-1, as are the control characters.
+   */
+  if (code >= 0xc0 && p != end && (*p & 0xc0) == 0x80)
+    code = ((code & 0x1f) << 6) | (*(p++) & 0x3f);
+
+  out[0] = '\\';
+  out[1] = 'u';
+  out[2] = hex[(code >> 12) & 0xf];
+  out[3] = hex[(code >> 8) & 0xf];
+  out[4] = hex[(code >> 4) & 0xf];
+  out[5] = hex[code & 0xf];
+
+  *pp = p;
+  return 6;
 }
@@ -3,20 +3,30 @@
 
 #include "common.h"
 #include "error.h"
-#include "queue.h"
+
+#include <pthread.h>
+#include <stdint.h>
 
 typedef struct cd_strings_s cd_strings_t;
 typedef struct cd_strings_item_s cd_strings_item_t;
 
 struct cd_strings_s {
-  QUEUE queue;
-  cd_hashmap_t map;
+  /* Open addressing over the stored hashes of `items` */
+  cd_strings_item_t** table;
+  unsigned int mask;
+
+  /* Indexed by `item->index`, items are in the arena */
+  cd_strings_item_t** items;
   int count;
+  int size;
+  cd_arena_t arena;
+
+  /* Strings are interned by all traversal threads */
+  pthread_mutex_t lock;
 };
 
 struct cd_strings_item_s {
-  QUEUE member;
-
+  uint32_t hash;
   int index;
   int len;
   char str[1];
@@ -37,6 +47,8 @@ cd_error_t cd_strings_concat(cd_strings_t* strings,
                              int left_len,
                              const char* right,
                              int right_len);
+cd_error_t cd_strings_reorder(cd_strings_t* strings, int* map, int count);
 void cd_strings_print(cd_strings_t* strings, cd_writebuf_t* buf);
+void cd_strings_print_json(cd_writebuf_t* buf, const char* data, int len);
 
 #endif  /* SRC_STRINGS_H_ */
@@ -1,7 +1,11 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 
 #include "v8constants.h"
+#include "cache.h"
+#include "common.h"
 #include "error.h"
 #include "obj.h"
 
@@ -10,26 +14,76 @@ CD_V8_REQUIRED_CONSTANTS_ENUM(CD_V8_CONSTANT_VALUE);
 CD_V8_OPTIONAL_CONSTANTS_ENUM(CD_V8_CONSTANT_VALUE);
 #undef CD_V8_CONSTANT_VALUE
 
+#define CD_V8_CONSTANT_COUNT(V, D) + 1
+enum {
+  kCDV8ConstantCount = 0
+      CD_V8_REQUIRED_CONSTANTS_ENUM(CD_V8_CONSTANT_COUNT)
+      CD_V8_OPTIONAL_CONSTANTS_ENUM(CD_V8_CONSTANT_COUNT)
+};
+#undef CD_V8_CONSTANT_COUNT
+
+/* Cached constants are valid only for the same list */
+#define CD_V8_CONSTANT_NAME(V, D) #V "\0"
+static const char cd_v8_constant_names[] =
+    CD_V8_REQUIRED_CONSTANTS_ENUM(CD_V8_CONSTANT_NAME)
+    CD_V8_OPTIONAL_CONSTANTS_ENUM(CD_V8_CONSTANT_NAME);
+#undef CD_V8_CONSTANT_NAME
+
+static const char kCDV8SymPrefix[] = "v8dbg_";
+
+typedef struct cd_v8_cached_s cd_v8_cached_t;
+typedef struct cd_v8_constant_s cd_v8_constant_t;
+typedef struct cd_v8_resolve_s cd_v8_resolve_t;
+
+/* `kCDCacheV8` payload: u32 count, u32 names hash, and `count` of these */
+struct cd_v8_cached_s {
+  int32_t value;
+  int32_t found;
+};
+
+struct cd_v8_constant_s {
+  const char* name;
+  int len;
+
+  /* `_v8dbg_` symbol wins over `v8dbg_` */
+  uint64_t addr;
+  int underscore;
+
+  cd_v8_cached_t res;
+  cd_v8_source_t source;
+};
+
+struct cd_v8_resolve_s {
+  cd_obj_t* owner;
+
+  /* Name without the prefix => index + 1 of the first such constant */
+  cd_hashmap_t names;
+};
+
+static cd_error_t cd_v8_find_owner(cd_obj_t* dso, void* arg);
+static cd_error_t cd_v8_resolve(cd_obj_t* core, cd_obj_t* owner);
+static cd_error_t cd_v8_lookup(cd_v8_resolve_t* st);
+static cd_error_t cd_v8_resolve_sym(cd_obj_t* obj,
+                                    cd_sym_t* sym,
+                                    void* arg);
+static cd_error_t cd_v8_open_cache(cd_obj_t* owner, cd_cache_t* cache);
+static void cd_v8_store_cache(cd_obj_t* owner);
+
 static int cd_v8_initialized;
+static cd_v8_constant_t cd_v8_constants[kCDV8ConstantCount];
+static const char* cd_v8_owner_path;
+static double cd_v8_elapsed;
 
 #define CD_V8_LOAD_CONSTANT(V, D, VERBOSE)                                    \
     do {                                                                      \
-      cd_error_t err;                                                         \
-      uint64_t addr;                                                          \
-      void* location;                                                         \
-      err = cd_obj_get_sym(core, "_v8dbg_" #V, &addr);                        \
-      if (!cd_is_ok(err))                                                     \
-        err = cd_obj_get_sym(core, "v8dbg_" #V, &addr);                       \
-      if (cd_is_ok(err))                                                      \
-        err = cd_obj_get(core, addr, sizeof(int), &location);                 \
-      if (!cd_is_ok(err)) {                                                   \
+      if (!cd_v8_constants[i].res.found) {                                    \
         cd_v8_##V = (D);                                                      \
         if ((VERBOSE))                                                        \
           fprintf(stderr, "Constant: " #V " was not found\n");                \
-        break;                                                                \
+      } else {                                                                \
+        cd_v8_##V = cd_v8_constants[i].res.value;                             \
       }                                                                       \
-      cd_v8_##V = *(int*) location;                                           \
-      break;                                                                  \
+      i++;                                                                    \
     } while (0);                                                              \
 
 #define CD_V8_LOAD_REQUIRED_CONSTANT(V, D)                                    \
@@ -40,19 +94,299 @@ static int cd_v8_initialized;
     CD_V8_LOAD_CONSTANT(V, D, 0)
 
 cd_error_t cd_v8_init(cd_obj_t* core) {
+  cd_error_t err;
+  struct timeval start;
+  struct timeval end;
+  cd_cache_t cache;
+  cd_obj_t* owner;
+  const char* name;
   int ptr_size;
+  int i;
 
   if (cd_v8_initialized)
     return cd_ok();
 
+  gettimeofday(&start, NULL);
+
+  name = cd_v8_constant_names;
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_v8_constants[i].name = name;
+    cd_v8_constants[i].len = strlen(name);
+    cd_v8_constants[i].addr = 0;
+    cd_v8_constants[i].underscore = 0;
+    cd_v8_constants[i].res.value = 0;
+    cd_v8_constants[i].res.found = 0;
+    cd_v8_constants[i].source = kCDV8SourceDefault;
+    name += cd_v8_constants[i].len + 1;
+  }
+
+  /* Constants are emitted together, find the DSO that has them */
+  owner = NULL;
+  err = cd_obj_iterate_dsos(core, cd_v8_find_owner, &owner);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (owner != NULL) {
+    cd_v8_owner_path = owner->path;
+
+    /* Constants of the same binary are the same, skip the symbols */
+    if (cd_is_ok(cd_v8_open_cache(owner, &cache))) {
+      cd_v8_cached_t* cached;
+
+      cached = (cd_v8_cached_t*) (cache.data + 8);
+      for (i = 0; i < kCDV8ConstantCount; i++) {
+        cd_v8_constants[i].res = cached[i];
+        if (cached[i].found)
+          cd_v8_constants[i].source = kCDV8SourceCache;
+      }
+      cd_cache_close(&cache);
+    } else {
+      err = cd_v8_resolve(core, owner);
+      if (!cd_is_ok(err))
+        return err;
+      cd_v8_store_cache(owner);
+    }
+  }
+
   /* Used in some optional consts */
   ptr_size = core->is_x64 ? 8 : 4;
+  i = 0;
   CD_V8_REQUIRED_CONSTANTS_ENUM(CD_V8_LOAD_REQUIRED_CONSTANT);
   CD_V8_OPTIONAL_CONSTANTS_ENUM(CD_V8_LOAD_OPTIONAL_CONSTANT);
 
+  gettimeofday(&end, NULL);
+  cd_v8_elapsed = (end.tv_sec - start.tv_sec) +
+                  (end.tv_usec - start.tv_usec) / 1e6;
+
   cd_v8_initialized = 1;
   return cd_ok();
 }
 
 #undef CD_V8_LOAD_REQUIRED_CONSTANT
 #undef CD_V8_LOAD_OPTIONAL_CONSTANT
+
+
+cd_error_t cd_v8_find_owner(cd_obj_t* dso, void* arg) {
+  uint64_t addr;
+
+  if (!cd_is_ok(cd_obj_get_sym(dso, "_v8dbg_HeapObjectTag", &addr)) &&
+      !cd_is_ok(cd_obj_get_sym(dso, "v8dbg_HeapObjectTag", &addr))) {
+    return cd_ok();
+  }
+
+  *(cd_obj_t**) arg = dso;
+  return cd_error(kCDErrSkip);
+}
+
+
+cd_error_t cd_v8_resolve(cd_obj_t* core, cd_obj_t* owner) {
+  cd_error_t err;
+  cd_v8_resolve_t st;
+  int i;
+
+  st.owner = owner;
+  if (cd_hashmap_init(&st.names, kCDV8ConstantCount * 2, 0) != 0)
+    return cd_error_str(kCDErrNoMem, "cd_hashmap_t");
+
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_v8_constant_t* c;
+
+    /* Some constants are listed twice */
+    c = &cd_v8_constants[i];
+    if (cd_hashmap_get(&st.names, c->name, c->len) != NULL)
+      continue;
+    if (cd_hashmap_insert(&st.names,
+                          c->name,
+                          c->len,
+                          (void*) (intptr_t) (i + 1)) != 0) {
+      cd_hashmap_destroy(&st.names);
+      return cd_error_str(kCDErrNoMem, "cd_hashmap_insert");
+    }
+  }
+
+  /*
+   * Only the owner is searched. Its hash table is cheaper than a pass over
+   * every symbol name, the pass is done only if there is no table.
+   */
+  err = cd_v8_lookup(&st);
+  if (err.code == kCDErrSkip)
+    err = cd_obj_iterate_syms(owner, cd_v8_resolve_sym, &st);
+  if (!cd_is_ok(err))
+    goto done;
+
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_v8_constant_t* c;
+    cd_v8_constant_t* first;
+    void* location;
+
+    c = &cd_v8_constants[i];
+    first = &cd_v8_constants[
+        (intptr_t) cd_hashmap_get(&st.names, c->name, c->len) - 1];
+    if (first->addr == 0)
+      continue;
+
+    err = cd_obj_get(core, first->addr, sizeof(int), &location);
+    if (!cd_is_ok(err))
+      continue;
+
+    c->res.value = *(int*) location;
+    c->res.found = 1;
+    c->source = kCDV8SourceSymbol;
+  }
+  err = cd_ok();
+
+done:
+  cd_hashmap_destroy(&st.names);
+  return err;
+}
+
+
+cd_error_t cd_v8_lookup(cd_v8_resolve_t* st) {
+  cd_error_t err;
+  char name[256];
+  int i;
+
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_v8_constant_t* c;
+    int r;
+
+    /* Duplicates are filled from the first one */
+    c = &cd_v8_constants[i];
+    if ((intptr_t) cd_hashmap_get(&st->names, c->name, c->len) != i + 1)
+      continue;
+
+    r = snprintf(name, sizeof(name), "_%s%s", kCDV8SymPrefix, c->name);
+    if (r < 0 || (unsigned int) r >= sizeof(name))
+      continue;
+
+    err = cd_obj_get_hashed_sym(st->owner, name, &c->addr);
+    if (cd_is_ok(err)) {
+      c->underscore = 1;
+      continue;
+    }
+    if (err.code != kCDErrNotFound)
+      return err;
+
+    err = cd_obj_get_hashed_sym(st->owner, name + 1, &c->addr);
+    if (err.code == kCDErrNotFound)
+      c->addr = 0;
+    else if (!cd_is_ok(err))
+      return err;
+  }
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_v8_resolve_sym(cd_obj_t* obj, cd_sym_t* sym, void* arg) {
+  cd_v8_resolve_t* st;
+  cd_v8_constant_t* c;
+  const char* name;
+  int nlen;
+  int underscore;
+  intptr_t index;
+
+  st = arg;
+  name = sym->name;
+  nlen = sym->nlen;
+
+  underscore = nlen > 0 && name[0] == '_';
+  if (underscore) {
+    name++;
+    nlen--;
+  }
+
+  if (nlen <= (int) sizeof(kCDV8SymPrefix) - 1 ||
+      memcmp(name, kCDV8SymPrefix, sizeof(kCDV8SymPrefix) - 1) != 0) {
+    return cd_ok();
+  }
+  name += sizeof(kCDV8SymPrefix) - 1;
+  nlen -= sizeof(kCDV8SymPrefix) - 1;
+
+  index = (intptr_t) cd_hashmap_get(&st->names, name, nlen);
+  if (index == 0)
+    return cd_ok();
+
+  c = &cd_v8_constants[index - 1];
+  if (c->addr != 0 && (c->underscore || !underscore))
+    return cd_ok();
+
+  c->addr = sym->value + obj->aslr;
+  c->underscore = underscore;
+  return cd_ok();
+}
+
+
+cd_error_t cd_v8_open_cache(cd_obj_t* owner, cd_cache_t* cache) {
+  cd_error_t err;
+
+  err = cd_cache_open(owner, kCDCacheV8, cache);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (cache->data_size != 8 + sizeof(cd_v8_cached_t) * kCDV8ConstantCount ||
+      *(uint32_t*) cache->data != kCDV8ConstantCount ||
+      *(uint32_t*) (cache->data + 4) !=
+          cd_murmur3(cd_v8_constant_names, sizeof(cd_v8_constant_names))) {
+    cd_cache_close(cache);
+    return cd_error_str(kCDErrNotFound, "cached v8 constants");
+  }
+
+  return cd_ok();
+}
+
+
+void cd_v8_store_cache(cd_obj_t* owner) {
+  cd_cache_writer_t writer;
+  uint32_t header[2];
+  int i;
+
+  /* Best effort, the next run will just look them up again */
+  if (!cd_is_ok(cd_cache_begin(owner, kCDCacheV8, &writer)))
+    return;
+
+  header[0] = kCDV8ConstantCount;
+  header[1] = cd_murmur3(cd_v8_constant_names, sizeof(cd_v8_constant_names));
+  cd_writebuf_put_raw(&writer.buf, (char*) header, sizeof(header));
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_writebuf_put_raw(&writer.buf,
+                        (char*) &cd_v8_constants[i].res,
+                        sizeof(cd_v8_constants[i].res));
+  }
+  cd_cache_end(&writer);
+}
+
+
+void cd_v8_print_stats() {
+  static const char* sources[] = { "default", "symbol", "cache" };
+  int counts[3];
+  int i;
+
+  counts[0] = 0;
+  counts[1] = 0;
+  counts[2] = 0;
+  for (i = 0; i < kCDV8ConstantCount; i++) {
+    cd_v8_constant_t* c;
+
+    c = &cd_v8_constants[i];
+    counts[c->source]++;
+    if (c->source == kCDV8SourceDefault) {
+      fprintf(stderr, "v8 constant %s: (default)\n", c->name);
+    } else {
+      fprintf(stderr,
+              "v8 constant %s: %d (%s)\n",
+              c->name,
+              c->res.value,
+              sources[c->source]);
+    }
+  }
+
+  fprintf(stderr,
+          "v8 constants: %d from symbols, %d cached, %d defaults "
+              "of %s in %.3fs\n",
+          counts[kCDV8SourceSymbol],
+          counts[kCDV8SourceCache],
+          counts[kCDV8SourceDefault],
+          cd_v8_owner_path == NULL ? "(none)" : cd_v8_owner_path,
+          cd_v8_elapsed);
+}
@@ -14,6 +14,7 @@
 static const int kCDV8RegExpPattern = 1;
 static const int kCDV8MapFieldOffset = 4;
 static const int kCDV8MapFieldCount = 2;
+static const int kCDV8CodeAlignment = 32;
 
 #define CD_V8_REQUIRED_CONSTANTS_ENUM(X)                                      \
     X(ConsStringTag, V8DBG_CONSSTRINGTAG)                                     \
@@ -246,6 +247,15 @@ static const int kCDV8MapFieldCount = 2;
       V8DBG_CLASS_SCRIPT__LINE_OFFSET__SMI)                                   \
     X(class_Script__column_offset__SMI,                                       \
       V8DBG_CLASS_SCRIPT__COLUMN_OFFSET__SMI)                                 \
+    X(class_Code__instruction_size__int,                                      \
+      V8DBG_CLASS_CODE__INSTRUCTION_SIZE__INT)                                \
+    X(class_Code__instruction_start__uintptr_t,                               \
+      V8DBG_CLASS_CODE__INSTRUCTION_START__UINTPTR_T)                         \
+    /* MemoryChunk layout is not exported, node.js v0.10 defaults */          \
+    X(MemoryChunk_alignment, 1 << 20)                                         \
+    X(class_MemoryChunk__size__size_t, 2 * ptr_size)                          \
+    X(class_MemoryChunk__area_start__Address, 4 * ptr_size)                   \
+    X(class_MemoryChunk__area_end__Address, 5 * ptr_size)                     \
     X(elements_fast_holey_elements, V8DBG_ELEMENTS_FAST_HOLEY_ELEMENTS)       \
     X(elements_fast_elements, V8DBG_ELEMENTS_FAST_ELEMENTS)                   \
     X(elements_dictionary_elements, V8DBG_ELEMENTS_DICTIONARY_ELEMENTS)       \
@@ -260,6 +270,18 @@ CD_V8_OPTIONAL_CONSTANTS_ENUM(CD_V8_CONSTANT_VALUE);
 
 #define CD_V8_TYPE(M, S) cd_v8_type_##M##__##S##_TYPE
 
+typedef enum cd_v8_source_e cd_v8_source_t;
+
+/* Where the value of the constant came from */
+enum cd_v8_source_e {
+  kCDV8SourceDefault,
+  kCDV8SourceSymbol,
+  kCDV8SourceCache
+};
+
 cd_error_t cd_v8_init(cd_obj_t* core);
 
+/* Provenance of every constant, and the time spent resolving them */
+void cd_v8_print_stats();
+
 #endif  /* SRC_V8_CONSTANTS_H_ */
@@ -41,8 +41,12 @@ cd_error_t cd_v8_get_obj_size(cd_state_t* state,
                               void* map,
                               int type,
                               int* size) {
+  cd_error_t err;
   int instance_size;
+  int len;
   uint8_t* ptr;
+  void** pval;
+  int* pint;
 
   LAZY_MAP
 
@@ -55,24 +59,83 @@ cd_error_t cd_v8_get_obj_size(cd_state_t* state,
     return cd_ok();
   }
 
-  /* Variable-size */
+  /* Variable-size, see HeapObject::SizeFromMap */
   if (type == CD_V8_TYPE(FixedArray, FIXED_ARRAY) ||
-      type == CD_V8_TYPE(FixedDoubleArray, FIXED_DOUBLE_ARRAY)) {
-    cd_error_t err;
-
-    err = cd_v8_get_fixed_arr_len(state, obj, size);
+      type == CD_V8_TYPE(FixedDoubleArray, FIXED_DOUBLE_ARRAY) ||
+      type == CD_V8_TYPE(ByteArray, BYTE_ARRAY)) {
+    err = cd_v8_get_fixed_arr_len(state, obj, &len);
     if (!cd_is_ok(err))
       return err;
 
-    *size *= state->ptr_size;
+    if (type == CD_V8_TYPE(FixedArray, FIXED_ARRAY))
+      len *= state->ptr_size;
+    else if (type == CD_V8_TYPE(FixedDoubleArray, FIXED_DOUBLE_ARRAY))
+      len *= sizeof(double);
 
     /* We are returning object size, not array size */
-    *size += cd_v8_class_FixedArray__data__uintptr_t;
+    *size = cd_v8_class_FixedArray__data__uintptr_t + len;
+  } else if (type < cd_v8_FirstNonstringType &&
+             (type & cd_v8_StringRepresentationMask) == cd_v8_SeqStringTag) {
+    V8_CORE_PTR(obj, cd_v8_class_String__length__SMI, pval);
+    if (!V8_IS_SMI(*pval))
+      return cd_error(kCDErrNotSMI);
+    len = V8_SMI(*pval);
+
+    if ((type & cd_v8_StringEncodingMask) == cd_v8_AsciiStringTag)
+      *size = cd_v8_class_SeqOneByteString__chars__char + len;
+    else
+      *size = cd_v8_class_SeqTwoByteString__chars__char + len * 2;
+  } else if (type == CD_V8_TYPE(FreeSpace, FREE_SPACE)) {
+    V8_CORE_PTR(obj, cd_v8_class_FreeSpace__size__SMI, pval);
+    if (!V8_IS_SMI(*pval))
+      return cd_error(kCDErrNotSMI);
+    *size = V8_SMI(*pval);
+  } else if (type == CD_V8_TYPE(Code, CODE)) {
+    V8_CORE_DATA(obj, cd_v8_class_Code__instruction_size__int, pint, 4);
+    *size = cd_v8_class_Code__instruction_start__uintptr_t + *pint;
+    *size = (*size + kCDV8CodeAlignment - 1) & ~(kCDV8CodeAlignment - 1);
+    return cd_ok();
+  } else {
+    *size = 0;
     return cd_ok();
   }
-  /* TODO(indutny) Support Code, and others */
 
-  *size = 0;
+  /* Objects are pointer-aligned */
+  *size = (*size + state->ptr_size - 1) & ~(state->ptr_size - 1);
+  return cd_ok();
+}
+
+
+cd_error_t cd_v8_get_obj_body(cd_state_t* state,
+                              int type,
+                              int size,
+                              int* start,
+                              int* end) {
+  /* Tagged slots after the map, see V8's BodyDescriptors */
+  *start = cd_v8_class_HeapObject__map__Map + state->ptr_size;
+  *end = size;
+
+  if (type < cd_v8_FirstNonstringType ||
+      type == CD_V8_TYPE(HeapNumber, HEAP_NUMBER) ||
+      type == CD_V8_TYPE(FixedDoubleArray, FIXED_DOUBLE_ARRAY) ||
+      type == CD_V8_TYPE(ByteArray, BYTE_ARRAY) ||
+      type == CD_V8_TYPE(FreeSpace, FREE_SPACE) ||
+      type == CD_V8_TYPE(Foreign, FOREIGN)) {
+    /* Raw data only, strings are visited separately */
+    *end = *start;
+  } else if (type == CD_V8_TYPE(Map, MAP)) {
+    /* Skip instance sizes and attributes */
+    *start = cd_v8_class_Map__prototype__Object;
+  } else if (type == CD_V8_TYPE(Code, CODE)) {
+    /* Header only, instructions and relocation info are raw */
+    *end = cd_v8_class_Code__instruction_start__uintptr_t;
+  }
+
+  if (*end > size)
+    *end = size;
+  if (*start > *end)
+    *start = *end;
+
   return cd_ok();
 }
 
@@ -66,6 +66,11 @@ cd_error_t cd_v8_get_obj_size(cd_state_t* state,
                               void* map,
                               int type,
                               int* size);
+cd_error_t cd_v8_get_obj_body(cd_state_t* state,
+                              int type,
+                              int size,
+                              int* start,
+                              int* end);
 cd_error_t cd_v8_to_cstr(cd_state_t* state,
                          void* str,
                          const char** res,
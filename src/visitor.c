@@ -6,20 +6,80 @@
 #include "v8helpers.h"
 #include "v8constants.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+static cd_error_t cd_visit_serial(cd_state_t* state);
+static cd_error_t cd_visit_parallel(cd_state_t* state);
+static void* cd_visitor_worker(void* arg);
+static void cd_visitor_wakeup(cd_state_t* state);
+static void cd_visitor_destroy_workers(cd_state_t* state, int count);
+static cd_node_t* cd_visitor_steal(cd_state_t* state,
+                                   cd_visitor_worker_t* worker);
+static void cd_visit_node(cd_state_t* state,
+                          cd_node_t* node,
+                          QUEUE* nodes,
+                          QUEUE* failed);
 static cd_error_t cd_visit_root(cd_state_t* state, cd_node_t* node);
+static void cd_visitor_sweep(cd_state_t* state, cd_node_t** nodes);
+static cd_error_t cd_visitor_build_edges(cd_state_t* state,
+                                         cd_node_t** nodes,
+                                         int* offsets);
+static cd_error_t cd_visitor_enumerate(cd_state_t* state,
+                                       cd_node_t** nodes,
+                                       int* offsets);
+static void cd_visitor_enumerate_from(cd_state_t* state,
+                                      cd_node_t** nodes,
+                                      int* offsets,
+                                      int* order,
+                                      cd_node_t* node);
+static cd_error_t cd_visitor_sort_edges(cd_state_t* state,
+                                        cd_node_t** nodes,
+                                        int* offsets);
+static cd_error_t cd_visitor_remap_strings(cd_state_t* state);
+static int cd_visitor_remap(int* map, int* count, int index);
+static int cd_node_sort(const cd_node_t** a, const cd_node_t** b);
 static cd_error_t cd_queue_range(cd_state_t* state,
                                  cd_node_t* from,
                                  char* start,
-                                 char* end);
+                                 char* end,
+                                 int index);
 static cd_error_t cd_add_node(cd_state_t* state, cd_node_t* node);
 static cd_error_t cd_node_init(cd_state_t* state,
+                               cd_arena_t* arena,
                                cd_node_t* node,
                                void* ptr,
                                void* map);
-static void cd_node_free(cd_state_t* state, cd_node_t* node);
+static cd_arena_t* cd_visitor_arena(cd_state_t* state, cd_node_t* node);
+static cd_key_cache_t* cd_visitor_key(cd_state_t* state,
+                                      cd_node_t* node,
+                                      void* key);
+static cd_error_t cd_map_info_get(cd_state_t* state,
+                                  cd_arena_t* arena,
+                                  void* map,
+                                  cd_map_info_t** res);
+static cd_error_t cd_map_info_load(cd_state_t* state,
+                                   void* map,
+                                   cd_map_info_t* info);
+static cd_error_t cd_map_info_layout(cd_state_t* state,
+                                     void* map,
+                                     cd_map_info_t* info);
+static cd_error_t cd_map_info_name(cd_state_t* state,
+                                   cd_map_info_t* info,
+                                   int* res);
+static cd_error_t cd_map_info_fields(cd_state_t* state,
+                                     cd_arena_t* arena,
+                                     void* map,
+                                     cd_map_info_t* info,
+                                     cd_map_fields_t** res);
+static void cd_node_push(cd_state_t* state, cd_node_t* from, cd_node_t* node);
+static int cd_edge_list_push(cd_edge_list_t* list,
+                             cd_node_t* from,
+                             cd_node_t* to,
+                             cd_edge_type_t type,
+                             int name,
+                             int tag);
 
 static cd_error_t cd_tag_obj_props(cd_state_t* state, cd_node_t* node);
 static cd_error_t cd_tag_obj_fast_props(cd_state_t* state,
@@ -70,9 +130,13 @@ static cd_error_t cd_tag(cd_state_t* state,
                          int tag_len);
 
 
-static cd_node_t nil_node;
+/* Slots filtered at once, before their lookups, see cd_queue_range */
+#define CD_QUEUE_RANGE_BATCH 16
+
 static const int kCDNodesInitialSize = 65536;
 static const int kCDEdgesInitialSize = 65536;
+static const int kCDMapsInitialSize = 4096;
+static const int kCDKeyCacheBits = 12;
 
 
 cd_error_t cd_visitor_init(cd_state_t* state) {
@@ -80,29 +144,56 @@ cd_error_t cd_visitor_init(cd_state_t* state) {
   cd_node_t* root;
 
   QUEUE_INIT(&state->nodes.list);
+  QUEUE_INIT(&state->nodes.failed);
 
   state->nodes.id = 0;
+  state->nodes.count = 0;
+  state->edges.list = NULL;
   state->edges.count = 0;
+  state->edges.incoming = NULL;
+  state->edges.incoming_offsets = NULL;
+  state->workers.count = 0;
+  state->workers.list = NULL;
+  state->workers.pending = 0;
 
   /* Init root and insert it */
   root = &state->nodes.root;
   QUEUE_INSERT_TAIL(&state->nodes.list, &root->member);
+  root->obj = NULL;
   root->type = kCDNodeSynthetic;
   root->size = 0;
-  QUEUE_INIT(&root->edges.incoming);
-  QUEUE_INIT(&root->edges.outgoing);
-  root->edges.outgoing_count = 0;
+  root->index = state->nodes.count++;
+  root->edge_count = 0;
+  root->worker = -1;
+  root->failed = 0;
 
   err = cd_strings_copy(&state->strings, NULL, &root->name, "(GC roots)", 10);
   if (!cd_is_ok(err))
     return err;
 
-  if (cd_hashmap_init(&state->nodes.map, kCDNodesInitialSize, 1) != 0)
-    return cd_error_str(kCDErrNoMem, "cd_hashmap_init(nodes.map)");
+  /* Collector and serial traversal use the first one */
+  state->edges.pending = calloc(1, sizeof(*state->edges.pending));
+  if (state->edges.pending == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_edge_list_t");
+  state->edges.pending_count = 1;
+
+  if (cd_ptrmap_init(&state->nodes.map, kCDNodesInitialSize) != 0) {
+    free(state->edges.pending);
+    return cd_error_str(kCDErrNoMem, "cd_ptrmap_init(nodes.map)");
+  }
+
+  if (cd_ptrmap_init(&state->maps, kCDMapsInitialSize) != 0) {
+    cd_ptrmap_destroy(&state->nodes.map);
+    free(state->edges.pending);
+    return cd_error_str(kCDErrNoMem, "cd_ptrmap_init(maps)");
+  }
 
-  if (cd_hashmap_init(&state->edges.map, kCDEdgesInitialSize, 0) != 0) {
-    cd_hashmap_destroy(&state->nodes.map);
-    return cd_error_str(kCDErrNoMem, "cd_hashmap_init(edges.map)");
+  state->keys = calloc(1 << kCDKeyCacheBits, sizeof(*state->keys));
+  if (state->keys == NULL) {
+    cd_ptrmap_destroy(&state->maps);
+    cd_ptrmap_destroy(&state->nodes.map);
+    free(state->edges.pending);
+    return cd_error_str(kCDErrNoMem, "cd_key_cache_t");
   }
 
   return cd_ok();
@@ -110,70 +201,692 @@ cd_error_t cd_visitor_init(cd_state_t* state) {
 
 
 void cd_visitor_destroy(cd_state_t* state) {
-  QUEUE* qn;
+  int i;
+
+  /* Nodes are released with the `state->arena` */
+  QUEUE_INIT(&state->nodes.list);
+  QUEUE_INIT(&state->nodes.failed);
+
+  for (i = 0; i < state->edges.pending_count; i++)
+    free(state->edges.pending[i].list);
+  free(state->edges.pending);
+  state->edges.pending = NULL;
+  state->edges.pending_count = 0;
+
+  free(state->edges.list);
+  free(state->edges.incoming);
+  free(state->edges.incoming_offsets);
+  state->edges.list = NULL;
+  state->edges.incoming = NULL;
+  state->edges.incoming_offsets = NULL;
+  state->edges.count = 0;
+
+  /* Map infos are released with the `state->arena` */
+  cd_ptrmap_destroy(&state->nodes.map);
+  cd_ptrmap_destroy(&state->maps);
+
+  free(state->keys);
+  state->keys = NULL;
+}
+
 
-  /* Free edges first */
-  QUEUE_FOREACH(qn, &state->nodes.list) {
+cd_error_t cd_visit_roots(cd_state_t* state) {
+  cd_error_t err;
+  cd_node_t** nodes;
+  int* offsets;
+
+  if (state->jobs > 1)
+    err = cd_visit_parallel(state);
+  else
+    err = cd_visit_serial(state);
+  if (!cd_is_ok(err))
+    return err;
+
+  /*
+   * Traversal order depends on the scheduling, make the output independent
+   * of it: drop failed nodes, enumerate the rest in BFS order from the root,
+   * and renumber strings by their first use.
+   */
+  if (state->nodes.count <= 0)
+    return cd_error_str(kCDErrNotFound, "cd_visit_roots: no nodes");
+
+  nodes = calloc((size_t) state->nodes.count, sizeof(*nodes));
+  offsets = malloc(sizeof(*offsets) * (state->nodes.count + 1));
+  if (nodes == NULL || offsets == NULL) {
+    err = cd_error_str(kCDErrNoMem, "cd_visit_roots");
+    goto done;
+  }
+
+  cd_visitor_sweep(state, nodes);
+
+  err = cd_visitor_build_edges(state, nodes, offsets);
+  if (!cd_is_ok(err))
+    goto done;
+
+  err = cd_visitor_enumerate(state, nodes, offsets);
+  if (!cd_is_ok(err))
+    goto done;
+
+  err = cd_visitor_sort_edges(state, nodes, offsets);
+  if (!cd_is_ok(err))
+    goto done;
+
+  err = cd_visitor_remap_strings(state);
+
+done:
+  free(nodes);
+  free(offsets);
+  return err;
+}
+
+
+cd_error_t cd_visit_serial(cd_state_t* state) {
+  while (!QUEUE_EMPTY(&state->queue)) {
+    QUEUE* q;
     cd_node_t* node;
 
-    node = container_of(qn, cd_node_t, member);
+    /* Pick first */
+    q = QUEUE_HEAD(&state->queue);
+    QUEUE_REMOVE(q);
 
-    /* Free edges */
-    while (!QUEUE_EMPTY(&node->edges.outgoing)) {
-      QUEUE* qe;
-      cd_edge_t* edge;
+    node = container_of(q, cd_node_t, member);
+    cd_visit_node(state, node, &state->nodes.list, &state->nodes.failed);
+  }
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_visit_parallel(cd_state_t* state) {
+  cd_visitor_worker_t* worker;
+  cd_edge_list_t* pending;
+  int i;
+  int started;
+
+  /* Edges of every worker are kept separately */
+  pending = realloc(state->edges.pending,
+                    sizeof(*pending) * (state->edges.pending_count +
+                                        state->jobs));
+  if (pending == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_edge_list_t");
+  state->edges.pending = pending;
+
+  if (pthread_mutex_init(&state->workers.lock, NULL) != 0)
+    return cd_error_str(kCDErrNoMem, "pthread_mutex_init(workers)");
+  if (pthread_cond_init(&state->workers.cond, NULL) != 0) {
+    pthread_mutex_destroy(&state->workers.lock);
+    return cd_error_str(kCDErrNoMem, "pthread_cond_init(workers)");
+  }
+  state->workers.idle = 0;
+  state->workers.gen = 0;
 
-      qe = QUEUE_HEAD(&node->edges.outgoing);
+  state->workers.list = calloc(state->jobs, sizeof(*state->workers.list));
+  if (state->workers.list == NULL) {
+    cd_visitor_destroy_workers(state, 0);
+    return cd_error_str(kCDErrNoMem, "cd_visitor_worker_t");
+  }
 
-      edge = container_of(qe, cd_edge_t, out);
-      state->edges.count--;
-      QUEUE_REMOVE(&edge->in);
-      QUEUE_REMOVE(&edge->out);
-      free(edge);
+  for (i = 0; i < state->jobs; i++) {
+    worker = &state->workers.list[i];
+
+    worker->state = state;
+    worker->index = i;
+    QUEUE_INIT(&worker->queue);
+    QUEUE_INIT(&worker->nodes);
+    QUEUE_INIT(&worker->failed);
+    worker->edges.list = NULL;
+    worker->edges.count = 0;
+    worker->edges.size = 0;
+    worker->keys = calloc(1 << kCDKeyCacheBits, sizeof(*worker->keys));
+    if (worker->keys == NULL)
+      break;
+    if (pthread_mutex_init(&worker->lock, NULL) != 0) {
+      free(worker->keys);
+      break;
     }
+    cd_arena_init(&worker->arena, state->arena.slab_size);
   }
 
-  /* Free nodes */
-  while (!QUEUE_EMPTY(&state->nodes.list)) {
+  /* Workers that were set up are released, queued roots stay in place */
+  if (i != state->jobs) {
+    cd_visitor_destroy_workers(state, i);
+    return cd_error_str(kCDErrNoMem, "cd_visitor_worker_t");
+  }
+  state->workers.count = i;
+
+  /* Distribute roots between the workers */
+  i = 0;
+  while (!QUEUE_EMPTY(&state->queue)) {
+    QUEUE* q;
+
+    q = QUEUE_HEAD(&state->queue);
+    QUEUE_REMOVE(q);
+
+    worker = &state->workers.list[i];
+    QUEUE_INSERT_TAIL(&worker->queue, q);
+    state->workers.pending++;
+
+    i = (i + 1) % state->workers.count;
+  }
+
+  state->nodes.map.locked = 1;
+  state->maps.locked = 1;
+
+  /*
+   * First worker runs on the current thread, queues of workers that failed
+   * to start are drained by stealing.
+   */
+  for (started = 1; started < state->workers.count; started++) {
+    worker = &state->workers.list[started];
+    if (pthread_create(&worker->thread, NULL, cd_visitor_worker, worker) != 0)
+      break;
+  }
+  cd_visitor_worker(&state->workers.list[0]);
+
+  for (i = 1; i < started; i++)
+    pthread_join(state->workers.list[i].thread, NULL);
+
+  state->nodes.map.locked = 0;
+  state->maps.locked = 0;
+
+  /* Merge results */
+  for (i = 0; i < state->workers.count; i++) {
+    worker = &state->workers.list[i];
+
+    if (!QUEUE_EMPTY(&worker->nodes))
+      QUEUE_ADD(&state->nodes.list, &worker->nodes);
+    if (!QUEUE_EMPTY(&worker->failed))
+      QUEUE_ADD(&state->nodes.failed, &worker->failed);
+    cd_arena_merge(&state->arena, &worker->arena);
+    state->edges.pending[state->edges.pending_count++] = worker->edges;
+  }
+
+  cd_visitor_destroy_workers(state, state->workers.count);
+
+  return cd_ok();
+}
+
+
+void cd_visitor_destroy_workers(cd_state_t* state, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    cd_visitor_worker_t* worker;
+
+    /* Merged arenas are empty */
+    worker = &state->workers.list[i];
+    cd_arena_destroy(&worker->arena);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker->keys);
+  }
+
+  free(state->workers.list);
+  state->workers.list = NULL;
+  state->workers.count = 0;
+  pthread_cond_destroy(&state->workers.cond);
+  pthread_mutex_destroy(&state->workers.lock);
+}
+
+
+void cd_visitor_wakeup(cd_state_t* state) {
+  pthread_mutex_lock(&state->workers.lock);
+  state->workers.gen++;
+  pthread_cond_broadcast(&state->workers.cond);
+  pthread_mutex_unlock(&state->workers.lock);
+}
+
+
+void* cd_visitor_worker(void* arg) {
+  cd_visitor_worker_t* worker;
+  cd_state_t* state;
+  int idle;
+  int gen;
+
+  worker = (cd_visitor_worker_t*) arg;
+  state = worker->state;
+  idle = 0;
+  gen = 0;
+
+  while (__atomic_load_n(&state->workers.pending, __ATOMIC_ACQUIRE) != 0) {
     cd_node_t* node;
 
-    qn = QUEUE_HEAD(&state->nodes.list);
-    QUEUE_REMOVE(qn);
-    node = container_of(qn, cd_node_t, member);
+    /*
+     * Announce the idleness before looking for nodes for the last time, so
+     * that either this worker finds a node queued in the meantime, or the
+     * one queueing it sees `idle` and bumps `gen`.
+     */
+    if (idle) {
+      pthread_mutex_lock(&state->workers.lock);
+      __atomic_add_fetch(&state->workers.idle, 1, __ATOMIC_SEQ_CST);
+      gen = state->workers.gen;
+      pthread_mutex_unlock(&state->workers.lock);
+    }
+
+    /* Pick last from own queue */
+    pthread_mutex_lock(&worker->lock);
+    if (QUEUE_EMPTY(&worker->queue)) {
+      node = NULL;
+    } else {
+      QUEUE* q;
+
+      q = QUEUE_PREV(&worker->queue);
+      QUEUE_REMOVE(q);
+      node = container_of(q, cd_node_t, member);
+    }
+    pthread_mutex_unlock(&worker->lock);
 
-    if (node != &state->nodes.root)
-      free(node);
+    if (node == NULL)
+      node = cd_visitor_steal(state, worker);
+
+    /* Others are still visiting, and may queue more nodes */
+    if (node == NULL && idle) {
+      pthread_mutex_lock(&state->workers.lock);
+      while (gen == state->workers.gen &&
+             __atomic_load_n(&state->workers.pending, __ATOMIC_ACQUIRE) != 0) {
+        pthread_cond_wait(&state->workers.cond, &state->workers.lock);
+      }
+      __atomic_sub_fetch(&state->workers.idle, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&state->workers.lock);
+    }
+    if (idle && node != NULL)
+      __atomic_sub_fetch(&state->workers.idle, 1, __ATOMIC_SEQ_CST);
+    idle = node == NULL;
+    if (node == NULL)
+      continue;
+
+    node->worker = worker->index;
+    cd_visit_node(state, node, &worker->nodes, &worker->failed);
+
+    /* Waiters wake up to exit after the last node */
+    if (__atomic_sub_fetch(&state->workers.pending, 1, __ATOMIC_ACQ_REL) == 0)
+      cd_visitor_wakeup(state);
   }
 
-  cd_hashmap_destroy(&state->nodes.map);
-  cd_hashmap_destroy(&state->edges.map);
+  return NULL;
 }
 
 
-cd_error_t cd_visit_roots(cd_state_t* state) {
+cd_node_t* cd_visitor_steal(cd_state_t* state, cd_visitor_worker_t* worker) {
+  int i;
+
+  for (i = 1; i < state->workers.count; i++) {
+    cd_visitor_worker_t* victim;
+    cd_node_t* node;
+
+    victim = &state->workers.list[(worker->index + i) % state->workers.count];
+
+    /* Pick first, it is likely to have the largest subgraph */
+    node = NULL;
+    pthread_mutex_lock(&victim->lock);
+    if (!QUEUE_EMPTY(&victim->queue)) {
+      QUEUE* q;
+
+      q = QUEUE_HEAD(&victim->queue);
+      QUEUE_REMOVE(q);
+      node = container_of(q, cd_node_t, member);
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (node != NULL)
+      return node;
+  }
+
+  return NULL;
+}
+
+
+void cd_visit_node(cd_state_t* state,
+                   cd_node_t* node,
+                   QUEUE* nodes,
+                   QUEUE* failed) {
+  /* Failed nodes are freed after the traversal, edges to them are dropped */
+  if (cd_is_ok(cd_visit_root(state, node))) {
+    QUEUE_INSERT_TAIL(nodes, &node->member);
+  } else {
+    __atomic_store_n(&node->failed, 1, __ATOMIC_RELAXED);
+    QUEUE_INSERT_TAIL(failed, &node->member);
+  }
+}
+
+
+void cd_visitor_sweep(cd_state_t* state, cd_node_t** nodes) {
   QUEUE* q;
-  while (!QUEUE_EMPTY(&state->queue) != 0) {
+
+  /* Index nodes, failed ones stay NULL */
+  QUEUE_FOREACH(q, &state->nodes.list) {
     cd_node_t* node;
 
-    /* Pick first */
-    q = QUEUE_NEXT(&state->queue);
-    QUEUE_REMOVE(q);
+    node = container_of(q, cd_node_t, member);
+    nodes[node->index] = node;
+  }
+
+  /* Failed nodes stay in the arena, nothing references them anymore */
+  QUEUE_INIT(&state->nodes.failed);
+}
+
+
+cd_error_t cd_visitor_build_edges(cd_state_t* state,
+                                  cd_node_t** nodes,
+                                  int* offsets) {
+  cd_edge_t* list;
+  int* first;
+  int count;
+  int i;
+  int j;
+  int k;
+
+  /* Count edges between live nodes */
+  for (i = 0; i <= state->nodes.count; i++)
+    offsets[i] = 0;
+
+  count = 0;
+  for (i = 0; i < state->edges.pending_count; i++) {
+    cd_edge_list_t* pending;
+
+    pending = &state->edges.pending[i];
+    for (j = 0; j < pending->count; j++) {
+      cd_edge_t* edge;
+
+      edge = &pending->list[j];
+      if (nodes[edge->from] == NULL || nodes[edge->to] == NULL)
+        continue;
+
+      offsets[edge->from + 1]++;
+      count++;
+    }
+  }
+
+  for (i = 0; i < state->nodes.count; i++)
+    offsets[i + 1] += offsets[i];
+
+  list = malloc(sizeof(*list) * (count == 0 ? 1 : count));
+  if (list == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_edge_t list");
+
+  /*
+   * Place edges by `from`, keeping the order of insertion: edges of any node
+   * are appended by a single thread, and the collector's precede the worker's.
+   */
+  for (i = 0; i < state->edges.pending_count; i++) {
+    cd_edge_list_t* pending;
+
+    pending = &state->edges.pending[i];
+    for (j = 0; j < pending->count; j++) {
+      cd_edge_t* edge;
+
+      edge = &pending->list[j];
+      if (nodes[edge->from] == NULL || nodes[edge->to] == NULL)
+        continue;
+
+      list[offsets[edge->from]++] = *edge;
+    }
+
+    free(pending->list);
+    pending->list = NULL;
+    pending->count = 0;
+    pending->size = 0;
+  }
+
+  /* `offsets[i]` is now the end of the i-th node's edges */
+  for (i = state->nodes.count; i > 0; i--)
+    offsets[i] = offsets[i - 1];
+  offsets[0] = 0;
+
+  first = calloc((size_t) state->nodes.count, sizeof(*first));
+  if (first == NULL) {
+    free(list);
+    return cd_error_str(kCDErrNoMem, "cd_edge_t first");
+  }
+  for (i = 0; i < state->nodes.count; i++)
+    first[i] = -1;
+
+  /*
+   * Remove duplicate edges, the first one stays in place and takes the name
+   * and the type of the tagged duplicates.
+   */
+  for (i = 0, k = 0; i < state->nodes.count; i++) {
+    int start;
+    int end;
+
+    start = offsets[i];
+    end = offsets[i + 1];
+    offsets[i] = k;
+
+    for (j = start; j < end; j++) {
+      cd_edge_t* edge;
+
+      edge = &list[j];
+      if (first[edge->to] < offsets[i]) {
+        first[edge->to] = k;
+        list[k++] = *edge;
+      } else if (edge->tag) {
+        list[first[edge->to]].type = edge->type;
+        list[first[edge->to]].name = edge->name;
+      }
+    }
+
+    if (nodes[i] != NULL)
+      nodes[i]->edge_count = k - offsets[i];
+  }
+  offsets[state->nodes.count] = k;
+  free(first);
+
+  state->edges.list = list;
+  state->edges.count = k;
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_visitor_enumerate(cd_state_t* state,
+                                cd_node_t** nodes,
+                                int* offsets) {
+  QUEUE* q;
+  cd_node_t** rest;
+  int* order;
+  int count;
+  int i;
+
+  order = malloc(sizeof(*order) * state->nodes.count);
+  if (order == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_node_t order");
+
+  QUEUE_FOREACH(q, &state->nodes.list) {
+    cd_node_t* node;
 
     node = container_of(q, cd_node_t, member);
+    node->id = -1;
+  }
+
+  state->nodes.id = 0;
+  cd_visitor_enumerate_from(state, nodes, offsets, order, &state->nodes.root);
+
+  /* Nodes unreachable from the root, ordered by address */
+  count = 0;
+  QUEUE_FOREACH(q, &state->nodes.list)
+    if (container_of(q, cd_node_t, member)->id == -1)
+      count++;
+
+  if (count != 0) {
+    rest = malloc(sizeof(*rest) * count);
+    if (rest == NULL) {
+      free(order);
+      return cd_error_str(kCDErrNoMem, "cd_node_t rest");
+    }
+
+    i = 0;
+    QUEUE_FOREACH(q, &state->nodes.list)
+      if (container_of(q, cd_node_t, member)->id == -1)
+        rest[i++] = container_of(q, cd_node_t, member);
+    qsort(rest,
+          count,
+          sizeof(*rest),
+          (int (*)(const void*, const void*)) cd_node_sort);
+
+    for (i = 0; i < count; i++)
+      if (rest[i]->id == -1)
+        cd_visitor_enumerate_from(state, nodes, offsets, order, rest[i]);
+    free(rest);
+  }
 
-    /* Node will be readded to `nodes` in case of success */
-    if (!cd_is_ok(cd_visit_root(state, node)))
-      cd_node_free(state, node);
+  /* Relink nodes in the order of ids */
+  QUEUE_INIT(&state->nodes.list);
+  for (i = 0; i < state->nodes.id; i++)
+    QUEUE_INSERT_TAIL(&state->nodes.list, &nodes[order[i]]->member);
+  free(order);
+
+  return cd_ok();
+}
+
+
+void cd_visitor_enumerate_from(cd_state_t* state,
+                               cd_node_t** nodes,
+                               int* offsets,
+                               int* order,
+                               cd_node_t* node) {
+  int i;
+
+  i = state->nodes.id;
+  node->id = state->nodes.id++;
+  order[node->id] = node->index;
+
+  /* BFS, `order` is the queue */
+  for (; i < state->nodes.id; i++) {
+    int j;
+
+    for (j = offsets[order[i]]; j < offsets[order[i] + 1]; j++) {
+      cd_node_t* to;
+
+      to = nodes[state->edges.list[j].to];
+      if (to->id != -1)
+        continue;
+
+      to->id = state->nodes.id++;
+      order[to->id] = to->index;
+    }
   }
+}
+
+
+cd_error_t cd_visitor_sort_edges(cd_state_t* state,
+                                 cd_node_t** nodes,
+                                 int* offsets) {
+  QUEUE* q;
+  cd_edge_t* list;
+  int k;
+
+  list = malloc(sizeof(*list) * (state->edges.count == 0 ? 1 :
+                                 state->edges.count));
+  if (list == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_edge_t list");
+
+  /* Lay out edges in the order of the output, referencing nodes by ids */
+  k = 0;
+  QUEUE_FOREACH(q, &state->nodes.list) {
+    cd_node_t* node;
+    int j;
+
+    node = container_of(q, cd_node_t, member);
+    for (j = offsets[node->index]; j < offsets[node->index + 1]; j++) {
+      list[k] = state->edges.list[j];
+      list[k].from = node->id;
+      list[k].to = nodes[list[k].to]->id;
+      k++;
+    }
+  }
+
+  free(state->edges.list);
+  state->edges.list = list;
+
+  return cd_ok();
+}
 
-  /* Enumerate nodes */
+
+cd_error_t cd_visitor_remap_strings(cd_state_t* state) {
+  cd_error_t err;
+  QUEUE* q;
+  int* map;
+  int count;
+  int i;
+
+  map = malloc(sizeof(*map) * state->strings.count);
+  if (map == NULL)
+    return cd_error_str(kCDErrNoMem, "strings map");
+
+  for (i = 0; i < state->strings.count; i++)
+    map[i] = -1;
+
+  /* Number strings in the order of the output, drop the unused ones */
+  count = 0;
   QUEUE_FOREACH(q, &state->nodes.list) {
     cd_node_t* node;
 
     node = container_of(q, cd_node_t, member);
-    node->id = state->nodes.id++;
+    node->name = cd_visitor_remap(map, &count, node->name);
+  }
+
+  for (i = 0; i < state->edges.count; i++) {
+    cd_edge_t* edge;
+
+    /* Element's name is an index */
+    edge = &state->edges.list[i];
+    if (edge->type == kCDEdgeElement)
+      continue;
+
+    edge->name = cd_visitor_remap(map, &count, edge->name);
+  }
+
+  err = cd_strings_reorder(&state->strings, map, count);
+  free(map);
+
+  return err;
+}
+
+
+int cd_visitor_remap(int* map, int* count, int index) {
+  if (map[index] == -1)
+    map[index] = (*count)++;
+  return map[index];
+}
+
+
+int cd_node_sort(const cd_node_t** a, const cd_node_t** b) {
+  return (*a)->obj > (*b)->obj ? 1 : (*a)->obj == (*b)->obj ? 0 : -1;
+}
+
+
+cd_error_t cd_visitor_incoming(cd_state_t* state) {
+  int* offsets;
+  int* incoming;
+  int i;
+
+  if (state->edges.incoming != NULL)
+    return cd_ok();
+
+  offsets = calloc((size_t) state->nodes.id + 1, sizeof(*offsets));
+  incoming = malloc(sizeof(*incoming) * (state->edges.count == 0 ? 1 :
+                                         state->edges.count));
+  if (offsets == NULL || incoming == NULL) {
+    free(offsets);
+    free(incoming);
+    return cd_error_str(kCDErrNoMem, "cd_visitor_incoming");
   }
 
+  for (i = 0; i < state->edges.count; i++)
+    offsets[state->edges.list[i].to + 1]++;
+  for (i = 0; i < state->nodes.id; i++)
+    offsets[i + 1] += offsets[i];
+
+  /* Edges are sorted by `from`, and so are the incoming lists */
+  for (i = 0; i < state->edges.count; i++)
+    incoming[offsets[state->edges.list[i].to]++] = i;
+  for (i = state->nodes.id; i > 0; i--)
+    offsets[i] = offsets[i - 1];
+  offsets[0] = 0;
+
+  state->edges.incoming = incoming;
+  state->edges.incoming_offsets = offsets;
+
   return cd_ok();
 }
 
@@ -184,12 +897,13 @@ cd_error_t cd_visit_roots(cd_state_t* state) {
 cd_error_t cd_visit_root(cd_state_t* state, cd_node_t* node) {
   cd_error_t err;
   char* start;
-  char* end;
+  int body_start;
+  int body_end;
   int type;
 
   type = node->v8_type;
 
-  /* Add node to the nodes list as early as possible */
+  /* Fill node's type and name */
   err = cd_add_node(state, node);
   if (!cd_is_ok(err))
     return err;
@@ -200,11 +914,13 @@ cd_error_t cd_visit_root(cd_state_t* state, cd_node_t* node) {
   if (type < cd_v8_FirstNonstringType)
     return cd_ok();
 
-  start = NULL;
-  end = NULL;
+  err = cd_v8_get_obj_body(state, type, node->size, &body_start, &body_end);
+  if (!cd_is_ok(err))
+    return err;
 
-  V8_CORE_PTR(node->obj, 0, start);
-  V8_CORE_PTR(node->obj, node->size, end);
+  start = NULL;
+  if (body_start != body_end)
+    V8_CORE_DATA(node->obj, body_start, start, body_end - body_start);
 
   /* Tag map */
   cd_tag(state, node, node->map, NULL, kCDEdgeInternal, "(map)", 5);
@@ -227,9 +943,14 @@ cd_error_t cd_visit_root(cd_state_t* state, cd_node_t* node) {
   /* Tag function script info properties */
   cd_tag_script_props(state, node);
 
-  /* Queue all pointers */
-  if (start != NULL && end != NULL)
-    cd_queue_range(state, node, start, end);
+  /* Queue all tagged slots, named by their index in the object */
+  if (start != NULL) {
+    cd_queue_range(state,
+                   node,
+                   start,
+                   start + (body_end - body_start),
+                   body_start / state->ptr_size);
+  }
 
   return cd_ok();
 }
@@ -237,8 +958,8 @@ cd_error_t cd_visit_root(cd_state_t* state, cd_node_t* node) {
 
 cd_error_t cd_tag_obj_props(cd_state_t* state, cd_node_t* node) {
   cd_error_t err;
+  cd_map_info_t* info;
   int type;
-  int fast;
   void** ptr;
   void* props;
   int size;
@@ -255,13 +976,27 @@ cd_error_t cd_tag_obj_props(cd_state_t* state, cd_node_t* node) {
     return cd_ok();
   }
 
+  info = node->info;
+  if (!cd_is_ok(info->layout_err))
+    return info->layout_err;
+
   /* Tag prototype */
-  V8_CORE_PTR(node->map, cd_v8_class_Map__prototype__Object, ptr);
-  cd_tag(state, node, *ptr, NULL, kCDEdgeProperty, "(prototype)", 11);
+  cd_tag(state,
+         node,
+         info->prototype,
+         NULL,
+         kCDEdgeProperty,
+         "(prototype)",
+         11);
 
   /* Tag constructor */
-  V8_CORE_PTR(node->map, cd_v8_class_Map__constructor__Object, ptr);
-  cd_tag(state, node, *ptr, NULL, kCDEdgeProperty, "(constructor)", 13);
+  cd_tag(state,
+         node,
+         info->constructor,
+         NULL,
+         kCDEdgeProperty,
+         "(constructor)",
+         13);
 
   /* Tag fast or slow properties */
   V8_CORE_PTR(node->obj, cd_v8_class_JSObject__properties__FixedArray, ptr);
@@ -269,15 +1004,11 @@ cd_error_t cd_tag_obj_props(cd_state_t* state, cd_node_t* node) {
   cd_name(state, node, *ptr, NULL, kCDEdgeHidden, 0, "(properties)", 12);
   props = *(char**) ptr;
 
-  err = cd_v8_obj_has_fast_props(state, node->obj, node->map, &fast);
-  if (!cd_is_ok(err))
-    return err;
-
   err = cd_v8_get_fixed_arr_data(state, props, &props, &size);
   if (!cd_is_ok(err))
     return err;
 
-  if (fast)
+  if (info->fast_props)
     return cd_tag_obj_fast_props(state, node, props, size);
   else
     return cd_tag_obj_slow_props(state, node, props, size);
@@ -289,58 +1020,32 @@ cd_error_t cd_tag_obj_fast_props(cd_state_t* state,
                                  char* props,
                                  int size) {
   cd_error_t err;
+  cd_map_fields_t* fields;
   void** ptr;
-  void* desc_array;
-  void* desc_data;
-  int desc_size;
-  int off;
-  int inobj;
-
-  V8_CORE_PTR(node->map,
-              cd_v8_class_Map__instance_descriptors__DescriptorArray,
-              ptr);
-  desc_array = *ptr;
+  int i;
 
-  err = cd_v8_get_fixed_arr_data(state, desc_array, &desc_data, &desc_size);
+  fields = NULL;
+  err = cd_map_info_fields(state,
+                           cd_visitor_arena(state, node),
+                           node->map,
+                           node->info,
+                           &fields);
   if (!cd_is_ok(err))
     return err;
 
-  off = cd_v8_prop_idx_first;
-  if ((desc_size - off) % cd_v8_prop_desc_size != 0)
-    return cd_error(kCDErrNotSoSlow);
-
-  V8_CORE_PTR(node->map, cd_v8_class_Map__inobject_properties__int, ptr);
-  inobj = *(int8_t*) ptr;
-
-  for (; off < desc_size; off += cd_v8_prop_desc_size) {
-    char* i;
-    void* key;
+  for (i = 0; i < fields->count; i++) {
+    cd_map_field_t* field;
     void* val;
-    int det;
-    int idx;
-    int type;
 
-    i = (char*) desc_data + off * state->ptr_size;
-    det = V8_SMI(*(void**)(i + cd_v8_prop_desc_details * state->ptr_size));
-
-    type = det & cd_v8_prop_type_mask;
-    idx = (det & cd_v8_prop_index_mask) >> cd_v8_prop_index_shift;
-
-    if (type != cd_v8_prop_type_field)
-      continue;
-
-    key = *(void**)(i + cd_v8_prop_desc_key * state->ptr_size);
-    if (idx < inobj) {
-      int inobj_off;
-
-      inobj_off = node->size + (idx - inobj) * state->ptr_size;
-      V8_CORE_PTR(node->obj, inobj_off, ptr)
-      val = *ptr;
+    field = &fields->list[i];
+    if (field->off == -1) {
+      val = field->value;
     } else {
-      val = *(void**)(i + cd_v8_prop_desc_value * state->ptr_size);
+      V8_CORE_PTR(node->obj, node->size + field->off, ptr)
+      val = *ptr;
     }
 
-    cd_tag_obj_property(state, node, key, val);
+    cd_tag_obj_property(state, node, field->key, val);
   }
 
   return cd_ok();
@@ -457,8 +1162,8 @@ cd_error_t cd_tag_script_props(cd_state_t* state, cd_node_t* node) {
 
 cd_error_t cd_tag_obj_elems(cd_state_t* state, cd_node_t* node) {
   cd_error_t err;
+  cd_map_info_t* info;
   int type;
-  int fast;
   void** ptr;
   void* elems;
   int size;
@@ -475,20 +1180,23 @@ cd_error_t cd_tag_obj_elems(cd_state_t* state, cd_node_t* node) {
     return cd_ok();
   }
 
+  info = node->info;
+  if (!cd_is_ok(info->layout_err))
+    return info->layout_err;
+
   /* Tag fast or slow properties */
   V8_CORE_PTR(node->obj, cd_v8_class_JSObject__elements__Object, ptr);
   cd_tag(state, node, *ptr, NULL, kCDEdgeHidden, "(elements)", 10);
   elems = *(char**) ptr;
 
-  err = cd_v8_obj_has_fast_elems(state, node->obj, node->map, &fast);
-  if (!cd_is_ok(err))
-    return err;
+  if (!cd_is_ok(info->elems_err))
+    return info->elems_err;
 
   err = cd_v8_get_fixed_arr_data(state, elems, &elems, &size);
   if (!cd_is_ok(err))
     return err;
 
-  if (fast)
+  if (info->fast_elems)
     return cd_tag_obj_fast_elems(state, node, elems, size);
   else
     return cd_tag_obj_slow_elems(state, node, elems, size);
@@ -553,6 +1261,7 @@ cd_error_t cd_tag_obj_property(cd_state_t* state,
                                void* key,
                                void* val) {
   cd_error_t err;
+  cd_key_cache_t* cache;
   int key_type;
   int key_name;
 
@@ -567,17 +1276,28 @@ cd_error_t cd_tag_obj_property(cd_state_t* state,
                         NULL);
   }
 
-  err = cd_v8_get_obj_type(state, key, NULL, &key_type);
-  if (!cd_is_ok(err))
-    return err;
+  cache = cd_visitor_key(state, node, key);
+  if (cache->key != key) {
+    err = cd_v8_get_obj_type(state, key, NULL, &key_type);
+    if (!cd_is_ok(err))
+      return err;
 
-  /* Skip non-string object keys */
-  if (key_type >= cd_v8_FirstNonstringType)
-    return cd_ok();
+    /* Skip non-string object keys */
+    if (key_type >= cd_v8_FirstNonstringType) {
+      key_name = -1;
+    } else {
+      err = cd_v8_to_cstr(state, key, NULL, NULL, &key_name);
+      if (!cd_is_ok(err))
+        return err;
+    }
 
-  err = cd_v8_to_cstr(state, key, NULL, NULL, &key_name);
-  if (!cd_is_ok(err))
-    return err;
+    cache->key = key;
+    cache->name = key_name;
+  }
+
+  key_name = cache->name;
+  if (key_name == -1)
+    return cd_ok();
 
   return cd_queue_ptr(state,
                       node,
@@ -600,12 +1320,20 @@ cd_error_t cd_name(cd_state_t* state,
                    int tag_len) {
   cd_error_t err;
   cd_node_t* to;
+  int index;
 
   err = cd_queue_ptr(state, node, ptr, map, type, name, 1, &to);
   if (!cd_is_ok(err))
     return err;
 
-  return cd_strings_copy(&state->strings, NULL, &to->name, tag, tag_len);
+  err = cd_strings_copy(&state->strings, NULL, &index, tag, tag_len);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* `to` may be visited concurrently, its own name never wins over this */
+  __atomic_store_n(&to->name, index, __ATOMIC_RELAXED);
+
+  return cd_ok();
 }
 
 
@@ -628,10 +1356,12 @@ cd_error_t cd_tag(cd_state_t* state,
 
 
 cd_error_t cd_node_init(cd_state_t* state,
+                        cd_arena_t* arena,
                         cd_node_t* node,
                         void* ptr,
                         void* map) {
   cd_error_t err;
+  cd_map_info_t* info;
 
   /* Load map, if not provided */
   if (map == NULL) {
@@ -639,58 +1369,285 @@ cd_error_t cd_node_init(cd_state_t* state,
 
     V8_CORE_PTR(ptr, cd_v8_class_HeapObject__map__Map, pmap);
     map = *pmap;
-
-    if (!V8_IS_HEAPOBJECT(map))
-      return cd_error(kCDErrNotObject);
   }
 
   /* Load object type and size */
-  err = cd_v8_get_obj_type(state, ptr, map, &node->v8_type);
+  err = cd_map_info_get(state, arena, map, &info);
   if (!cd_is_ok(err))
     return err;
 
-  err = cd_v8_get_obj_size(state, ptr, map, node->v8_type, &node->size);
-  if (!cd_is_ok(err))
-    return err;
+  node->v8_type = info->v8_type;
+  if (info->size != 0) {
+    node->size = info->size;
+  } else {
+    err = cd_v8_get_obj_size(state, ptr, map, node->v8_type, &node->size);
+    if (!cd_is_ok(err))
+      return err;
+  }
 
   node->obj = ptr;
   node->map = map;
+  node->info = info;
   node->name = 0;
+  node->index = -1;
+  node->edge_count = 0;
+  node->worker = -1;
+  node->failed = 0;
 
   QUEUE_INIT(&node->member);
-  QUEUE_INIT(&node->edges.incoming);
-  QUEUE_INIT(&node->edges.outgoing);
-  node->edges.outgoing_count = 0;
 
   return cd_ok();
 }
 
 
-void cd_node_free(cd_state_t* state, cd_node_t* node) {
-  /* Dealloc all incoming edges */
-  while (!QUEUE_EMPTY(&node->edges.incoming)) {
-    QUEUE* q;
-    cd_edge_t* edge;
+cd_arena_t* cd_visitor_arena(cd_state_t* state, cd_node_t* node) {
+  /* Worker visiting `node` is the current thread */
+  if (node == NULL || node->worker == -1)
+    return &state->arena;
+  return &state->workers.list[node->worker].arena;
+}
 
-    q = QUEUE_HEAD(&node->edges.incoming);
 
-    edge = container_of(q, cd_edge_t, in);
-    QUEUE_REMOVE(&edge->in);
-    QUEUE_REMOVE(&edge->out);
+cd_key_cache_t* cd_visitor_key(cd_state_t* state,
+                               cd_node_t* node,
+                               void* key) {
+  cd_key_cache_t* keys;
+  uint64_t hash;
 
-    edge->key.from->edges.outgoing_count--;
-    cd_hashmap_delete(&state->edges.map,
-                      (const char*) &edge->key,
-                      sizeof(edge->key));
-    free(edge);
+  if (node == NULL || node->worker == -1)
+    keys = state->keys;
+  else
+    keys = state->workers.list[node->worker].keys;
+
+  hash = (uint64_t) (intptr_t) key * 0x9e3779b97f4a7c15ULL;
+  return &keys[hash >> (64 - kCDKeyCacheBits)];
+}
+
+
+cd_error_t cd_map_info_get(cd_state_t* state,
+                           cd_arena_t* arena,
+                           void* map,
+                           cd_map_info_t** res) {
+  cd_error_t err;
+  cd_ptrmap_shard_t* shard;
+  cd_map_info_t* info;
+  cd_map_info_t tmp;
+  int r;
+
+  if (!V8_IS_HEAPOBJECT(map))
+    return cd_error(kCDErrNotObject);
+
+  shard = cd_ptrmap_acquire(&state->maps, (intptr_t) map);
+  info = cd_ptrmap_get(shard, (intptr_t) map);
+  cd_ptrmap_release(&state->maps, shard);
+  if (info != NULL) {
+    *res = info;
+    return cd_ok();
   }
-  QUEUE_REMOVE(&node->member);
 
-  cd_hashmap_insert(&state->nodes.map,
-                    (const char*) node->obj,
-                    sizeof(node->obj),
-                    &nil_node);
-  free(node);
+  /* Failures are not cached, there is no Map at `map` */
+  err = cd_map_info_load(state, map, &tmp);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* Another worker might have inserted it in the meantime */
+  shard = cd_ptrmap_acquire(&state->maps, (intptr_t) map);
+  info = cd_ptrmap_get(shard, (intptr_t) map);
+  r = 0;
+  if (info == NULL) {
+    info = cd_arena_alloc(arena, sizeof(*info));
+    if (info != NULL) {
+      *info = tmp;
+      r = cd_ptrmap_insert(shard, (intptr_t) map, info);
+    }
+  }
+  cd_ptrmap_release(&state->maps, shard);
+
+  if (info == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_map_info_t");
+  if (r != 0)
+    return cd_error_str(kCDErrNoMem, "cd_ptrmap_insert(maps)");
+
+  *res = info;
+  return cd_ok();
+}
+
+
+cd_error_t cd_map_info_load(cd_state_t* state,
+                            void* map,
+                            cd_map_info_t* info) {
+  void** ptr;
+
+  V8_CORE_PTR(map, cd_v8_class_Map__instance_attributes__int, ptr);
+  info->v8_type = *(uint8_t*) ptr;
+
+  V8_CORE_PTR(map, cd_v8_class_Map__instance_size__int, ptr);
+  info->size = *(uint8_t*) ptr * state->ptr_size;
+
+  info->name = -1;
+  info->fields = NULL;
+
+  /* Only objects need the rest, their tagging fails if it is not there */
+  info->layout_err = cd_map_info_layout(state, map, info);
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_map_info_layout(cd_state_t* state,
+                              void* map,
+                              cd_map_info_t* info) {
+  cd_error_t err;
+  void** ptr;
+
+  V8_CORE_PTR(map, cd_v8_class_Map__prototype__Object, ptr);
+  info->prototype = *ptr;
+  V8_CORE_PTR(map, cd_v8_class_Map__constructor__Object, ptr);
+  info->constructor = *ptr;
+  V8_CORE_PTR(map, cd_v8_class_Map__inobject_properties__int, ptr);
+  info->inobj = *(int8_t*) ptr;
+
+  err = cd_v8_obj_has_fast_props(state, NULL, map, &info->fast_props);
+  if (!cd_is_ok(err))
+    return err;
+
+  info->elems_err = cd_v8_obj_has_fast_elems(state,
+                                             NULL,
+                                             map,
+                                             &info->fast_elems);
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_map_info_name(cd_state_t* state,
+                            cd_map_info_t* info,
+                            int* res) {
+  cd_error_t err;
+  int ctype;
+  int name;
+
+  name = __atomic_load_n(&info->name, __ATOMIC_RELAXED);
+  if (name != -1) {
+    *res = name;
+    return cd_ok();
+  }
+
+  if (!cd_is_ok(info->layout_err))
+    return info->layout_err;
+
+  err = cd_v8_get_obj_type(state, info->constructor, NULL, &ctype);
+  if (!cd_is_ok(err))
+    return err;
+
+  if (ctype == T(JSFunction, JS_FUNCTION))
+    err = cd_v8_fn_info(state, info->constructor, NULL, NULL, &name, NULL);
+  else
+    err = cd_strings_copy(&state->strings, NULL, &name, "Object", 6);
+  if (!cd_is_ok(err))
+    return err;
+
+  /* Racing workers intern the same string, and store the same index */
+  __atomic_store_n(&info->name, name, __ATOMIC_RELAXED);
+  *res = name;
+
+  return cd_ok();
+}
+
+
+cd_error_t cd_map_info_fields(cd_state_t* state,
+                              cd_arena_t* arena,
+                              void* map,
+                              cd_map_info_t* info,
+                              cd_map_fields_t** res) {
+  cd_error_t err;
+  cd_map_fields_t* fields;
+  void** ptr;
+  void* desc_data;
+  int desc_size;
+  int count;
+  int off;
+
+  fields = __atomic_load_n(&info->fields, __ATOMIC_ACQUIRE);
+  if (fields != NULL) {
+    *res = fields;
+    return cd_ok();
+  }
+
+  V8_CORE_PTR(map,
+              cd_v8_class_Map__instance_descriptors__DescriptorArray,
+              ptr);
+
+  err = cd_v8_get_fixed_arr_data(state, *ptr, &desc_data, &desc_size);
+  if (!cd_is_ok(err))
+    return err;
+
+  off = cd_v8_prop_idx_first;
+  if ((desc_size - off) % cd_v8_prop_desc_size != 0)
+    return cd_error(kCDErrNotSoSlow);
+
+  fields = cd_arena_alloc(arena,
+                          sizeof(*fields) +
+                              (desc_size - off) / cd_v8_prop_desc_size *
+                              sizeof(*fields->list));
+  if (fields == NULL)
+    return cd_error_str(kCDErrNoMem, "cd_map_fields_t");
+
+  for (count = 0; off < desc_size; off += cd_v8_prop_desc_size) {
+    cd_map_field_t* field;
+    char* i;
+    int det;
+    int idx;
+
+    i = (char*) desc_data + off * state->ptr_size;
+    det = V8_SMI(*(void**)(i + cd_v8_prop_desc_details * state->ptr_size));
+    if ((det & cd_v8_prop_type_mask) != cd_v8_prop_type_field)
+      continue;
+
+    idx = (det & cd_v8_prop_index_mask) >> cd_v8_prop_index_shift;
+
+    /* In-object fields are at the end of the object */
+    field = &fields->list[count++];
+    field->key = *(void**)(i + cd_v8_prop_desc_key * state->ptr_size);
+    if (idx < info->inobj) {
+      field->off = (idx - info->inobj) * state->ptr_size;
+      field->value = NULL;
+    } else {
+      field->off = -1;
+      field->value = *(void**)(i + cd_v8_prop_desc_value * state->ptr_size);
+    }
+  }
+  fields->count = count;
+
+  /* Racing workers build the same list, either one is fine */
+  __atomic_store_n(&info->fields, fields, __ATOMIC_RELEASE);
+  *res = fields;
+
+  return cd_ok();
+}
+
+
+void cd_node_push(cd_state_t* state, cd_node_t* from, cd_node_t* node) {
+  cd_visitor_worker_t* worker;
+
+  if (from == NULL || from->worker == -1) {
+    QUEUE_INSERT_TAIL(&state->queue, &node->member);
+    return;
+  }
+
+  /* Queue to the worker that is visiting `from` */
+  worker = &state->workers.list[from->worker];
+  node->worker = from->worker;
+  __atomic_add_fetch(&state->workers.pending, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&worker->lock);
+  QUEUE_INSERT_TAIL(&worker->queue, &node->member);
+  pthread_mutex_unlock(&worker->lock);
+
+  /* Pairs with the announcement in cd_visitor_worker() */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&state->workers.idle, __ATOMIC_RELAXED) != 0)
+    cd_visitor_wakeup(state);
 }
 
 
@@ -703,116 +1660,160 @@ cd_error_t cd_queue_ptr(cd_state_t* state,
                         int tag,
                         cd_node_t** out) {
   cd_error_t err;
+  cd_ptrmap_shard_t* shard;
   cd_node_t* node;
-  cd_edge_t* edge;
-  cd_edge_t* old_edge;
-  int existing;
+  cd_node_t tmp;
+  cd_arena_t* arena;
+  cd_edge_list_t* edges;
+  int created;
+  int r;
 
   if (!V8_IS_HEAPOBJECT(ptr))
     return cd_error(kCDErrNotObject);
 
-  node = cd_hashmap_get(&state->nodes.map, (const char*) ptr, sizeof(ptr));
-  if (node == &nil_node)
-    return cd_ok();
+  /* Stray words mostly point outside of the core, skip the lookups */
+  if (!CD_OBJ_MAY_HAVE(state->core, (intptr_t) V8_OBJ(ptr)))
+    return cd_error(kCDErrNotFound);
 
-  if (node == NULL) {
-    node = malloc(sizeof(*node));
-    if (node == NULL)
-      return cd_error_str(kCDErrNoMem, "cd_node_t");
-    existing = 0;
+  /* Worker visiting `from` is the current thread */
+  if (from == NULL || from->worker == -1) {
+    arena = &state->arena;
+    edges = &state->edges.pending[0];
   } else {
-    existing = 1;
+    arena = &state->workers.list[from->worker].arena;
+    edges = &state->workers.list[from->worker].edges;
   }
 
-  if (from != NULL) {
-    edge = malloc(sizeof(*edge));
-    if (edge == NULL) {
-      err = cd_error_str(kCDErrNoMem, "cd_edge_t");
-      goto fatal;
-    }
-  } else {
-    edge = NULL;
-  }
+  shard = cd_ptrmap_acquire(&state->nodes.map, (intptr_t) ptr);
+  node = cd_ptrmap_get(shard, (intptr_t) ptr);
+  cd_ptrmap_release(&state->nodes.map, shard);
 
   /* Initialize and queue node if just created */
-  if (!existing) {
-    err = cd_node_init(state, node, ptr, map);
+  if (node == NULL) {
+    /* Most of the pointers are not objects, do not waste arena on them */
+    err = cd_node_init(state, arena, &tmp, ptr, map);
     if (!cd_is_ok(err))
-      goto fatal;
+      return err;
 
-    QUEUE_INSERT_TAIL(&state->queue, &node->member);
-  }
+    /* Another worker might have inserted it in the meantime */
+    shard = cd_ptrmap_acquire(&state->nodes.map, (intptr_t) ptr);
+    node = cd_ptrmap_get(shard, (intptr_t) ptr);
+    created = node == NULL;
+    r = 0;
+    if (created) {
+      node = cd_arena_alloc(arena, sizeof(*node));
+      if (node != NULL) {
+        *node = tmp;
+        QUEUE_INIT(&node->member);
+        node->index = __atomic_fetch_add(&state->nodes.count,
+                                         1,
+                                         __ATOMIC_RELAXED);
+        r = cd_ptrmap_insert(shard, (intptr_t) ptr, node);
+      }
+    }
+    cd_ptrmap_release(&state->nodes.map, shard);
 
-  /* Fill the edge */
-  if (edge == NULL)
-    goto done;
+    if (node == NULL)
+      return cd_error_str(kCDErrNoMem, "cd_node_t");
+    if (r != 0)
+      return cd_error_str(kCDErrNoMem, "cd_ptrmap_insert(nodes.map)");
 
-  edge->key.from = from;
-  edge->key.to = node;
+    if (created)
+      cd_node_push(state, from, node);
+  }
 
-  edge->type = type;
-  edge->name = name;
+  if (out != NULL)
+    *out = node;
 
-  /* Existing edge found */
-  old_edge = cd_hashmap_get(&state->edges.map,
-                            (const char*) &edge->key,
-                            sizeof(edge->key));
-  if (old_edge != NULL) {
-    if (tag) {
-      old_edge->type = type;
-      old_edge->name = name;
-    }
-    free(edge);
-    goto done;
-  }
+  /* Failed to visit, the edge would be dropped anyway */
+  if (__atomic_load_n(&node->failed, __ATOMIC_RELAXED))
+    return cd_ok();
 
-  if (cd_hashmap_insert(&state->edges.map,
-                        (const char*) &edge->key,
-                        sizeof(edge->key),
-                        edge) != 0) {
-    err = cd_error_str(kCDErrNoMem, "cd_edge_t hashmap insert");
-    goto fatal;
-  }
+  if (from == NULL)
+    return cd_ok();
 
-  from->edges.outgoing_count++;
+  /* Duplicates are removed by cd_visit_roots() */
+  if (cd_edge_list_push(edges, from, node, type, name, tag) != 0)
+    return cd_error_str(kCDErrNoMem, "cd_edge_t");
 
-  QUEUE_INSERT_TAIL(&from->edges.outgoing, &edge->out);
-  QUEUE_INSERT_TAIL(&node->edges.incoming, &edge->in);
+  return cd_ok();
+}
 
-  state->edges.count++;
 
-done:
-  if (cd_hashmap_insert(&state->nodes.map,
-                        (const char*) node->obj,
-                        sizeof(node->obj),
-                        node) != 0) {
-    err = cd_error_str(kCDErrNoMem, "cd_hashmap_insert(nodes.map)");
-    goto fatal;
-  }
+int cd_edge_list_push(cd_edge_list_t* list,
+                      cd_node_t* from,
+                      cd_node_t* to,
+                      cd_edge_type_t type,
+                      int name,
+                      int tag) {
+  cd_edge_t* edge;
 
-  if (out != NULL)
-    *out = node;
+  if (list->count == list->size) {
+    int size;
+    cd_edge_t* tmp;
 
-  return cd_ok();
+    size = list->size == 0 ? kCDEdgesInitialSize : list->size * 2;
+    tmp = realloc(list->list, sizeof(*tmp) * size);
+    if (tmp == NULL)
+      return -1;
 
-fatal:
-  if (!existing)
-    free(node);
-  free(edge);
+    list->list = tmp;
+    list->size = size;
+  }
 
-  return err;
+  edge = &list->list[list->count++];
+  edge->from = from->index;
+  edge->to = to->index;
+  edge->type = type;
+  edge->name = name;
+  edge->tag = tag;
+
+  return 0;
 }
 
 
 cd_error_t cd_queue_range(cd_state_t* state,
                           cd_node_t* from,
                           char* start,
-                          char* end) {
+                          char* end,
+                          int index) {
+  void* ptrs[CD_QUEUE_RANGE_BATCH];
+  int names[CD_QUEUE_RANGE_BATCH];
   const char* cur;
+  int count;
   int i;
 
-  for (i = 0, cur = start; cur < end; cur += state->ptr_size, i++)
-    cd_queue_ptr(state,from, *(void**) cur, NULL, kCDEdgeElement, i, 0, NULL);
+  cur = start;
+  while (cur < end) {
+    /* Filter a batch of slots first, and start lookups of what is left */
+    for (count = 0;
+         count < CD_QUEUE_RANGE_BATCH && cur < end;
+         cur += state->ptr_size, index++) {
+      void* ptr;
+
+      ptr = *(void**) cur;
+      if (!V8_IS_HEAPOBJECT(ptr) ||
+          !CD_OBJ_MAY_HAVE(state->core, (intptr_t) V8_OBJ(ptr))) {
+        continue;
+      }
+
+      cd_ptrmap_prefetch(&state->nodes.map, (intptr_t) ptr);
+      ptrs[count] = ptr;
+      names[count] = index;
+      count++;
+    }
+
+    for (i = 0; i < count; i++) {
+      cd_queue_ptr(state,
+                   from,
+                   ptrs[i],
+                   NULL,
+                   kCDEdgeElement,
+                   names[i],
+                   0,
+                   NULL);
+    }
+  }
 
   return cd_ok();
 }
@@ -823,6 +1824,7 @@ cd_error_t cd_add_node(cd_state_t* state, cd_node_t* node) {
   void** ptr;
   int type;
   int name;
+  int unnamed;
 
   type = node->v8_type;
 
@@ -858,28 +1860,24 @@ cd_error_t cd_add_node(cd_state_t* state, cd_node_t* node) {
              type == T(JSBuiltinsObject, JS_BUILTINS_OBJECT) ||
              type == T(JSMessageObject, JS_MESSAGE_OBJECT) ||
              type == T(Map, MAP)) {
-    void* cons;
-    int ctype;
-
-    V8_CORE_PTR((type == T(Map, MAP) ? node->obj : node->map),
-                cd_v8_class_Map__constructor__Object,
-                ptr);
-    cons = *ptr;
+    cd_map_info_t* info;
+
+    /* Map's own constructor, and the one of the object's map otherwise */
+    if (type == T(Map, MAP)) {
+      err = cd_map_info_get(state,
+                            cd_visitor_arena(state, node),
+                            node->obj,
+                            &info);
+      if (!cd_is_ok(err))
+        return err;
+    } else {
+      info = node->info;
+    }
 
-    err = cd_v8_get_obj_type(state, cons, NULL, &ctype);
+    err = cd_map_info_name(state, info, &name);
     if (!cd_is_ok(err))
       return err;
 
-    if (ctype == T(JSFunction, JS_FUNCTION)) {
-      err = cd_v8_fn_info(state, cons, NULL, NULL, &name, NULL);
-    } else {
-      err = cd_strings_copy(&state->strings,
-                            NULL,
-                            &name,
-                            "Object",
-                            6);
-    }
-
     node->type = kCDNodeObject;
   } else if (type < cd_v8_FirstNonstringType) {
     int repr;
@@ -950,10 +1948,14 @@ cd_error_t cd_add_node(cd_state_t* state, cd_node_t* node) {
   if (!cd_is_ok(err))
     return err;
 
-  if (node->name == 0)
-    node->name = name;
-
-  QUEUE_INSERT_TAIL(&state->nodes.list, &node->member);
+  /* Keep the name given by cd_name() */
+  unnamed = 0;
+  __atomic_compare_exchange_n(&node->name,
+                              &unnamed,
+                              name,
+                              0,
+                              __ATOMIC_RELAXED,
+                              __ATOMIC_RELAXED);
 
   return cd_ok();
 }
@@ -5,11 +5,19 @@
 #include "error.h"
 #include "queue.h"
 
+#include <pthread.h>
+
 /* Forward declarations */
 struct cd_state_s;
 
 typedef struct cd_node_s cd_node_t;
 typedef struct cd_edge_s cd_edge_t;
+typedef struct cd_edge_list_s cd_edge_list_t;
+typedef struct cd_visitor_worker_s cd_visitor_worker_t;
+typedef struct cd_map_info_s cd_map_info_t;
+typedef struct cd_map_fields_s cd_map_fields_t;
+typedef struct cd_map_field_s cd_map_field_t;
+typedef struct cd_key_cache_s cd_key_cache_t;
 typedef enum cd_node_type_e cd_node_type_t;
 typedef enum cd_edge_type_e cd_edge_type_t;
 
@@ -44,30 +52,111 @@ struct cd_node_s {
   /* Raw V8 stuff right from the Heap */
   void* obj;
   void* map;
+  cd_map_info_t* info;
   int v8_type;
 
   cd_node_type_t type;
   int id;
   int name;
   int size;
+  int edge_count;
+
+  /* Order of creation, edges reference nodes by it */
+  int index;
+
+  /* Index of the worker that visits the node, or -1 */
+  int worker;
+  int failed;
+};
+
+/*
+ * Decoded Map, shared by all objects with it. Fields below `layout_err` are
+ * valid only if it is ok, `name` and `fields` are filled on the first use.
+ */
+struct cd_map_info_s {
+  int v8_type;
+
+  /* Instance size in bytes, zero if variable */
+  int size;
+
+  cd_error_t layout_err;
+  void* prototype;
+  void* constructor;
+  int fast_props;
+  cd_error_t elems_err;
+  int fast_elems;
+  int inobj;
+
+  /* Constructor's name, -1 if not known yet */
+  int name;
+
+  /* Field properties of fast-mode objects */
+  cd_map_fields_t* fields;
+};
+
+struct cd_map_field_s {
+  void* key;
+
+  /* Offset from the object's end, or -1 if the value is in the descriptor */
+  int off;
+  void* value;
+};
 
-  struct {
-    QUEUE incoming;
-    QUEUE outgoing;
-    int outgoing_count;
-  } edges;
+struct cd_map_fields_s {
+  int count;
+  cd_map_field_t list[1];
 };
 
+/*
+ * Direct-mapped property key => name, one table per thread. Keys are
+ * internalized strings, so the same address always gives the same name.
+ */
+struct cd_key_cache_s {
+  void* key;
+
+  /* Index in `strings`, or -1 for non-string keys */
+  int name;
+};
+
+/*
+ * `from` and `to` are node indexes during the traversal, cd_visit_roots()
+ * sorts edges by `from` and replaces both with node ids.
+ */
 struct cd_edge_s {
-  QUEUE in;
-  QUEUE out;
-
-  cd_edge_type_t type;
-  struct {
-    cd_node_t* from;
-    cd_node_t* to;
-  } key;
+  int from;
+  int to;
   int name;
+  uint8_t type;
+
+  /* Tagged duplicate overrides the name and the type of the first edge */
+  uint8_t tag;
+};
+
+/* Append-only, one per thread */
+struct cd_edge_list_s {
+  cd_edge_t* list;
+  int count;
+  int size;
+};
+
+struct cd_visitor_worker_s {
+  pthread_t thread;
+  struct cd_state_s* state;
+  int index;
+
+  /* Owner pops from the tail, other workers steal from the head */
+  pthread_mutex_t lock;
+  QUEUE queue;
+
+  /* Visited and failed nodes, merged after join */
+  QUEUE nodes;
+  QUEUE failed;
+
+  /* Nodes allocated by this worker, merged after join */
+  cd_arena_t arena;
+  cd_edge_list_t edges;
+
+  cd_key_cache_t* keys;
 };
 
 cd_error_t cd_visitor_init(struct cd_state_s* state);
@@ -75,6 +164,9 @@ void cd_visitor_destroy(struct cd_state_s* state);
 
 cd_error_t cd_visit_roots(struct cd_state_s* state);
 
+/* Build `edges.incoming` on demand, valid after cd_visit_roots() */
+cd_error_t cd_visitor_incoming(struct cd_state_s* state);
+
 cd_error_t cd_queue_ptr(struct cd_state_s* state,
                         cd_node_t* from,
                         void* ptr,